@@ -17,6 +17,7 @@
 #include <libxcvt/libxcvt.h>
 #include <X11/X.h>
 #include <X11/Xmd.h>
+#include <X11/Xatom.h>
 #include <sys/wait.h>
 #include <present.h>
 #include <sys/mman.h>
@@ -34,6 +35,8 @@
 #include "glxutil.h"
 #include "fbconfigs.h"
 #include "inpututils.h"
+#include "windowstr.h"
+#include "propertyst.h"
 #include "exa.h"
 #include "drm_fourcc.h"
 
@@ -44,21 +47,33 @@ extern void android_shmem_sysv_shm_force(uint8_t enable);
 #define unused __attribute__((unused))
 #define log(prio, ...) __android_log_print(ANDROID_LOG_ ## prio, "LorieNative", __VA_ARGS__)
 
-extern DeviceIntPtr lorieMouse, lorieKeyboard;
+extern DeviceIntPtr lorieMouse, lorieKeyboard, lorieTouch, loriePen, lorieEraser;
 
 #define CREATE_PIXMAP_USAGE_LORIEBUFFER_BACKED 5
+#define LORIE_FLIP_HISTORY_SIZE 16
+#define LORIE_BUFFER_POOL_MAX_AGE 10000
+#define LORIE_INPUT_MAX_FRAMES 4 // Frames input may stay without damage before it is not counted as its cause.
 
 struct vblank {
     struct xorg_list link;
     uint64_t id, msc;
 };
 
+// Remembers which clients present root-sized pixmaps so we can allocate them as shareable buffers from the start.
+typedef struct {
+    int client;
+    uint16_t width, height;
+    uint32_t flips;
+} LorieFlipHistory;
+
 static struct present_screen_info loriePresentInfo;
 static dri3_screen_info_rec lorieDri3Info;
 static ExaDriverRec lorieExa;
 
 typedef struct {
     DamagePtr damage;
+    uint64_t damageTime; // CLOCK_MONOTONIC time (ns) damage region became non-empty.
+    uint64_t inputTime; // CLOCK_MONOTONIC time (ns) of the oldest input event received before that.
     OsTimerPtr fpsTimer;
 
     SetWindowPixmapProcPtr SetWindowPixmap;
@@ -76,10 +91,20 @@ typedef struct {
     } root;
 
     Bool dri3;
+    Bool motionCoalescing;
+    Bool reprobeRenderer;
+    Bool profileRequests;
 
     uint64_t vblank_interval;
     struct xorg_list vblank_queue;
     uint64_t current_msc;
+
+    struct {
+        Bool pending;
+        uint64_t eventId, msc, serial;
+    } pendingFlip;
+
+    LorieFlipHistory flipHistory[LORIE_FLIP_HISTORY_SIZE];
 } lorieScreenInfo;
 
 ScreenPtr pScreenPtr;
@@ -90,6 +115,7 @@ static lorieScreenInfo lorieScreen = {
         .root.framerate = 30,
         .root.name = "screen",
         .dri3 = TRUE,
+        .motionCoalescing = TRUE,
         .vblank_queue = { &lorieScreen.vblank_queue, &lorieScreen.vblank_queue },
 }, *pvfb = &lorieScreen;
 static char *xstartup = NULL;
@@ -97,6 +123,7 @@ static char *xstartup = NULL;
 typedef struct {
     LorieBuffer *buffer;
     bool flipped, wasLocked, imported;
+    bool embedded; // allocated together with the buffer, freed with its last reference
     void *locked;
     void *mem;
 } LoriePixmapPriv;
@@ -130,12 +157,24 @@ void OsVendorInit(void) {
     pthread_condattr_init(&cond_attr);
     pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
     pthread_cond_init(&lorieScreen.state->cond, &cond_attr);
+
+    LorieBufferPool_setRetirementCounter(&lorieScreen.state->retiredBuffers);
 }
 
 void lorieActivityConnected(void) {
     pvfb->state->drawRequested = pvfb->state->cursor.updated = true;
+    // New renderer does not hold any of our buffers.
+    pvfb->state->retiredBuffers = 0;
+    LorieBufferPool_retireAll();
     lorieSendSharedServerState(pvfb->stateFd);
-    lorieRegisterBuffer(LORIE_BUFFER_FROM_PIXMAP(pScreenPtr->devPrivate));
+
+    // Register root window and currently flipped pixmap in one batch, so renderer can draw right away.
+    present_screen_priv_ptr presentPriv = present_screen_priv(pScreenPtr);
+    LorieBuffer* buffers[] = {
+            LORIE_BUFFER_FROM_PIXMAP(pScreenPtr->devPrivate),
+            presentPriv ? LORIE_BUFFER_FROM_PIXMAP(presentPriv->flip_pixmap) : NULL,
+    };
+    lorieRegisterBuffers(buffers, ARRAY_SIZE(buffers));
 }
 
 static LoriePixmapPriv* lorieRootWindowPixmapPriv(void) {
@@ -220,6 +259,8 @@ Bool drawSquares() {
 }
 
 void ddxReady(void) {
+    lorieStartupMark("ddxReady");
+    lorieRequestProfilerInit(pvfb->profileRequests);
     CursorVisible = TRUE;
     pScreenPtr->DisplayCursor(lorieMouse, pScreenPtr, rootCursor);
     if (NoListenAll)
@@ -253,8 +294,15 @@ void ddxUseMsg(void) {
     ErrorF("-xstartup \"command\"    start `command` after server startup\n");
     ErrorF("-legacy-drawing        use legacy drawing, without using AHardwareBuffers\n");
     ErrorF("-force-bgra            force flipping colours (RGBA->BGRA)\n");
+    ErrorF("-reprobe-renderer      test renderer capabilities again instead of using cached result\n");
+    ErrorF("-profile-requests      count requests and time spent handling them per opcode and client from the start\n");
     ErrorF("-disable-dri3          disabling DRI3 support (to let lavapipe work)\n");
     ErrorF("-force-sysvshm         force using SysV shm syscalls\n");
+    ErrorF("-buffer-pool-budget n  keep up to n MiB of released shareable buffers for reuse (0 disables pooling)\n");
+    ErrorF("-no-motion-coalescing  send every pointer, touch and stylus motion sample to clients instead of one per frame\n");
+    ErrorF("-input-resampling      resample touch and stylus positions to display frame time\n");
+    ErrorF("-resample-latency n    resample positions for n milliseconds before the frame (default 5, implies -input-resampling)\n");
+    ErrorF("-resample-max-prediction n  do not predict positions more than n milliseconds ahead (default 8, implies -input-resampling)\n");
     ErrorF("-check-drawing         run server only able to draw some test image (for testing if rendering root window works or not),\n");
 }
 
@@ -275,6 +323,16 @@ int ddxProcessArgument(unused int argc, unused char *argv[], unused int i) {
         return 1;
     }
 
+    if (strcmp(argv[i], "-reprobe-renderer") == 0) {
+        pvfb->reprobeRenderer = TRUE;
+        return 1;
+    }
+
+    if (strcmp(argv[i], "-profile-requests") == 0) {
+        pvfb->profileRequests = TRUE;
+        return 1;
+    }
+
     if (strcmp(argv[i], "-disable-dri3") == 0) {
         pvfb->dri3 = FALSE;
         return 1;
@@ -285,6 +343,36 @@ int ddxProcessArgument(unused int argc, unused char *argv[], unused int i) {
         return 1;
     }
 
+    if (strcmp(argv[i], "-buffer-pool-budget") == 0) {
+        CHECK_FOR_REQUIRED_ARGUMENTS(1);
+        LorieBufferPool_setBudget((size_t) max(atoi(argv[++i]), 0) * 1024 * 1024);
+        return 2;
+    }
+
+    if (strcmp(argv[i], "-no-motion-coalescing") == 0) {
+        pvfb->motionCoalescing = FALSE;
+        return 1;
+    }
+
+    if (strcmp(argv[i], "-input-resampling") == 0) {
+        lorieResampling.enabled = true;
+        return 1;
+    }
+
+    if (strcmp(argv[i], "-resample-latency") == 0) {
+        CHECK_FOR_REQUIRED_ARGUMENTS(1);
+        lorieResampling.enabled = true;
+        lorieResampling.latency = max(atoi(argv[++i]), 0);
+        return 2;
+    }
+
+    if (strcmp(argv[i], "-resample-max-prediction") == 0) {
+        CHECK_FOR_REQUIRED_ARGUMENTS(1);
+        lorieResampling.enabled = true;
+        lorieResampling.maxPrediction = max(atoi(argv[++i]), 0);
+        return 2;
+    }
+
     if (strcmp(argv[i], "-check-drawing") == 0) {
         NoListenAll = TRUE;
         QueueWorkProc(drawSquares, NULL, NULL);
@@ -395,26 +483,84 @@ static miPointerScreenFuncRec loriePointerCursorFuncs = {
 };
 
 static void loriePerformVblanks(void);
+static void lorieClientStateCallback(CallbackListPtr *list, void *closure, void *data);
 
-static Bool lorieRedraw(__unused ClientPtr pClient, __unused void *closure) {
+// Completes the last flip once renderer stopped sampling previous pixmap, or right away if renderer does not draw anything.
+static void lorieCompleteFlip(Bool force) {
+    if (!pvfb->pendingFlip.pending)
+        return;
+
+    if (!force && __atomic_load_n(&pvfb->state->flipSerialAcked, __ATOMIC_ACQUIRE) < pvfb->pendingFlip.serial)
+        return;
+
+    pvfb->pendingFlip.pending = FALSE;
+    lorieTraceInstant("flip complete", pvfb->pendingFlip.msc);
+    present_event_notify(pvfb->pendingFlip.eventId, GetTimeInMicros(), pvfb->pendingFlip.msc);
+}
+
+static Bool lorieRawEventsSelected(void) {
+    // Raw events are delivered only to root window, clients selecting them want every sample.
+    OtherInputMasks *masks = pScreenPtr && pScreenPtr->root ? wOtherInputMasks(pScreenPtr->root) : NULL;
+    DeviceIntPtr devices[] = { lorieMouse, lorieTouch, loriePen, lorieEraser };
+    if (!masks || !masks->xi2mask)
+        return FALSE;
+
+    for (int i = 0; i < ARRAY_SIZE(devices); i++) {
+        // Master is checked too, xi2mask_isset matches XIAllMasterDevices selection only for master devices.
+        DeviceIntPtr master = devices[i] ? GetMaster(devices[i], MASTER_POINTER) : NULL;
+        if (devices[i] && (xi2mask_isset(masks->xi2mask, devices[i], XI_RawMotion) || xi2mask_isset(masks->xi2mask, devices[i], XI_RawTouchUpdate)))
+            return TRUE;
+        if (master && (xi2mask_isset(masks->xi2mask, master, XI_RawMotion) || xi2mask_isset(masks->xi2mask, master, XI_RawTouchUpdate)))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static uint64_t pendingInputTime = 0; // Oldest input event which did not cause any damage yet.
+
+/*
+ * Input which did not cause damage for a few frames (pointer moving over empty desktop, key press ignored by client)
+ * is dropped, otherwise the first unrelated damage much later would be attributed to it.
+ * The same value surviving frame callbacks means nothing consumed it in between.
+ */
+static void lorieExpirePendingInput(void) {
+    static uint64_t seen = 0;
+    static int frames = 0;
+    uint64_t pending = __atomic_load_n(&pendingInputTime, __ATOMIC_RELAXED);
+
+    if (!pending || pending != seen) {
+        seen = pending;
+        frames = 0;
+    } else if (++frames >= LORIE_INPUT_MAX_FRAMES) {
+        __atomic_compare_exchange_n(&pendingInputTime, &pending, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        seen = 0;
+        frames = 0;
+    }
+}
+
+static void lorieRedrawRoot(void) {
     int status, nonEmpty;
     LoriePixmapPriv* priv;
     PixmapPtr root = pScreenPtr && pScreenPtr->root ? pScreenPtr->GetWindowPixmap(pScreenPtr->root) : NULL;
 
     pvfb->current_msc++;
+    lorieExpirePendingInput();
     loriePerformVblanks();
+    lorieCompleteFlip(!lorieConnectionAlive() || !pvfb->state->surfaceAvailable);
+    lorieSetMotionCoalescing(pvfb->motionCoalescing && !lorieRawEventsSelected());
 
     pvfb->state->waitForNextFrame = false;
 
     if (!lorieConnectionAlive() || !pvfb->state->surfaceAvailable)
-        return TRUE;
+        return;
 
     nonEmpty = RegionNotEmpty(DamageRegion(pvfb->damage));
     priv = root ? exaGetPixmapDriverPrivate(root) : NULL;
 
     if (!priv)
         // Impossible situation, but let's skip this step
-        return TRUE;
+        return;
 
     if (nonEmpty && priv->buffer) {
         // We should unlock and lock buffer in order to update texture content on some devices
@@ -431,6 +577,20 @@ static Bool lorieRedraw(__unused ClientPtr pClient, __unused void *closure) {
 
         DamageEmpty(pvfb->damage);
         pvfb->state->drawRequested = TRUE;
+
+        if (pvfb->damageTime) {
+            uint64_t damageTime = 0;
+            lorieHistogramRecord(&pvfb->state->metrics[LORIE_METRIC_DAMAGE_TO_REQUEST], lorieMonotonicNs() - pvfb->damageTime);
+            // Keep the older damage if renderer did not draw it yet.
+            __atomic_compare_exchange_n(&pvfb->state->damageTime, &damageTime, pvfb->damageTime, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            pvfb->damageTime = 0;
+        }
+
+        if (pvfb->inputTime) {
+            uint64_t inputTime = 0;
+            __atomic_compare_exchange_n(&pvfb->state->inputTime, &inputTime, pvfb->inputTime, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            pvfb->inputTime = 0;
+        }
     }
 
     if (pvfb->state->drawRequested || pvfb->state->cursor.moved || pvfb->state->cursor.updated) {
@@ -442,22 +602,118 @@ static Bool lorieRedraw(__unused ClientPtr pClient, __unused void *closure) {
         // Renderer thread will check the `drawRequested` flag right before going to sleep.
         pthread_cond_signal(&pvfb->state->cond);
     }
+}
 
+/*
+ * Called by input thread for every input event.
+ * The first damage after input is assumed to be caused by it, that is exactly what happens
+ * when client draws something in response to key press, and is close enough for statistics otherwise.
+ */
+void lorieNoteInput(void) {
+    uint64_t none = 0;
+    if (!__atomic_load_n(&pendingInputTime, __ATOMIC_RELAXED))
+        __atomic_compare_exchange_n(&pendingInputTime, &none, lorieMonotonicNs(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void lorieDamageReport(__unused DamagePtr damage, __unused RegionPtr region, __unused void *closure) {
+    // Called only when damage region becomes non-empty.
+    pvfb->damageTime = lorieMonotonicNs();
+    if (!pvfb->inputTime)
+        pvfb->inputTime = __atomic_exchange_n(&pendingInputTime, 0, __ATOMIC_RELAXED);
+}
+
+static Bool lorieRedraw(__unused ClientPtr pClient, __unused void *closure) {
+    lorieTraceBegin("lorieRedraw");
+    lorieRedrawRoot();
+    lorieTraceEnd("lorieRedraw");
     return TRUE;
 }
 
+static uint64_t lorieHistogramPercentile(const lorieHistogram* histogram, uint64_t count, int percentile) {
+    uint64_t rank = (count * percentile + 99) / 100, seen = 0;
+    for (int i = 0; i < LORIE_HISTOGRAM_BUCKETS - 1; i++)
+        if ((seen += histogram->buckets[i]) >= rank)
+            return min(lorieHistogramBucketStart(i + 1) - 1, histogram->maxUs);
+    return histogram->maxUs;
+}
+
+// Publishes frame latency percentiles of the last interval so they can be read with `xprop -root _TERMUX_X11_FRAME_METRICS`.
+static void loriePublishFrameMetrics(void) {
+    static const char* names[LORIE_METRIC_COUNT] = {
+        [LORIE_METRIC_DAMAGE_TO_REQUEST] = "damage-to-request",
+        [LORIE_METRIC_WAKE_TO_LOCK] = "wake-to-lock",
+        [LORIE_METRIC_LOCK_HOLD] = "lock-hold",
+        [LORIE_METRIC_UPLOAD] = "upload",
+        [LORIE_METRIC_SWAP] = "swap",
+        [LORIE_METRIC_DAMAGE_TO_PRESENT] = "damage-to-present",
+        [LORIE_METRIC_GPU_ROOT] = "gpu-root",
+        [LORIE_METRIC_GPU_CURSOR] = "gpu-cursor",
+        [LORIE_METRIC_INPUT_TO_PRESENT] = "input-to-present",
+    };
+    static const char property[] = "_TERMUX_X11_FRAME_METRICS";
+    static lorieHistogram published[LORIE_METRIC_COUNT]; // Totals at the previous update.
+    char text[2048]; // Enough for all metrics, every line is shorter than 160 characters.
+    int length = 0;
+
+    if (!pScreenPtr || !pScreenPtr->root)
+        return;
+
+    for (int i = 0; i < LORIE_METRIC_COUNT; i++) {
+        // Renderer may record samples right now, but a slightly inconsistent snapshot is fine for statistics.
+        lorieHistogram* shared = &pvfb->state->metrics[i], *previous = &published[i], histogram;
+        uint64_t count = __atomic_load_n(&shared->count, __ATOMIC_ACQUIRE);
+
+        // Only samples recorded since the previous update are shown, so old spikes do not stay in max and p99 forever.
+        if (count < previous->count)
+            memset(previous, 0, sizeof(*previous)); // Shared state was replaced.
+        histogram.count = count - previous->count;
+        histogram.sumUs = __atomic_load_n(&shared->sumUs, __ATOMIC_RELAXED) - previous->sumUs;
+        histogram.maxUs = __atomic_exchange_n(&shared->maxUs, 0, __ATOMIC_RELAXED);
+        previous->count = count;
+        previous->sumUs += histogram.sumUs;
+        for (int j = 0; j < LORIE_HISTOGRAM_BUCKETS; j++) {
+            histogram.buckets[j] = __atomic_load_n(&shared->buckets[j], __ATOMIC_RELAXED) - previous->buckets[j];
+            previous->buckets[j] += histogram.buckets[j];
+        }
+
+        count = histogram.count;
+        length += snprintf(text + length, sizeof(text) - length, "%s count=%llu", names[i], (unsigned long long) count);
+        if (count)
+            length += snprintf(text + length, sizeof(text) - length, " p50=%lluus p90=%lluus p99=%lluus avg=%lluus max=%lluus",
+                               (unsigned long long) lorieHistogramPercentile(&histogram, count, 50),
+                               (unsigned long long) lorieHistogramPercentile(&histogram, count, 90),
+                               (unsigned long long) lorieHistogramPercentile(&histogram, count, 99),
+                               (unsigned long long) (histogram.sumUs / count), (unsigned long long) histogram.maxUs);
+        length += snprintf(text + length, sizeof(text) - length, "\n");
+    }
+
+    dixChangeWindowProperty(serverClient, pScreenPtr->root, MakeAtom(property, sizeof(property) - 1, TRUE),
+                            XA_STRING, 8, PropModeReplace, length, text, TRUE);
+}
+
 static CARD32 lorieFramecounter(unused OsTimerPtr timer, unused CARD32 time, unused void *arg) {
-    if (pvfb->state->renderedFrames)
+    LorieBufferPool_Stats stats;
+    if (pvfb->state->renderedFrames) {
         log(INFO, "%d frames in 5.0 seconds = %.1f FPS",
             pvfb->state->renderedFrames, ((float) pvfb->state->renderedFrames) / 5);
+        loriePublishFrameMetrics();
+    }
     pvfb->state->renderedFrames = 0;
+
+    LorieBufferPool_trim(LORIE_BUFFER_POOL_MAX_AGE);
+    LorieBufferPool_getStats(&stats, TRUE);
+    if (stats.allocations)
+        log(INFO, "%llu shareable buffer allocations in 5.0 seconds (%llu reused), avg %.3f ms, max %.3f ms, %zu buffers (%zu KiB) pooled",
+            (unsigned long long) stats.allocations, (unsigned long long) stats.hits,
+            stats.allocationTimeNs / 1000000.0 / stats.allocations, stats.maxAllocationTimeNs / 1000000.0,
+            stats.pooledBuffers, stats.pooledBytes / 1024);
     return 5000;
 }
 
 static Bool lorieCreateScreenResources(ScreenPtr pScreen) {
     pScreen->devPrivate = pScreen->CreatePixmap(pScreen, pScreen->width, pScreen->height, pScreen->rootDepth, CREATE_PIXMAP_USAGE_LORIEBUFFER_BACKED);
 
-    pvfb->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen, NULL);
+    pvfb->damage = DamageCreate(lorieDamageReport, NULL, DamageReportNonEmpty, TRUE, pScreen, NULL);
     if (!pvfb->damage)
         FatalError("Couldn't setup damage\n");
 
@@ -537,7 +793,7 @@ static Bool lorieRRScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
         DamageDestroy(pvfb->damage);
     }
 
-    pvfb->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen, NULL);
+    pvfb->damage = DamageCreate(lorieDamageReport, NULL, DamageReportNonEmpty, TRUE, pScreen, NULL);
     if (!pvfb->damage)
         FatalError("Couldn't setup damage\n");
 
@@ -620,9 +876,12 @@ static void lorieWorkingQueueCallback(int fd, int __unused ready, void __unused
     eventfd_read(fd, &dummy);
 }
 
-void lorieChoreographerFrameCallback(__unused long t, AChoreographer* d) {
+void lorieChoreographerFrameCallback(long t, AChoreographer* d) {
     AChoreographer_postFrameCallback(d, (AChoreographer_frameCallback) lorieChoreographerFrameCallback, d);
     if (pScreenPtr) {
+        // Vsync is the boundary of motion coalescing.
+        // Frame time is nanoseconds of CLOCK_MONOTONIC, but it does not fit long on 32-bit platforms.
+        lorieFlushMotion(sizeof(t) >= sizeof(int64_t) ? (CARD32) (t / 1000000) : GetTimeInMillis());
         QueueWorkProc(lorieRedraw, NULL, NULL);
         lorieWakeServer();
     }
@@ -666,6 +925,12 @@ static Bool lorieScreenInit(ScreenPtr pScreen, unused int argc, unused char **ar
     ShmRegisterFbFuncs(pScreen);
     miSyncShmScreenInit(pScreen);
 
+    memset(pvfb->flipHistory, 0, sizeof(pvfb->flipHistory));
+    AddCallback(&ClientStateCallback, lorieClientStateCallback, NULL);
+
+    if (!lorieXvInit(pScreen))
+        log(ERROR, "Failed to initialize XVideo adaptor");
+
     return TRUE;
 }                               /* end lorieScreenInit */
 
@@ -704,6 +969,7 @@ void InitOutput(ScreenInfo * screen_info, int argc, char **argv) {
     int bpp[] =    { 1, 8, 8, 16, 16, 32, 32 };
     int i;
 
+    lorieStartupMark("InitOutput");
     if (monitorResolution == 0)
         monitorResolution = 96;
 
@@ -719,7 +985,8 @@ void InitOutput(ScreenInfo * screen_info, int argc, char **argv) {
     screen_info->bitmapBitOrder = BITMAP_BIT_ORDER;
     screen_info->numPixmapFormats = ARRAY_SIZE(depths);
 
-    rendererTestCapabilities(&pvfb->root.legacyDrawing, &pvfb->root.flip);
+    rendererTestCapabilities(&pvfb->root.legacyDrawing, &pvfb->root.flip, pvfb->reprobeRenderer);
+    lorieStartupMark("rendererTestCapabilities");
     xorgGlxCreateVendor();
     lorieInitClipboard();
 
@@ -770,6 +1037,7 @@ static void loriePerformVblanks(void) {
     struct vblank *vblank, *tmp;
     xorg_list_for_each_entry_safe(vblank, tmp, &pvfb->vblank_queue, link) {
         if (vblank->msc <= pvfb->current_msc) {
+            lorieTraceInstant("vblank", vblank->msc);
             present_event_notify(vblank->id, GetTimeInMicros(), pvfb->current_msc);
             xorg_list_del(&vblank->link);
             free (vblank);
@@ -777,11 +1045,65 @@ static void loriePerformVblanks(void) {
     }
 }
 
+static LorieFlipHistory* lorieFindFlipHistory(int client, int width, int height) {
+    for (int i = 0; i < LORIE_FLIP_HISTORY_SIZE; i++) {
+        LorieFlipHistory *h = &pvfb->flipHistory[i];
+        if (h->flips && h->client == client && h->width == width && h->height == height)
+            return h;
+    }
+
+    return NULL;
+}
+
+static void lorieRecordFlip(PixmapPtr pixmap) {
+    int client = CLIENT_ID(pixmap->drawable.id);
+    LorieFlipHistory *h = lorieFindFlipHistory(client, pixmap->drawable.width, pixmap->drawable.height);
+    if (!h) {
+        // Replace the least used entry.
+        h = &pvfb->flipHistory[0];
+        for (int i = 1; i < LORIE_FLIP_HISTORY_SIZE; i++)
+            if (pvfb->flipHistory[i].flips < h->flips)
+                h = &pvfb->flipHistory[i];
+        *h = (LorieFlipHistory) { .client = client, .width = pixmap->drawable.width, .height = pixmap->drawable.height };
+    }
+
+    if (h->flips < UINT32_MAX)
+        h->flips++;
+}
+
+static Bool lorieFlipPredicted(int width, int height, int depth, int usage_hint) {
+    ClientPtr client;
+    // Only plain client pixmaps of root window size can be flipped.
+    if (usage_hint != 0 || (depth != 24 && depth != 32) || width != pvfb->root.width || height != pvfb->root.height)
+        return FALSE;
+
+    client = GetCurrentClient();
+    return client && lorieFindFlipHistory(client->index, width, height) != NULL;
+}
+
+static void lorieClientStateCallback(unused CallbackListPtr *list, unused void *closure, void *data) {
+    ClientPtr client = ((NewClientInfoRec *) data)->client;
+    if (client->clientState == ClientStateRunning) {
+        lorieStartupMark("first client connected");
+        lorieStartupFinish("X server");
+    }
+
+    if (client->clientState != ClientStateGone)
+        return;
+
+    // Client index will be reused by other client, so we should forget about this one.
+    for (int i = 0; i < LORIE_FLIP_HISTORY_SIZE; i++)
+        if (pvfb->flipHistory[i].client == client->index)
+            pvfb->flipHistory[i] = (LorieFlipHistory) {0};
+}
+
 Bool loriePresentFlip(__unused RRCrtcPtr crtc, __unused uint64_t event_id, __unused uint64_t target_msc, PixmapPtr pixmap, __unused Bool sync_flip) {
     LoriePixmapPriv* priv = (LoriePixmapPriv*) exaGetPixmapDriverPrivate(pixmap);
-    if (!priv || !priv->buffer || priv->mem || pvfb->root.width != pixmap->drawable.width || pvfb->root.width != pixmap->drawable.height)
+    if (!priv || !priv->buffer || priv->mem || pvfb->root.width != pixmap->drawable.width || pvfb->root.height != pixmap->drawable.height)
         return FALSE;
 
+    lorieRecordFlip(pixmap);
+
     const LorieBuffer_Desc *desc = LorieBuffer_description(priv->buffer);
     char *forceFlip = getenv("TERMUX_X11_FORCE_FLIP");
     if (desc->type == LORIEBUFFER_FD && priv->imported && !(forceFlip && strcmp(forceFlip, "1") == 0))
@@ -802,21 +1124,46 @@ Bool loriePresentFlip(__unused RRCrtcPtr crtc, __unused uint64_t event_id, __unu
     if (desc->type != LORIEBUFFER_FD && desc->type != LORIEBUFFER_AHARDWAREBUFFER)
         return FALSE;
 
-    dprintf(2, "flip! pixmap %dx%d screen %dx%d\n", pixmap->drawable.width, pixmap->drawable.height, pvfb->root.width, pvfb->root.height);
+    lorieTraceInstant("flip", desc->id);
 
     lorieRegisterBuffer(priv->buffer);
     return TRUE;
 }
 
-void loriePresentAfterFlip(__unused RRCrtcPtr crtc, uint64_t event_id, uint64_t ust, uint64_t target_msc, __unused PixmapPtr pixmap) {
+void loriePresentAfterFlip(__unused RRCrtcPtr crtc, uint64_t event_id, __unused uint64_t ust, uint64_t target_msc, PixmapPtr pixmap) {
     // X server was patched to call this function right after finishing all present_flip shenanigans
     // Since we do not invoke DRM API or anything similar we do not need to implement this as callback
-    // For some reason calling present_event_notify in BlockHandler or as QueueWorkProc/eventfd callback
-    // adds some delay which may be easily avoided this way.
     static BoxRec box = { 0, 0, 1, 1 }; // lorieRedraw only checks if it is empty or not.
+    LorieBuffer* buffer = LORIE_BUFFER_FROM_PIXMAP(pixmap);
+    uint64_t none = 0;
     RegionReset(DamageRegion(pvfb->damage), &box);
+
+    // Flip can not be pending here since Present does not flip again before previous flip is complete, but let's be safe.
+    lorieCompleteFlip(TRUE);
     pvfb->current_msc = min(pvfb->current_msc + 1, target_msc);
-    present_event_notify(event_id, ust, pvfb->current_msc);
+    lorieTraceInstant("flip vblank", pvfb->current_msc);
+
+    // present_event_notify makes previously flipped pixmap idle and triggers its idle fence,
+    // so client is free to render to it right after this call.
+    // We do not take the lock here, renderer may hold it for the whole frame. Instead we publish new texture ID
+    // and complete the flip in lorieRedraw after renderer acknowledged it will not sample previous pixmap anymore.
+    if (!buffer || !lorieConnectionAlive() || !pvfb->state->surfaceAvailable) {
+        present_event_notify(event_id, GetTimeInMicros(), pvfb->current_msc);
+        return;
+    }
+
+    pvfb->state->rootWindowTextureID = LorieBuffer_description(buffer)->id;
+    pvfb->pendingFlip.pending = TRUE;
+    pvfb->pendingFlip.eventId = event_id;
+    pvfb->pendingFlip.msc = pvfb->current_msc;
+    pvfb->pendingFlip.serial = __atomic_add_fetch(&pvfb->state->flipSerial, 1, __ATOMIC_RELEASE);
+    pvfb->state->drawRequested = TRUE;
+    // Flipped pixmap is complete frame, the flip is its damage.
+    __atomic_compare_exchange_n(&pvfb->state->damageTime, &none, lorieMonotonicNs(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    none = 0;
+    __atomic_compare_exchange_n(&pvfb->state->inputTime, &none, __atomic_exchange_n(&pendingInputTime, 0, __ATOMIC_RELAXED),
+                                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pvfb->state->cond);
 }
 
 void loriePresentUnflip(__unused ScreenPtr screen, uint64_t event_id) {
@@ -839,41 +1186,55 @@ static struct present_screen_info loriePresentInfo = {
 
 void exaDDXDriverInit(__unused ScreenPtr pScreen) {}
 
-void *lorieCreatePixmap(__unused ScreenPtr pScreen, int width, int height, __unused int depth, int usage_hint, __unused int bpp, int *new_fb_pitch) {
-    LoriePixmapPriv *priv;
-    size_t size = sizeof(LoriePixmapPriv);
+void *lorieCreatePixmap(__unused ScreenPtr pScreen, int width, int height, int depth, int usage_hint, __unused int bpp, int *new_fb_pitch) {
+    LoriePixmapPriv *priv = NULL;
+    LorieBuffer *buffer = NULL;
     *new_fb_pitch = 0;
 
-    priv = calloc(1, size);
-    if (!priv)
-        return NULL;
-
     if (width == 0 || height == 0)
-        return priv;
+        return calloc(1, sizeof(LoriePixmapPriv));
 
-    uint8_t type = usage_hint != CREATE_PIXMAP_USAGE_LORIEBUFFER_BACKED ? LORIEBUFFER_REGULAR : pvfb->root.legacyDrawing ? LORIEBUFFER_FD : LORIEBUFFER_AHARDWAREBUFFER;
+    // Pixmaps which are likely to be presented are allocated as shareable to avoid LorieBuffer_convert in the flip path.
+    Bool shareable = usage_hint == CREATE_PIXMAP_USAGE_LORIEBUFFER_BACKED || lorieFlipPredicted(width, height, depth, usage_hint);
     uint8_t format = pvfb->root.flip ? AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM : AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM;
-    priv->buffer = LorieBuffer_allocate(width, height, format, type);
-    *new_fb_pitch = LorieBuffer_description(priv->buffer)->stride * 4;
+    if (shareable) {
+        buffer = LorieBuffer_allocate(width, height, format, pvfb->root.legacyDrawing ? LORIEBUFFER_FD : LORIEBUFFER_AHARDWAREBUFFER);
+        if (buffer && !(priv = calloc(1, sizeof(LoriePixmapPriv)))) {
+            LorieBuffer_release(buffer);
+            return NULL;
+        }
+    }
 
-    LorieBuffer_lock(priv->buffer, &priv->locked);
-    if (!priv->buffer) {
-        free(priv);
-        return NULL;
+    if (!buffer && usage_hint != CREATE_PIXMAP_USAGE_LORIEBUFFER_BACKED) {
+        // Regular pixmaps are allocated in one piece with their private, small ones come from slab allocator.
+        buffer = LorieBuffer_allocateRegular(width, height, format, sizeof(LoriePixmapPriv), (void**) &priv);
+        if (priv)
+            priv->embedded = TRUE;
     }
 
+    if (!buffer)
+        return NULL;
+
+    priv->buffer = buffer;
+    *new_fb_pitch = LorieBuffer_description(buffer)->stride * 4;
+    LorieBuffer_lock(buffer, &priv->locked);
     return priv;
 }
 
 void lorieExaDestroyPixmap(__unused ScreenPtr pScreen, void *driverPriv) {
     LoriePixmapPriv *priv = driverPriv;
-    if (priv->buffer) {
+    LorieBuffer *buffer = priv->buffer;
+    if (buffer) {
         if (priv->locked)
-            LorieBuffer_unlock(priv->buffer);
-        LorieBuffer_release(priv->buffer);
-        lorieUnregisterBuffer(priv->buffer);
+            LorieBuffer_unlock(buffer);
+        // Buffer must be unregistered before release, its storage may be pooled and reused right away.
+        lorieUnregisterBuffer(buffer);
     }
-    free(priv);
+
+    // Embedded private is freed together with the buffer.
+    if (!priv->embedded)
+        free(priv);
+    LorieBuffer_release(buffer);
 }
 
 Bool lorieModifyPixmapHeader(PixmapPtr pPix, __unused int w, __unused int h, __unused int depth, __unused int bitsPerbppPixel, __unused int devKind, __unused void *data) {
@@ -42,6 +42,8 @@
 #include <X11/keysym.h>
 #include <selection.h>
 
+#include "filecache.h"
+
 #ifndef KEYBOARD_OR_FLOAT
 #define KEYBOARD_OR_FLOAT MASTER_KEYBOARD
 #endif
@@ -54,25 +56,29 @@ static const KeyCode fakeKeys[] = {
     92, 203, 204, 205, 206, 207
 };
 
-typedef struct
-{
-    KeySym keysym;
-    KeyCode keycode;
-    struct xorg_list entry;
-} AddedKeySym;
-
 /*
  * If a KeySym recieved from client is not mapped to any KeyCode, it needs to be
  * mapped to an unused KeyCode to generate required key events.
  *
- * This list tracks such assignments. A KeyCode from this list can be reused if
- * we run out of unused KeyCodes.
- *
- * Items in this list are maintained in LRU order, with most recently used key
- * in front.
+ * KeyCodes unused by the layout are reserved as a block of scratch keys for such
+ * assignments. Scratch keys are maintained in LRU order, with most recently used
+ * key in front, and the least recently used one is reassigned when the block is
+ * exhausted. Entries are indexed by KeyCode and hashed by KeySym, so marking key
+ * as used and looking up assigned keysym do not walk the list.
  */
-static struct xorg_list addedKeysyms = { &addedKeysyms, &addedKeysyms };
+typedef struct
+{
+    KeySym keysym; /* NoSymbol if key is not assigned yet */
+    KeyCode next; /* next key in the same hash bucket */
+    struct xorg_list entry;
+} ScratchKey;
 
+#define SCRATCH_HASH_SIZE 256
+
+static ScratchKey scratchKeys[256];
+static KeyCode scratchHash[SCRATCH_HASH_SIZE];
+static struct xorg_list scratchLRU = { &scratchLRU, &scratchLRU };
+static int scratchCount = 0;
 
 static KeySym pressedKeys[256] = {0};
 
@@ -126,6 +132,7 @@ static struct altKeysym_t {
 };
 
 void lorieKeysymKeyboardEvent(KeySym keysym, int down);
+void lorieMapKeysyms(const KeySym *keysyms, int count);
 KeyCode lorieKeysymToKeycode(KeySym keysym, unsigned state, unsigned *new_state);
 
 /* Stolen from libX11 */
@@ -479,63 +486,172 @@ static size_t lorieReleaseLevelThree(KeyCode *keys, size_t maxKeys) {
 	return count;
 }
 
-KeyCode lorieKeysymToKeycode(KeySym keysym, unsigned state, unsigned *new_state) {
+/*
+ * Reverse index from KeySym to KeyCode for a given keyboard state.
+ *
+ * Looking up keysym by translating every keycode costs a few hundred
+ * XkbTranslateKeyCode() calls, and lorieKeysymToKeycode() repeats it for
+ * up to three more states when keysym needs Shift or Level 3. Instead we
+ * translate every keycode once per state and keep the result in a small
+ * hash table.
+ *
+ * Keymap may be changed in place by many paths (XKB requests, core
+ * ChangeKeyboardMapping and SetModifierMapping, master device switching
+ * slaves, lorie's own keysym assignment), so indexes remember fingerprint
+ * of the parts of keymap XkbTranslateKeyCode() depends on. All of these
+ * happen between our input events or when we assign keysyms ourselves, so
+ * fingerprint is computed once after input queue was processed and after
+ * every assignment, not on every lookup.
+ */
+#define KEYSYM_INDEX_SIZE 512 /* power of 2, at least twice the number of keycodes */
+#define KEYSYM_INDEX_COUNT 8  /* states cached at once */
+
+typedef struct {
+	KeySym keysym;
+	KeyCode keycode; /* 0 for empty slot */
+	Bool fake;
+} KeysymIndexSlot;
+
+typedef struct {
 	XkbDescPtr xkb;
+	uint64_t fingerprint;
+	unsigned state, lastUsed;
+	KeysymIndexSlot slots[KEYSYM_INDEX_SIZE];
+} KeysymIndex;
+
+static KeysymIndex keysymIndexes[KEYSYM_INDEX_COUNT];
+static unsigned keysymIndexClock = 0;
+static Bool keymapFingerprintValid = FALSE;
+static uint64_t keymapFingerprint = 0;
+
+static uint64_t lorieKeymapFingerprint(XkbDescPtr xkb) {
+	XkbClientMapPtr map = xkb->map;
+	uint64_t hash = LORIE_CACHE_HASH_INIT;
+	int i, j;
+
+	if (!map || !map->key_sym_map || !map->syms || !map->types)
+		return 0;
+
+	hash = lorieCacheHash(hash, &xkb->min_key_code, sizeof(xkb->min_key_code));
+	hash = lorieCacheHash(hash, &xkb->max_key_code, sizeof(xkb->max_key_code));
+	hash = lorieCacheHash(hash, &map->key_sym_map[xkb->min_key_code],
+			(xkb->max_key_code - xkb->min_key_code + 1) * sizeof(*map->key_sym_map));
+	hash = lorieCacheHash(hash, map->syms, map->num_syms * sizeof(*map->syms));
+
+	/* Fields one by one, structures have padding */
+	for (i = 0; i < map->num_types; i++) {
+		XkbKeyTypePtr type = &map->types[i];
+		hash = lorieCacheHash(hash, (unsigned char[]) { type->mods.mask, type->num_levels, type->map_count }, 3);
+		for (j = 0; j < type->map_count; j++)
+			hash = lorieCacheHash(hash, (unsigned char[]) { type->map[j].active, type->map[j].level, type->map[j].mods.mask }, 3);
+	}
+
+	return hash;
+}
+
+/* Called after anything which may have changed the keymap */
+static void lorieKeymapChanged(void) {
+	keymapFingerprintValid = FALSE;
+}
+
+static inline KeysymIndexSlot *lorieKeysymIndexSlot(KeysymIndex *index, KeySym keysym) {
+	unsigned int i = (unsigned int) ((keysym * 2654435761u) & (KEYSYM_INDEX_SIZE - 1));
+
+	/* Table is never more than half full, so there is always an empty slot */
+	while (index->slots[i].keycode != 0 && index->slots[i].keysym != keysym)
+		i = (i + 1) & (KEYSYM_INDEX_SIZE - 1);
+
+	return &index->slots[i];
+}
+
+static void lorieBuildKeysymIndex(KeysymIndex *index, XkbDescPtr xkb, uint64_t fingerprint, unsigned state) {
 	unsigned int key; // KeyCode has insufficient range for the loop
-	KeyCode fallback;
-	KeySym ks;
-	unsigned level_three_mask;
 
-	if (new_state != NULL)
-		*new_state = state;
+	memset(index->slots, 0, sizeof(index->slots));
+	index->xkb = xkb;
+	index->fingerprint = fingerprint;
+	index->state = state;
 
-	fallback = 0;
-	xkb = GetMaster(lorieKeyboard, KEYBOARD_OR_FLOAT)->key->xkbInfo->desc;
 	for (key = xkb->min_key_code; key <= xkb->max_key_code; key++) {
 		unsigned int state_out;
-		KeySym dummy;
+		KeySym ks, dummy;
+		KeysymIndexSlot *slot;
 		size_t fakeIdx;
+		Bool fake;
 
 		XkbTranslateKeyCode(xkb, key, state, &state_out, &ks);
 		if (ks == NoSymbol)
 			continue;
 
-		/*
-		 * Despite every known piece of documentation on
-		 * XkbTranslateKeyCode() stating that mods_rtrn returns
-		 * the unconsumed modifiers, in reality it always
-		 * returns the _potentially consumed_ modifiers.
-		 */
+		/* See lorieKeysymToKeycode() for the explanation */
 		state_out = state & ~state_out;
 		if (state_out & LockMask)
 			XkbConvertCase(ks, &dummy, &ks);
 
-		if (ks != keysym)
-			continue;
+		for (fakeIdx = 0; fakeIdx < ARRAY_SIZE(fakeKeys); fakeIdx++)
+			if (key == fakeKeys[fakeIdx])
+				break;
+		fake = fakeIdx < ARRAY_SIZE(fakeKeys);
 
 		/*
-		 * Some keys are never sent by a real keyboard and are
-		 * used in the default layouts as a fallback for
-		 * modifiers. Make sure we use them last as some
-		 * applications can be confused by these normally
-		 * unused keys.
+		 * The lowest keycode wins, but keys from fakeKeys are only
+		 * used if there is no other key producing the keysym.
 		 */
-		for (fakeIdx = 0; fakeIdx < ARRAY_SIZE(fakeKeys); fakeIdx++) {
-			if (key == fakeKeys[fakeIdx]) {
-				if (fallback == 0)
-					fallback = key;
-				break;
-			}
-		}
-		if (fakeIdx < ARRAY_SIZE(fakeKeys))
+		slot = lorieKeysymIndexSlot(index, ks);
+		if (slot->keycode != 0 && (!slot->fake || fake))
 			continue;
 
-		return key;
+		slot->keysym = ks;
+		slot->keycode = key;
+		slot->fake = fake;
+	}
+}
+
+static KeyCode lorieKeysymIndexLookup(XkbDescPtr xkb, unsigned state, KeySym keysym) {
+	KeysymIndex *index = &keysymIndexes[0];
+	uint64_t fingerprint;
+	int i;
+
+	if (!keymapFingerprintValid) {
+		keymapFingerprint = lorieKeymapFingerprint(xkb);
+		keymapFingerprintValid = TRUE;
+	}
+	fingerprint = keymapFingerprint;
+
+	for (i = 0; i < KEYSYM_INDEX_COUNT; i++) {
+		KeysymIndex *it = &keysymIndexes[i];
+		Bool valid = it->xkb == xkb && it->fingerprint == fingerprint;
+		if (valid && it->state == state) {
+			index = it;
+			break;
+		}
+
+		/* Otherwise reuse stale or least recently used index */
+		if (!valid)
+			it->lastUsed = 0;
+		if (it->lastUsed < index->lastUsed)
+			index = it;
 	}
 
-	/* Use the fallback key, if one was found */
-	if (fallback != 0)
-		return fallback;
+	if (i == KEYSYM_INDEX_COUNT)
+		lorieBuildKeysymIndex(index, xkb, fingerprint, state);
+
+	index->lastUsed = ++keysymIndexClock;
+	return lorieKeysymIndexSlot(index, keysym)->keycode;
+}
+
+KeyCode lorieKeysymToKeycode(KeySym keysym, unsigned state, unsigned *new_state) {
+	XkbDescPtr xkb;
+	KeyCode key;
+	unsigned level_three_mask;
+
+	if (new_state != NULL)
+		*new_state = state;
+
+	xkb = GetMaster(lorieKeyboard, KEYBOARD_OR_FLOAT)->key->xkbInfo->desc;
+	key = lorieKeysymIndexLookup(xkb, state, keysym);
+	if (key != 0)
+		return key;
 
 	if (new_state == NULL)
 		return 0;
@@ -609,98 +725,159 @@ static int lorieIsAffectedByNumLock(KeyCode keycode) {
 	return 1;
 }
 
-static void saveAddedKeysym(KeyCode code, KeySym sym)
+static inline KeyCode *scratchBucket(KeySym keysym)
 {
-    AddedKeySym* item;
+    return &scratchHash[((uint32_t) keysym * 2654435761u) >> 24 & (SCRATCH_HASH_SIZE - 1)];
+}
+
+static void scratchUnhash(KeyCode key)
+{
+    KeyCode *it;
 
-    item = malloc(sizeof(AddedKeySym));
-    if (!item)
+    if (scratchKeys[key].keysym == NoSymbol)
         return;
 
-    item->keycode = code;
-    item->keysym = sym;
-    xorg_list_add(&item->entry, &addedKeysyms);
+    for (it = scratchBucket(scratchKeys[key].keysym); *it; it = &scratchKeys[*it].next) {
+        if (*it == key) {
+            *it = scratchKeys[key].next;
+            break;
+        }
+    }
+
+    scratchKeys[key].keysym = NoSymbol;
+    scratchKeys[key].next = 0;
+}
+
+static void scratchSetKeysym(KeyCode key, KeySym keysym)
+{
+    KeyCode *bucket = scratchBucket(keysym);
+
+    scratchUnhash(key);
+    scratchKeys[key].keysym = keysym;
+    scratchKeys[key].next = *bucket;
+    *bucket = key;
 }
 
 /*
- * Keeps the list in LRU order by moving the used key to front of the list.
+ * Returns scratch key the keysym is assigned to, or 0.
  */
-void vncOnKeyUsed(KeyCode usedKeycode)
+static KeyCode scratchFind(KeySym keysym)
 {
-    AddedKeySym* it;
+    KeyCode key;
 
-    if (xorg_list_is_empty(&addedKeysyms))
-        return;
+    for (key = *scratchBucket(keysym); key; key = scratchKeys[key].next)
+        if (scratchKeys[key].keysym == keysym)
+            return key;
 
-    it = xorg_list_first_entry(&addedKeysyms, AddedKeySym, entry);
-    if (it->keycode == usedKeycode)
-        return;
+    return 0;
+}
 
-    xorg_list_for_each_entry(it, &addedKeysyms, entry) {
-        if (it->keycode == usedKeycode) {
-            xorg_list_del(&it->entry);
-            xorg_list_add(&it->entry, &addedKeysyms);
-            break;
-        }
+static Bool isScratchKey(KeyCode key)
+{
+    return scratchKeys[key].entry.next && !xorg_list_is_empty(&scratchKeys[key].entry);
+}
+
+/*
+ * Reserves every KeyCode the layout does not use. Keys are appended
+ * to the tail of the list, so they are used before reassigning any
+ * previously assigned key.
+ */
+static void reserveScratchKeys(XkbDescPtr xkb)
+{
+    unsigned int key; // KeyCode has insufficient range for the loop
+
+    for (key = xkb->min_key_code; key <= xkb->max_key_code; key++) {
+        if (XkbKeyNumGroups(xkb, key) != 0 || isScratchKey(key))
+            continue;
+
+        scratchUnhash(key);
+        xorg_list_append(&scratchKeys[key].entry, &scratchLRU);
+        scratchCount++;
     }
 }
 
+static void releaseScratchKey(KeyCode key)
+{
+    scratchUnhash(key);
+    xorg_list_del(&scratchKeys[key].entry);
+    scratchCount--;
+}
+
+/*
+ * Keeps the list in LRU order by moving the used key to front of the list.
+ */
+void vncOnKeyUsed(KeyCode usedKeycode)
+{
+    if (!isScratchKey(usedKeycode))
+        return;
+
+    xorg_list_del(&scratchKeys[usedKeycode].entry);
+    xorg_list_add(&scratchKeys[usedKeycode].entry, &scratchLRU);
+}
+
 /*
- * Returns keycode of oldest item from list of manually added keysyms.
- * The item is removed from the list.
+ * Returns keycode of the least recently used scratch key and moves it to front.
  * Returns 0 if no usable keycode is found.
  */
-static KeyCode getReusableKeycode(XkbDescPtr xkb)
+static KeyCode takeScratchKey(XkbDescPtr xkb)
 {
-    AddedKeySym* last;
-    KeyCode result;
+    ScratchKey* last;
+    KeyCode key;
 
-    result = 0;
-    while (result == 0 && !xorg_list_is_empty(&addedKeysyms)) {
-        last = xorg_list_last_entry(&addedKeysyms, AddedKeySym, entry);
+    if (xorg_list_is_empty(&scratchLRU))
+        reserveScratchKeys(xkb);
+
+    while (!xorg_list_is_empty(&scratchLRU)) {
+        last = xorg_list_last_entry(&scratchLRU, ScratchKey, entry);
+        key = last - scratchKeys;
 
         // Make sure someone else hasn't modified the key
-        if (XkbKeyNumGroups(xkb, last->keycode) > 0 &&
-            XkbKeySymsPtr(xkb, last->keycode)[0] == last->keysym &&
-            (xkb->names == NULL || xkb->names->keys[last->keycode].name[0] == 'T'))
-            result = last->keycode;
+        if (last->keysym == NoSymbol ? XkbKeyNumGroups(xkb, key) == 0 :
+            (XkbKeyNumGroups(xkb, key) > 0 &&
+             XkbKeySymsPtr(xkb, key)[0] == last->keysym &&
+             (xkb->names == NULL || xkb->names->keys[key].name[0] == 'T'))) {
+            vncOnKeyUsed(key);
+            return key;
+        }
 
-        xorg_list_del(&last->entry);
-        free(last);
+        releaseScratchKey(key);
     }
-    return result;
+
+    return 0;
 }
 
-static KeyCode lorieAddKeysym(KeySym keysym, unused unsigned state) {
-	DeviceIntPtr master;
-	XkbDescPtr xkb;
-	unsigned int key;
+static void lorieExtendKeyRange(KeyCode *first, unsigned char *num, KeyCode key) {
+	unsigned int last;
 
-	XkbEventCauseRec cause;
-	XkbChangesRec changes;
+	if (*num == 0) {
+		*first = key;
+		*num = 1;
+		return;
+	}
+
+	last = *first + *num - 1;
+	if (key < *first)
+		*first = key;
+	if (key > last)
+		last = key;
+	*num = last - *first + 1;
+}
+
+/*
+ * Maps keysym to the least recently used scratch KeyCode.
+ * Changes are accumulated so several keysyms can be announced to clients with one notification.
+ */
+static KeyCode lorieAssignKeysym(XkbDescPtr xkb, KeySym keysym, XkbChangesPtr changes) {
+	KeyCode key;
 
 	int types[1];
 	KeySym *syms;
 	KeySym upper, lower;
 
-	master = GetMaster(lorieKeyboard, KEYBOARD_OR_FLOAT);
-	xkb = master->key->xkbInfo->desc;
-    for (key = xkb->max_key_code; key >= xkb->min_key_code; key--) {
-        if (XkbKeyNumGroups(xkb, key) == 0)
-            break;
-    }
-
-    if (key < xkb->min_key_code)
-        key = getReusableKeycode(xkb);
-
+    key = takeScratchKey(xkb);
     if (!key)
         return 0;
 
-	memset(&changes, 0, sizeof(changes));
-	memset(&cause, 0, sizeof(cause));
-
-	XkbSetCauseUnknown(&cause)
-
 	/*
 	 * Tools like xkbcomp get confused if there isn't a name
 	 * assigned to the keycode we're trying to use.
@@ -711,31 +888,148 @@ static KeyCode lorieAddKeysym(KeySym keysym, unused unsigned state) {
 		xkb->names->keys[key].name[2] = '0' + (key /  10) % 10;
 		xkb->names->keys[key].name[3] = '0' + (key /   1) % 10;
 
-		changes.names.changed |= XkbKeyNamesMask;
-		changes.names.first_key = key;
-		changes.names.num_keys = 1;
+		changes->names.changed |= XkbKeyNamesMask;
+		lorieExtendKeyRange(&changes->names.first_key, &changes->names.num_keys, key);
 	}
 
 	XkbConvertCase(keysym, &lower, &upper);
 	types[XkbGroup1Index] = XkbAlphabeticIndex;
 
-	XkbChangeTypesOfKey(xkb, (int) key, 1, XkbGroup1Mask, types, &changes.map);
+	XkbChangeTypesOfKey(xkb, (int) key, 1, XkbGroup1Mask, types, &changes->map);
 
 	syms = XkbKeySymsPtr(xkb, key);
 	syms[0] = lower;
 	syms[1] = upper;
 
-    saveAddedKeysym(key, syms[0]);
+    scratchSetKeysym(key, syms[0]);
 
-	changes.map.changed |= XkbKeySymsMask;
-	changes.map.first_key_sym = key;
-	changes.map.num_key_syms = 1;
+	changes->map.changed |= XkbKeySymsMask;
+	lorieExtendKeyRange(&changes->map.first_key_sym, &changes->map.num_key_syms, key);
 
-	XkbSendNotification(master, &changes, &cause);
+	return key;
+}
+
+static KeyCode lorieAddKeysym(KeySym keysym, unused unsigned state) {
+	DeviceIntPtr master;
+	KeyCode key;
+
+	XkbEventCauseRec cause;
+	XkbChangesRec changes;
+
+	master = GetMaster(lorieKeyboard, KEYBOARD_OR_FLOAT);
+
+	memset(&changes, 0, sizeof(changes));
+	memset(&cause, 0, sizeof(cause));
+
+	XkbSetCauseUnknown(&cause)
+
+	key = lorieAssignKeysym(master->key->xkbInfo->desc, keysym, &changes);
+	lorieKeymapChanged();
+	if (key)
+		XkbSendNotification(master, &changes, &cause);
 
 	return key;
 }
 
+/* Finds keycode for keysym or one of its equivalents, returns 0 if keymap has none. */
+static KeyCode lorieFindKeysym(KeySym keysym, unsigned state, unsigned *new_state) {
+    int i;
+    KeyCode keycode = lorieKeysymToKeycode(keysym, state, new_state);
+
+    /* Try some equivalent keysyms if we couldn't find a perfect match */
+    for (i = 0;keycode == 0 && i < sizeof(altKeysym)/sizeof(altKeysym[0]);i++) {
+        if (altKeysym[i].a == keysym)
+            keycode = lorieKeysymToKeycode(altKeysym[i].b, state, new_state);
+        else if (altKeysym[i].b == keysym)
+            keycode = lorieKeysymToKeycode(altKeysym[i].a, state, new_state);
+    }
+
+    return keycode;
+}
+
+/*
+ * lorieMapKeysyms() - add all keysyms the keymap is missing with one keymap
+ * update, so clients get a single MappingNotify instead of one per keysym.
+ * Keysyms which do not fit to the scratch keys are left for
+ * lorieKeysymKeyboardEvent() to map one by one.
+ */
+void lorieMapKeysyms(const KeySym *keysyms, int count) {
+    DeviceIntPtr master;
+    XkbDescPtr xkb;
+    KeyCode key;
+    unsigned state, new_state;
+    int i, used, added;
+    Bool touched[256] = { FALSE };
+    char *missing;
+
+    XkbEventCauseRec cause;
+    XkbChangesRec changes;
+
+    master = GetMaster(lorieKeyboard, KEYBOARD_OR_FLOAT);
+    xkb = master->key->xkbInfo->desc;
+
+    missing = calloc(count, 1);
+    if (!missing)
+        return;
+
+    memset(&changes, 0, sizeof(changes));
+    memset(&cause, 0, sizeof(cause));
+
+    XkbSetCauseUnknown(&cause)
+
+    mieqProcessInputEvents();
+    lorieKeymapChanged();
+    state = lorieGetKeyboardState();
+
+    if (xorg_list_is_empty(&scratchLRU))
+        reserveScratchKeys(xkb);
+
+    /*
+     * Scratch keys already holding keysyms of this batch are moved to front
+     * so they are not reassigned to other keysyms of the same batch.
+     */
+    for (i = 0, used = 0;i < count;i++) {
+        if (keysyms[i] == NoSymbol)
+            continue;
+
+        key = lorieFindKeysym(keysyms[i], state, &new_state);
+        if (key == 0)
+            missing[i] = TRUE;
+        else if (isScratchKey(key) && !touched[key]) {
+            touched[key] = TRUE;
+            vncOnKeyUsed(key);
+            used++;
+        }
+    }
+
+    for (i = 0, added = 0;i < count && used + added < scratchCount;i++) {
+        KeySym lower, upper;
+
+        if (!missing[i])
+            continue;
+
+        /* Already added by this batch */
+        XkbConvertCase(keysyms[i], &lower, &upper);
+        if (scratchFind(lower) != 0)
+            continue;
+
+        if (lorieAssignKeysym(xkb, keysyms[i], &changes) == 0) {
+            LogMessageVerb(X_ERROR, -1, "Failure adding new keysym 0x%x\n", keysyms[i]);
+            break;
+        }
+
+        added++;
+    }
+
+    free(missing);
+    lorieKeymapChanged();
+
+    if (added) {
+        LogMessageVerb(X_INFO, 0, "Added %d unknown keysyms with one keymap update\n", added);
+        XkbSendNotification(master, &changes, &cause);
+    }
+}
+
 /*
  * lorieKeysymKeyboardEvent() - work out the best keycode corresponding
  * to the keysym sent by the viewer. This is basically impossible in
@@ -783,28 +1077,11 @@ void lorieKeysymKeyboardEvent(KeySym keysym, int down) {
      * stuck down.
      */
     mieqProcessInputEvents();
+    lorieKeymapChanged();
 
     state = lorieGetKeyboardState();
 
-    keycode = lorieKeysymToKeycode(keysym, state, &new_state);
-
-    /* Try some equivalent keysyms if we couldn't find a perfect match */
-    if (keycode == 0) {
-        for (i = 0;i < sizeof(altKeysym)/sizeof(altKeysym[0]);i++) {
-            KeySym altsym;
-
-            if (altKeysym[i].a == keysym)
-                altsym = altKeysym[i].b;
-            else if (altKeysym[i].b == keysym)
-                altsym = altKeysym[i].a;
-            else
-                continue;
-
-            keycode = lorieKeysymToKeycode(altsym, state, &new_state);
-            if (keycode != 0)
-                break;
-        }
-    }
+    keycode = lorieFindKeysym(keysym, state, &new_state);
 
     /* No matches. Will have to add a new entry... */
     if (keycode == 0) {
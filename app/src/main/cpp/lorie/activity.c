@@ -3,11 +3,14 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <errno.h>
 #include <jni.h>
 #include <android/looper.h>
@@ -41,8 +44,88 @@ static struct {
 } CharBuffer = {0};
 
 static JNIEnv *guienv = NULL; // Must be used only in GUI thread.
+static lorieMessageReader reader = {0}; // Must be used only in GUI thread.
+static bool helloReceived = false; // Must be used only in GUI thread.
+static int helloTimer = -1;
 static jobject globalThiz = NULL;
 
+static pthread_mutex_t inputRingLock = PTHREAD_MUTEX_INITIALIZER; // Ring has only one producer, JNI calls may come from different threads.
+static struct lorie_event_ring* inputRing = NULL;
+static int inputDoorbell = -1;
+
+/*
+ * Events which did not fit the ring while X server was busy.
+ * They are kept in the same format as in the ring and written there before any newer event, so nothing is reordered.
+ * GUI thread must never wait for X server, so the backlog is flushed by a timer on its looper, and if it overflows too the event is dropped.
+ */
+static uint8_t inputBacklog[LORIE_EVENT_RING_SIZE];
+static size_t inputBacklogSize = 0;
+static int inputRetryTimer = -1;
+
+#define INPUT_RETRY_INTERVAL_NS 2000000
+
+static void setInputRing(struct lorie_event_ring* ring, int doorbell) {
+    pthread_mutex_lock(&inputRingLock);
+    if (inputRing)
+        munmap(inputRing, sizeof(*inputRing));
+    if (inputDoorbell != -1)
+        close(inputDoorbell);
+    inputRing = ring;
+    inputDoorbell = doorbell;
+    inputBacklogSize = 0; // Events of previous connection are meaningless for new X server.
+    pthread_mutex_unlock(&inputRingLock);
+}
+
+static bool flushInputBacklogLocked(void) {
+    size_t offset = 0;
+    while (offset < inputBacklogSize) {
+        uint32_t size;
+        memcpy(&size, inputBacklog + offset, sizeof(size));
+        if (!lorieEventRingWrite(inputRing, inputDoorbell, inputBacklog + offset + sizeof(size), size))
+            break;
+        offset += sizeof(size) + size;
+    }
+
+    memmove(inputBacklog, inputBacklog + offset, inputBacklogSize - offset);
+    inputBacklogSize -= offset;
+    return !inputBacklogSize;
+}
+
+static void armInputRetryTimer(void) {
+    struct itimerspec spec = { .it_value.tv_nsec = INPUT_RETRY_INTERVAL_NS };
+    if (inputRetryTimer != -1)
+        timerfd_settime(inputRetryTimer, 0, &spec, NULL);
+}
+
+static int inputRetryCallback(int fd, __unused int events, __unused void* data) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    pthread_mutex_lock(&inputRingLock);
+    if (inputRing && !flushInputBacklogLocked())
+        armInputRetryTimer();
+    pthread_mutex_unlock(&inputRingLock);
+    return 1;
+}
+
+static void sendInputEvent(const lorieEvent* e) {
+    uint8_t data[LORIE_MOTION_BATCH_MAX_SIZE];
+    uint32_t size;
+    pthread_mutex_lock(&inputRingLock);
+    if (inputRing && (size = (uint32_t) lorieEncodeEvent(e, data, sizeof(data)))) {
+        if (!flushInputBacklogLocked() || !lorieEventRingWrite(inputRing, inputDoorbell, data, size)) {
+            if (inputBacklogSize + sizeof(size) + size <= sizeof(inputBacklog)) {
+                memcpy(inputBacklog + inputBacklogSize, &size, sizeof(size));
+                memcpy(inputBacklog + inputBacklogSize + sizeof(size), data, size);
+                inputBacklogSize += sizeof(size) + size;
+            } else
+                log(ERROR, "Input event ring is full, dropping event");
+            armInputRetryTimer();
+        }
+    } else if (conn_fd != -1)
+        lorieSendEvent(conn_fd, e, NULL, 0);
+    pthread_mutex_unlock(&inputRingLock);
+}
+
 static jclass FindClassOrDie(JNIEnv *env, const char* name) {
     jclass clazz = (*env)->FindClass(env, name);
     if (!clazz) {
@@ -105,7 +188,17 @@ static jboolean requestConnection(__unused JNIEnv *env, __unused jclass clazz) {
 }
 
 static void connect_(__unused JNIEnv* env, __unused jobject cls, jint fd);
-static void nativeInit(JNIEnv *env, jobject thiz) {
+static int helloTimeout(int fd, __unused int events, __unused void* data) {
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+    if (conn_fd != -1 && !helloReceived) {
+        log(ERROR, "X server did not complete protocol handshake in %d ms, disconnecting", LORIE_HELLO_TIMEOUT_MS);
+        shutdown(conn_fd, SHUT_RDWR); // Looper reports hangup and connection is dropped in xcallback.
+    }
+    return 1;
+}
+
+static void nativeInit(JNIEnv *env, jobject thiz, jstring jCacheDir) {
     JavaVM* vm;
     if (!Charset.self) {
         // Init clipboard-related JNI stuff
@@ -121,6 +214,21 @@ static void nativeInit(JNIEnv *env, jobject thiz) {
         MainActivity.clientConnectedStateChanged = FindMethodOrDie(env, MainActivity.self, "clientConnectedStateChanged", "()V", JNI_FALSE);
     }
 
+    if (inputRetryTimer == -1 && (inputRetryTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) != -1)
+        ALooper_addFd(ALooper_forThread(), inputRetryTimer, 0, ALOOPER_EVENT_INPUT, inputRetryCallback, NULL);
+    if (helloTimer == -1 && (helloTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) != -1)
+        ALooper_addFd(ALooper_forThread(), helloTimer, 0, ALOOPER_EVENT_INPUT, helloTimeout, NULL);
+
+    if (!guienv && jCacheDir) {
+        // Activity process has no $TMPDIR, traces and startup timeline go to the cache directory of the app.
+        const char* dir = (*env)->GetStringUTFChars(env, jCacheDir, NULL);
+        if (dir) {
+            lorieStartupSetDirectory(dir);
+            lorieTraceStart("activity", dir);
+            (*env)->ReleaseStringUTFChars(env, jCacheDir, dir);
+        }
+    }
+
     (*env)->GetJavaVM(env, &vm);
     (*vm)->AttachCurrentThread(vm, &guienv, NULL);
     globalThiz = (*guienv)->NewGlobalRef(env, thiz);
@@ -132,6 +240,7 @@ static int xcallback(int fd, int events, __unused void* data) {
     jobject thiz = globalThiz;
 
     if (events & (ALOOPER_EVENT_ERROR | ALOOPER_EVENT_HANGUP)) {
+        hangup:;
         jobject instance = (*env)->CallStaticObjectMethod(env, MainActivity.self, MainActivity.getInstance);
         if (instance)
             (*env)->CallVoidMethod(env, instance, MainActivity.clientConnectedStateChanged);
@@ -139,6 +248,9 @@ static int xcallback(int fd, int events, __unused void* data) {
         ALooper_removeFd(ALooper_forThread(), fd);
         close(conn_fd);
         conn_fd = -1;
+        helloReceived = false;
+        lorieReaderReset(&reader);
+        setInputRing(NULL, -1);
         rendererSetSharedState(NULL);
         rendererRemoveAllBuffers();
         log(DEBUG, "disconnected");
@@ -147,17 +259,26 @@ static int xcallback(int fd, int events, __unused void* data) {
 
     if (conn_fd != -1) {
         lorieEvent e = {0};
+        int fds[LORIE_MESSAGE_MAX_FDS], nfds = 0;
+
+        // Only one read per wakeup, looper calls us again if there is more data.
+        if (lorieReaderFill(&reader, conn_fd) < 0)
+            goto hangup;
+
+        while (lorieReaderNext(&reader, &e, fds, &nfds) > 0) {
+            if (!helloReceived && e.type != EVENT_HELLO) {
+                log(ERROR, "X server sent message %d before protocol handshake, disconnecting", e.type);
+                for (int i = 0; i < nfds; i++)
+                    close(fds[i]);
+                goto hangup;
+            }
 
-        again:
-        if (read(conn_fd, &e, sizeof(e)) == sizeof(e)) {
             switch(e.type) {
                 case EVENT_CLIPBOARD_SEND: {
-                    if (!e.clipboardSend.count)
+                    // Content is owned by reader, it is NULL if it was too big to be received.
+                    char *clipboard = e.clipboardSend.data;
+                    if (!clipboard)
                         break;
-                    char clipboard[e.clipboardSend.count + 1];
-                    memset(clipboard, 0, e.clipboardSend.count + 1);
-                    read(conn_fd, clipboard, sizeof(clipboard));
-                    clipboard[e.clipboardSend.count] = 0;
                     log(DEBUG, "Clipboard content (%zu symbols) is %s", strlen(clipboard), clipboard);
                     jmethodID id = (*env)->GetMethodID(env, (*env)->GetObjectClass(env, thiz), "setClipboardText","(Ljava/lang/String;)V");
                     jobject bb = (*env)->NewDirectByteBuffer(env, clipboard, strlen(clipboard));
@@ -175,7 +296,7 @@ static int xcallback(int fd, int events, __unused void* data) {
                 }
                 case EVENT_SHARED_SERVER_STATE: {
                     struct lorie_shared_server_state* state = NULL;
-                    int stateFd = ancil_recv_fd(conn_fd);
+                    int stateFd = nfds >= 1 ? fds[0] : -1;
 
                     if (stateFd < 0)
                         break;
@@ -189,27 +310,65 @@ static int xcallback(int fd, int events, __unused void* data) {
                     rendererSetSharedState(state);
 
                     close(stateFd); // Closing file descriptor does not unmmap shared memory fragment.
+                    nfds = 0;
                     break;
                 }
                 case EVENT_ADD_BUFFER: {
-                    static LorieBuffer* buffer = NULL;
-                    const LorieBuffer_Desc* desc;
-                    LorieBuffer_recvHandleFromUnixSocket(conn_fd, &buffer);
-                    desc = LorieBuffer_description(buffer);
-                    log(INFO, "Received shared buffer width %d stride %d height %d format %d type %d id %llu", desc->width, desc->stride, desc->height, desc->format, desc->type, desc->id);
-                    rendererAddBuffer(buffer);
+                    LorieBuffer* buffers[LORIEBUFFER_MAX_BATCH];
+                    int count = LorieBuffer_decodeHandles(e.addBuffer.data, e.addBuffer.size, fds, nfds, buffers, LORIEBUFFER_MAX_BATCH);
+                    nfds = 0; // decodeHandles takes ownership of file descriptors.
+                    if (count < 0)
+                        log(ERROR, "Failed to receive shared buffers");
+
+                    for (int i = 0; i < count; i++) {
+                        const LorieBuffer_Desc* desc = LorieBuffer_description(buffers[i]);
+                        log(INFO, "Received shared buffer width %d stride %d height %d format %d type %d id %llu", desc->width, desc->stride, desc->height, desc->format, desc->type, desc->id);
+                        rendererAddBuffer(buffers[i]);
+                    }
                     break;
                 }
                 case EVENT_REMOVE_BUFFER: {
                     rendererRemoveBuffer(e.removeBuffer.id);
                     break;
                 }
+                case EVENT_INPUT_RING: {
+                    struct lorie_event_ring* ring;
+                    int ringFd, doorbell;
+                    if (nfds != 2) {
+                        log(ERROR, "Failed to receive input event ring");
+                        break;
+                    }
+
+                    ringFd = fds[0];
+                    doorbell = fds[1];
+                    nfds = 0;
+                    ring = mmap(NULL, sizeof(*ring), PROT_READ|PROT_WRITE, MAP_SHARED, ringFd, 0);
+                    close(ringFd); // Closing file descriptor does not unmmap shared memory fragment.
+                    if (ring == MAP_FAILED) {
+                        log(ERROR, "Failed to map input event ring: %s", strerror(errno));
+                        close(doorbell);
+                        break;
+                    }
+
+                    setInputRing(ring, doorbell);
+                    break;
+                }
+                case EVENT_HELLO: {
+                    if (!lorieCheckHello(&e))
+                        goto hangup;
+
+                    helloReceived = true;
+                    if (helloTimer != -1)
+                        timerfd_settime(helloTimer, 0, &(struct itimerspec) {0}, NULL);
+                    break;
+                }
             }
-        }
 
-        int n;
-        if (ioctl(conn_fd, FIONREAD, &n) >= 0 && n > sizeof(e))
-            goto again;
+            // Close file descriptors which were not consumed by handler.
+            for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+            nfds = 0;
+        }
     }
 
     return 1;
@@ -219,12 +378,25 @@ static void connect_(__unused JNIEnv* env, __unused jobject cls, jint fd) {
     if (conn_fd != -1) {
         ALooper_removeFd(ALooper_forThread(), conn_fd);
         close(conn_fd);
+        lorieReaderReset(&reader);
+        setInputRing(NULL, -1);
         rendererSetSharedState(NULL);
         rendererRemoveAllBuffers();
         log(DEBUG, "disconnected");
     }
 
+    helloReceived = false;
+    if (fd != -1) {
+        struct itimerspec timeout = { .it_value.tv_sec = LORIE_HELLO_TIMEOUT_MS / 1000, .it_value.tv_nsec = LORIE_HELLO_TIMEOUT_MS % 1000 * 1000000 };
+        // Hello goes first, before other threads can see the connection and send input events.
+        lorieSendEvent(fd, &(lorieEvent) { .hello = { .t = EVENT_HELLO, .version = LORIE_PROTOCOL_VERSION } }, NULL, 0);
+        if (helloTimer != -1)
+            timerfd_settime(helloTimer, 0, &timeout, NULL);
+    }
+
     if ((conn_fd = fd) != -1) {
+        lorieStartupReset();
+        lorieStartupMark("connected to X server");
         ALooper_addFd(ALooper_forThread(), fd, 0, ALOOPER_EVENT_INPUT | ALOOPER_EVENT_ERROR | ALOOPER_EVENT_HANGUP, xcallback, NULL);
         log(DEBUG, "XCB connection is successfull");
     }
@@ -256,14 +428,14 @@ static void startLogcat(JNIEnv *env, __unused jobject cls, jint fd) {
 static void setClipboardSyncEnabled(__unused JNIEnv* env, __unused jobject cls, jboolean enable, __unused jboolean ignored) {
     if (conn_fd != -1) {
         lorieEvent e = { .clipboardEnable = { .t = EVENT_CLIPBOARD_ENABLE, .enable = enable } };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
     }
 }
 
 static void sendClipboardAnnounce(__unused JNIEnv *env, __unused jobject thiz) {
     if (conn_fd != -1) {
         lorieEvent e = { .type = EVENT_CLIPBOARD_ANNOUNCE };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
     }
 }
 
@@ -272,7 +444,7 @@ static void sendClipboardEvent(JNIEnv *env, __unused jobject thiz, jbyteArray te
         jsize length = (*env)->GetArrayLength(env, text);
         jbyte* str = (*env)->GetByteArrayElements(env, text, NULL);
         lorieEvent e = { .clipboardSend = { .t = EVENT_CLIPBOARD_SEND, .count = length } };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
         write(conn_fd, str, length);
         (*env)->ReleaseByteArrayElements(env, text, str, JNI_ABORT);
     }
@@ -281,42 +453,74 @@ static void sendClipboardEvent(JNIEnv *env, __unused jobject thiz, jbyteArray te
 static void sendWindowChange(__unused JNIEnv* env, __unused jobject cls, jint width, jint height, jint framerate, jstring jname) {
     if (conn_fd != -1) {
         const char *name = (!jname || width <= 0 || height <= 0) ? NULL : (*env)->GetStringUTFChars(env, jname, JNI_FALSE);
-        lorieEvent e = { .screenSize = { .t = EVENT_SCREEN_SIZE, .width = width, .height = height, .framerate = framerate, .name_size = (name ? strlen(name) : 0) } };
-        write(conn_fd, &e, sizeof(e));
-        if (name) {
-            write(conn_fd, name, strlen(name));
+        lorieEvent e = { .screenSize = { .t = EVENT_SCREEN_SIZE, .width = width, .height = height, .framerate = framerate, .name_size = (name ? strlen(name) : 0), .name = (char*) name } };
+        lorieSendEvent(conn_fd, &e, NULL, 0);
+        if (name)
             (*env)->ReleaseStringUTFChars(env, jname, name);
-        }
     }
 }
 
 static void sendMouseEvent(__unused JNIEnv* env, __unused jobject cls, jfloat x, jfloat y, jint which_button, jboolean button_down, jboolean relative) {
     if (conn_fd != -1) {
         lorieEvent e = { .mouse = { .t = EVENT_MOUSE, .x = x, .y = y, .detail = which_button, .down = button_down, .relative = relative } };
-        write(conn_fd, &e, sizeof(e));
+        sendInputEvent(&e);
     }
 }
 
 static void sendTouchEvent(__unused JNIEnv* env, __unused jobject cls, jint action, jint id, jint x, jint y) {
     if (conn_fd != -1 && action != -1) {
         lorieEvent e = { .touch = { .t = EVENT_TOUCH, .type = action, .id = id, .x = x, .y = y } };
-        write(conn_fd, &e, sizeof(e));
+        sendInputEvent(&e);
     }
 }
 
+static int stylusButtons = 0; // Buttons of the last stylus sample sent.
 static void sendStylusEvent(__unused JNIEnv *env, __unused jobject thiz, jfloat x, jfloat y,
                             jint pressure, jint tilt_x, jint tilt_y,
                             jint orientation, jint buttons, jboolean eraser, jboolean mouse) {
     if (conn_fd != -1) {
+        stylusButtons = buttons;
         lorieEvent e = { .stylus = { .t = EVENT_STYLUS, .x = x, .y = y, .pressure = pressure, .tilt_x = tilt_x, .tilt_y = tilt_y, .orientation = orientation, .buttons = buttons, .eraser = eraser, .mouse = mouse } };
-        write(conn_fd, &e, sizeof(e));
+        sendInputEvent(&e);
+    }
+}
+
+// Every sample is x, y, pressure, tilt x, tilt y, orientation, pointer ID, time relative to event time in milliseconds.
+#define JAVA_MOTION_SAMPLE_STRIDE 8
+
+static void sendMotionBatch(JNIEnv *env, __unused jobject thiz, jint device, jint buttons, jboolean eraser, jboolean mouse,
+                            jlong eventTime, jint count, jfloatArray jsamples) {
+    jfloat values[LORIE_MAX_MOTION_SAMPLES * JAVA_MOTION_SAMPLE_STRIDE];
+    uint8_t samples[LORIE_MAX_MOTION_SAMPLES * LORIE_MOTION_SAMPLE_SIZE];
+    if (conn_fd == -1 || !jsamples || count <= 0)
+        return;
+
+    count = min(count, (*env)->GetArrayLength(env, jsamples) / JAVA_MOTION_SAMPLE_STRIDE);
+    for (int start = 0; start < count; start += LORIE_MAX_MOTION_SAMPLES) {
+        int n = min(count - start, LORIE_MAX_MOTION_SAMPLES);
+        // Buttons are applied to the last sample of the batch, they changed only at the last sample of the whole event.
+        int batchButtons = device == LORIE_MOTION_STYLUS && start + n < count ? stylusButtons : buttons;
+        lorieEvent e = { .motionBatch = { .t = EVENT_MOTION_BATCH, .device = device, .buttons = batchButtons, .eraser = eraser, .mouse = mouse, .count = n, .samples = samples } };
+        (*env)->GetFloatArrayRegion(env, jsamples, start * JAVA_MOTION_SAMPLE_STRIDE, n * JAVA_MOTION_SAMPLE_STRIDE, values);
+        for (int i = 0; i < n; i++) {
+            jfloat* v = values + i * JAVA_MOTION_SAMPLE_STRIDE;
+            lorieMotionSample sample = {
+                    .x = v[0], .y = v[1], .pressure = v[2], .tilt_x = v[3], .tilt_y = v[4], .orientation = v[5],
+                    .id = v[6], .time = (uint32_t) (eventTime + (jlong) v[7]),
+            };
+            lorieEncodeMotionSample(samples + i * LORIE_MOTION_SAMPLE_SIZE, &sample);
+        }
+        sendInputEvent(&e);
     }
+
+    if (device == LORIE_MOTION_STYLUS)
+        stylusButtons = buttons;
 }
 
 static void requestStylusEnabled(__unused JNIEnv *env, __unused jclass clazz, jboolean enabled) {
     if (conn_fd != -1) {
         lorieEvent e = { .stylusEnable = { .t = EVENT_STYLUS_ENABLE, .enable = enabled } };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
     }
 }
 
@@ -325,7 +529,7 @@ static jboolean sendKeyEvent(__unused JNIEnv* env, __unused jobject cls, jint sc
         int code = (scan_code) ?: android_to_linux_keycode[key_code];
         log(DEBUG, "Sending key: %d (%d %d %d)", code + 8, scan_code, key_code, key_down);
         lorieEvent e = { .key = { .t = EVENT_KEY, .key = code + 8, .state = key_down } };
-        write(conn_fd, &e, sizeof(e));
+        sendInputEvent(&e);
     }
 
     return true;
@@ -335,16 +539,17 @@ static void sendTextEvent(JNIEnv *env, __unused jobject thiz, jbyteArray text) {
     if (conn_fd != -1 && text) {
         jsize length = (*env)->GetArrayLength(env, text);
         jbyte *str = (*env)->GetByteArrayElements(env, text, NULL);
-        char *p = (char*) str;
+        char *p = (char*) str, *chunk = p, *end = p + length;
         mbstate_t mbstate = { 0 };
         if (!length)
             return;
 
         log(DEBUG, "Parsing text: %.*s", length, str);
 
-        while (*p) {
+        // Whole text is sent at once, X server types it as fast as focused client reads events.
+        while (p < end && *p) {
             wchar_t wc;
-            size_t len = mbrtowc(&wc, p, MB_CUR_MAX, &mbstate);
+            size_t len = mbrtowc(&wc, p, end - p, &mbstate);
 
             if (len == (size_t)-1 || len == (size_t)-2) {
                 log(ERROR, "Invalid UTF-8 sequence encountered");
@@ -354,13 +559,18 @@ static void sendTextEvent(JNIEnv *env, __unused jobject thiz, jbyteArray text) {
             if (len == 0)
                 break;
 
-            log(DEBUG, "Sending unicode event: %lc (U+%X)", wc, wc);
-            lorieEvent e = { .unicode = { .t = EVENT_UNICODE, .code = wc } };
-            write(conn_fd, &e, sizeof(e));
+            if (p + len - chunk > LORIE_MAX_TEXT_CHUNK) {
+                lorieEvent e = { .text = { .t = EVENT_TEXT, .length = p - chunk, .data = chunk } };
+                sendInputEvent(&e);
+                chunk = p;
+            }
+
             p += len;
-            if (p - (char*) str >= length)
-                break;
-            usleep(30000);
+        }
+
+        if (p > chunk) {
+            lorieEvent e = { .text = { .t = EVENT_TEXT, .length = p - chunk, .data = chunk } };
+            sendInputEvent(&e);
         }
 
         (*env)->ReleaseByteArrayElements(env, text, str, JNI_ABORT);
@@ -378,7 +588,7 @@ static void surfaceChanged(JNIEnv *env, __unused jobject thiz, jobject sfc) {
 JNIEXPORT jint JNI_OnLoad(JavaVM *vm, __unused void *reserved) {
     JNIEnv* env;
     static JNINativeMethod methods[] = {
-            {"nativeInit", "()V", (void *)&nativeInit},
+            {"nativeInit", "(Ljava/lang/String;)V", (void *)&nativeInit},
             {"surfaceChanged", "(Landroid/view/Surface;)V", (void *)&surfaceChanged},
             {"connect", "(I)V", (void *)&connect_},
             {"connected", "()Z", (void *)&connected},
@@ -390,6 +600,7 @@ JNIEXPORT jint JNI_OnLoad(JavaVM *vm, __unused void *reserved) {
             {"sendMouseEvent", "(FFIZZ)V", (void *)&sendMouseEvent},
             {"sendTouchEvent", "(IIII)V", (void *)&sendTouchEvent},
             {"sendStylusEvent", "(FFIIIIIZZ)V", (void *)&sendStylusEvent},
+            {"sendMotionBatch", "(IIZZJI[F)V", (void *)&sendMotionBatch},
             {"requestStylusEnabled", "(Z)V", (void *)&requestStylusEnabled},
             {"sendKeyEvent", "(IIZ)Z", (void *)&sendKeyEvent},
             {"sendTextEvent", "([B)V", (void *)&sendTextEvent},
@@ -14,12 +14,15 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include "list.h"
 #include "buffer.h"
+#include "lorie.h"
 
 struct LorieBuffer {
     int16_t refcount;
@@ -36,8 +39,66 @@ struct LorieBuffer {
     GLuint id;
     EGLImage image;
     struct xorg_list link;
+
+    // Storage of buffers allocated by LorieBuffer_allocate or LorieBuffer_convert can be reused via pool.
+    bool poolable;
+    uint64_t retireSerial;
+    uint64_t releaseTime;
+
+    // Buffer shell, private data of the caller and pixels share one slab block.
+    bool slab;
 };
 
+/*
+ * Toolkits create and destroy lots of tiny pixmaps (icons, glyph masks, solid pictures).
+ * Regular buffers small enough to fit size class are carved out of 256 KiB slabs together
+ * with LorieBuffer and private data of the caller to avoid a bunch of malloc calls per pixmap
+ * and to keep heap from fragmenting. Slabs are aligned to their size so slab header can be
+ * found by masking block address.
+ */
+#define SLAB_SIZE (256 * 1024)
+#define SLAB_MIN_BLOCK_SHIFT 6
+#define SLAB_CLASSES 10
+#define SLAB_MAX_BLOCK (1 << (SLAB_MIN_BLOCK_SHIFT + SLAB_CLASSES - 1)) // 32 KiB
+#define SLAB_HEADER_SIZE ((sizeof(LorieSlab) + 63) & ~63)
+
+typedef struct {
+    struct xorg_list link; // in the list of slabs with free blocks of its size class
+    void* freeList;
+    uint8_t* next; // blocks after this one were never used
+    uint32_t used, capacity;
+    uint8_t sizeClass;
+} LorieSlab;
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    struct xorg_list partial[SLAB_CLASSES];
+    LorieSlab* spare[SLAB_CLASSES]; // One empty slab per size class is kept to avoid thrashing.
+} slabs = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Shareable buffers released by X server are not destroyed immediately but kept in the pool
+ * keyed by width, height, format and type, so the next allocation of the same geometry
+ * (root window resize back and forth, rotation, split screen toggling) does not need
+ * to allocate and fault in new memory fragment or AHardwareBuffer.
+ * Renderer may still hold the storage until it processes removal event,
+ * so pooled buffer can not be reused until renderer reports its retirement serial.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct xorg_list entries; // Most recently released buffers go first.
+    size_t budget, bytes, count;
+    volatile uint64_t* retired;
+    LorieBufferPool_Stats stats;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .entries = { &pool.entries, &pool.entries },
+    .budget = LORIEBUFFER_POOL_DEFAULT_BUDGET,
+};
+
+static uint64_t nextBufferId = 0;
+
 __attribute__((unused))
 static int memfd_create(const char *name, unsigned int flags) {
 #ifndef __NR_memfd_create
@@ -97,9 +158,8 @@ int LorieBuffer_createRegion(char const* name, size_t size) {
 
 static LorieBuffer* allocate(int32_t width, int32_t stride, int32_t height, int8_t format, int8_t type, AHardwareBuffer *buf, int fd, size_t size, off_t offset, bool takeFd) {
     AHardwareBuffer_Desc desc = {0};
-    static uint64_t id = 0;
     bool acceptable = (format == AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM || format == AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM) && width > 0 && height > 0;
-    LorieBuffer b = { .desc = { .width = width, .stride = stride, .height = height, .format = format, .type = type, .buffer = buf, .id = id++ }, .fd = takeFd ? fd : dup(fd), .size = size, .offset = offset };
+    LorieBuffer b = { .desc = { .width = width, .stride = stride, .height = height, .format = format, .type = type, .buffer = buf, .id = __sync_fetch_and_add(&nextBufferId, 1) }, .fd = takeFd ? fd : dup(fd), .size = size, .offset = offset };
 
     if (type != LORIEBUFFER_AHARDWAREBUFFER && !acceptable)
         return NULL;
@@ -160,10 +220,194 @@ static LorieBuffer* allocate(int32_t width, int32_t stride, int32_t height, int8
     return buffer;
 }
 
+static inline size_t storageSize(LorieBuffer* buffer) {
+    return buffer->desc.type == LORIEBUFFER_FD ? buffer->size : buffer->desc.stride * buffer->desc.height * sizeof(uint32_t);
+}
+
+static void slabsInit(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        xorg_list_init(&slabs.partial[i]);
+}
+
+static inline void slabReset(LorieSlab* slab) {
+    slab->freeList = NULL;
+    slab->next = (uint8_t*) slab + SLAB_HEADER_SIZE;
+    slab->used = 0;
+}
+
+static void* slabAlloc(size_t size) {
+    LorieSlab* slab;
+    void* block;
+    uint8_t sizeClass = 0;
+    while ((1U << (SLAB_MIN_BLOCK_SHIFT + sizeClass)) < size)
+        sizeClass++;
+
+    pthread_once(&slabs.once, slabsInit);
+    pthread_mutex_lock(&slabs.lock);
+    if (!xorg_list_is_empty(&slabs.partial[sizeClass]))
+        slab = xorg_list_first_entry(&slabs.partial[sizeClass], LorieSlab, link);
+    else {
+        if ((slab = slabs.spare[sizeClass]))
+            slabs.spare[sizeClass] = NULL;
+        else if (posix_memalign((void**) &slab, SLAB_SIZE, SLAB_SIZE) == 0) {
+            slab->sizeClass = sizeClass;
+            slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) >> (SLAB_MIN_BLOCK_SHIFT + sizeClass);
+            slabReset(slab);
+        } else {
+            pthread_mutex_unlock(&slabs.lock);
+            return NULL;
+        }
+
+        xorg_list_add(&slab->link, &slabs.partial[sizeClass]);
+    }
+
+    if (slab->freeList) {
+        block = slab->freeList;
+        slab->freeList = *(void**) block;
+    } else {
+        block = slab->next;
+        slab->next += 1U << (SLAB_MIN_BLOCK_SHIFT + sizeClass);
+    }
+
+    if (++slab->used == slab->capacity)
+        xorg_list_del(&slab->link);
+    pthread_mutex_unlock(&slabs.lock);
+
+    return block;
+}
+
+static void slabFree(void* block) {
+    LorieSlab* slab = (LorieSlab*) ((uintptr_t) block & ~((uintptr_t) SLAB_SIZE - 1));
+    pthread_mutex_lock(&slabs.lock);
+    *(void**) block = slab->freeList;
+    slab->freeList = block;
+    if (slab->used-- == slab->capacity)
+        xorg_list_add(&slab->link, &slabs.partial[slab->sizeClass]);
+
+    if (!slab->used) {
+        xorg_list_del(&slab->link);
+        if (!slabs.spare[slab->sizeClass]) {
+            slabReset(slab);
+            slabs.spare[slab->sizeClass] = slab;
+        } else
+            free(slab);
+    }
+    pthread_mutex_unlock(&slabs.lock);
+}
+
+static void destroy(LorieBuffer* buffer) {
+    switch (buffer->desc.type) {
+        case LORIEBUFFER_REGULAR:
+            if (!buffer->slab)
+                free(buffer->desc.data);
+            break;
+        case LORIEBUFFER_FD:
+            munmap(buffer->desc.data, buffer->size);
+            close(buffer->fd);
+            break;
+        case LORIEBUFFER_AHARDWAREBUFFER:
+            AHardwareBuffer_release(buffer->desc.buffer);
+            break;
+        default: break;
+    }
+
+    if (buffer->slab)
+        slabFree(buffer);
+    else
+        free(buffer);
+}
+
+static void destroyList(struct xorg_list* list) {
+    LorieBuffer *buffer, *tmp;
+    xorg_list_for_each_entry_safe(buffer, tmp, list, link) {
+        xorg_list_del(&buffer->link);
+        destroy(buffer);
+    }
+}
+
+static void poolEvictLocked(size_t needed, struct xorg_list* evicted) {
+    // Oldest buffers are in the end of the list.
+    while (pool.bytes + needed > pool.budget && !xorg_list_is_empty(&pool.entries)) {
+        LorieBuffer* buffer = xorg_list_last_entry(&pool.entries, LorieBuffer, link);
+        xorg_list_del(&buffer->link);
+        xorg_list_add(&buffer->link, evicted);
+        pool.bytes -= storageSize(buffer);
+        pool.count--;
+        pool.stats.evictions++;
+    }
+}
+
+static LorieBuffer* poolTake(int32_t width, int32_t height, int8_t format, int8_t type) {
+    LorieBuffer *buffer, *found = NULL;
+    uint64_t retired = pool.retired ? __atomic_load_n(pool.retired, __ATOMIC_ACQUIRE) : UINT64_MAX;
+
+    pthread_mutex_lock(&pool.lock);
+    xorg_list_for_each_entry(buffer, &pool.entries, link) {
+        if (buffer->desc.width == width && buffer->desc.height == height && buffer->desc.format == format
+                && buffer->desc.type == type && buffer->retireSerial <= retired) {
+            found = buffer;
+            xorg_list_del(&found->link);
+            xorg_list_init(&found->link);
+            pool.bytes -= storageSize(found);
+            pool.count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return found;
+}
+
+static bool poolPut(LorieBuffer* buffer) {
+    struct xorg_list evicted;
+    size_t size = storageSize(buffer);
+    if (size > pool.budget)
+        return false;
+
+    if (buffer->locked)
+        LorieBuffer_unlock(buffer);
+
+    buffer->releaseTime = lorieMonotonicNs();
+    xorg_list_init(&evicted);
+    pthread_mutex_lock(&pool.lock);
+    poolEvictLocked(size, &evicted);
+    xorg_list_add(&buffer->link, &pool.entries);
+    pool.bytes += size;
+    pool.count++;
+    pthread_mutex_unlock(&pool.lock);
+
+    destroyList(&evicted);
+    return true;
+}
+
+static void poolAccount(uint64_t start, bool hit) {
+    uint64_t elapsed = lorieMonotonicNs() - start;
+    pthread_mutex_lock(&pool.lock);
+    pool.stats.allocations++;
+    pool.stats.hits += hit ? 1 : 0;
+    pool.stats.allocationTimeNs += elapsed;
+    if (elapsed > pool.stats.maxAllocationTimeNs)
+        pool.stats.maxAllocationTimeNs = elapsed;
+    pthread_mutex_unlock(&pool.lock);
+}
+
 __LIBC_HIDDEN__ LorieBuffer* LorieBuffer_allocate(int32_t width, int32_t height, int8_t format, int8_t type) {
     int fd = -1;
     size_t size = 0;
+    uint64_t start = lorieMonotonicNs();
     AHardwareBuffer *ahardwarebuffer = NULL;
+    LorieBuffer* buffer;
+
+    if (type == LORIEBUFFER_FD || type == LORIEBUFFER_AHARDWAREBUFFER) {
+        if ((buffer = poolTake(width, height, format, type))) {
+            // Buffer gets new ID, so renderer will not confuse it with the one it has just released.
+            buffer->refcount = 1;
+            buffer->desc.id = __sync_fetch_and_add(&nextBufferId, 1);
+            buffer->retireSerial = 0;
+            poolAccount(start, true);
+            return buffer;
+        }
+    }
 
     if (type == LORIEBUFFER_FD) {
         size = alignToPage(width * height * sizeof(uint32_t));
@@ -178,7 +422,56 @@ __LIBC_HIDDEN__ LorieBuffer* LorieBuffer_allocate(int32_t width, int32_t height,
             dprintf(2, "FATAL: failed to allocate AHardwareBuffer (width %d height %d format %d): error %d\n", width, height, format, err);
     }
 
-    return allocate(width, width, height, format, type, ahardwarebuffer, fd, size, 0, true);
+    buffer = allocate(width, width, height, format, type, ahardwarebuffer, fd, size, 0, true);
+    if (buffer && type != LORIEBUFFER_REGULAR) {
+        buffer->poolable = true;
+        poolAccount(start, false);
+    }
+
+    return buffer;
+}
+
+__LIBC_HIDDEN__ LorieBuffer* LorieBuffer_allocateRegular(int32_t width, int32_t height, int8_t format, size_t privSize, void** priv) {
+    size_t header = (sizeof(LorieBuffer) + privSize + 15) & ~15, pixels = width * height * sizeof(uint32_t);
+    LorieBuffer* buffer;
+
+    if (priv)
+        *priv = NULL;
+
+    if ((format != AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM && format != AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM) || width <= 0 || height <= 0)
+        return NULL;
+
+    if (header + pixels <= SLAB_MAX_BLOCK) {
+        if (!(buffer = slabAlloc(header + pixels)))
+            return NULL;
+
+        // Content of new pixmap is undefined, only shell and private data are cleared.
+        memset(buffer, 0, header);
+        buffer->slab = true;
+        buffer->desc.data = (uint8_t*) buffer + header;
+    } else {
+        if (!(buffer = calloc(1, header)))
+            return NULL;
+
+        if (!(buffer->desc.data = malloc(pixels))) {
+            free(buffer);
+            return NULL;
+        }
+    }
+
+    __sync_fetch_and_add(&buffer->refcount, 1);
+    buffer->desc.width = buffer->desc.stride = width;
+    buffer->desc.height = height;
+    buffer->desc.format = format;
+    buffer->desc.type = LORIEBUFFER_REGULAR;
+    buffer->desc.id = __sync_fetch_and_add(&nextBufferId, 1);
+    buffer->fd = -1;
+    xorg_list_init(&buffer->link);
+
+    if (priv && privSize)
+        *priv = (uint8_t*) buffer + sizeof(LorieBuffer);
+
+    return buffer;
 }
 
 __LIBC_HIDDEN__ LorieBuffer* LorieBuffer_wrapFileDescriptor(int32_t width, int32_t stride, int32_t height, int8_t format, int fd, off_t offset) {
@@ -191,11 +484,43 @@ __LIBC_HIDDEN__ LorieBuffer* LorieBuffer_wrapAHardwareBuffer(AHardwareBuffer* bu
 
 __LIBC_HIDDEN__ void LorieBuffer_convert(LorieBuffer* buffer, int8_t type, int8_t format) {
     void *data;
+    LorieBuffer* storage;
+    uint64_t start = lorieMonotonicNs();
     if (!buffer || buffer->desc.type != LORIEBUFFER_REGULAR
         || (type != LORIEBUFFER_FD && type != LORIEBUFFER_AHARDWAREBUFFER)
         || (format != AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM && format != AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM))
         return;
 
+    if ((storage = poolTake(buffer->desc.width, buffer->desc.height, format, type))) {
+        data = storage->desc.data;
+        if (type == LORIEBUFFER_AHARDWAREBUFFER && AHardwareBuffer_lock(storage->desc.buffer, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN | AHARDWAREBUFFER_USAGE_CPU_WRITE_OFTEN, -1, NULL, &data) != 0)
+            data = NULL;
+
+        if (data)
+            pixman_blt(buffer->desc.data, data, buffer->desc.stride, storage->desc.stride, 32, 32, 0, 0, 0, 0, buffer->desc.width, buffer->desc.height);
+
+        if (data && type == LORIEBUFFER_AHARDWAREBUFFER)
+            AHardwareBuffer_unlock(storage->desc.buffer, NULL);
+
+        // Take storage of pooled buffer, its shell is not needed anymore.
+        if (!buffer->slab)
+            free(buffer->desc.data);
+        buffer->desc.type = type;
+        buffer->desc.format = format;
+        buffer->desc.stride = storage->desc.stride;
+        buffer->desc.buffer = storage->desc.buffer;
+        buffer->desc.data = storage->desc.data;
+        buffer->fd = storage->fd;
+        buffer->size = storage->size;
+        buffer->offset = storage->offset;
+        buffer->lockedData = NULL;
+        buffer->locked = 0;
+        buffer->poolable = !buffer->slab;
+        free(storage);
+        poolAccount(start, true);
+        return;
+    }
+
     if (type == LORIEBUFFER_FD) {
         size_t size = alignToPage(buffer->desc.stride * buffer->desc.height * sizeof(uint32_t));
         int fd = LorieBuffer_createRegion("LorieBuffer", size);
@@ -215,11 +540,13 @@ __LIBC_HIDDEN__ void LorieBuffer_convert(LorieBuffer* buffer, int8_t type, int8_
         buffer->fd = fd;
         buffer->size = size;
         buffer->offset = 0;
-        free(buffer->desc.data);
+        if (!buffer->slab)
+            free(buffer->desc.data);
         buffer->desc.data = data;
 
         buffer->lockedData = NULL;
         buffer->locked = 0;
+        buffer->poolable = !buffer->slab;
     } else {
         AHardwareBuffer *b = NULL;
         AHardwareBuffer_Desc desc = { .width = buffer->desc.width, .height = buffer->desc.height, .format = format, .layers = 1,
@@ -239,11 +566,15 @@ __LIBC_HIDDEN__ void LorieBuffer_convert(LorieBuffer* buffer, int8_t type, int8_
         buffer->desc.format = format;
         buffer->desc.stride = desc.stride;
         buffer->desc.buffer = b;
-        free(buffer->desc.data);
+        if (!buffer->slab)
+            free(buffer->desc.data);
         buffer->desc.data = NULL;
         buffer->lockedData = NULL;
         buffer->locked = 0;
+        buffer->poolable = !buffer->slab;
     }
+
+    poolAccount(start, false);
 }
 
 __LIBC_HIDDEN__ void __LorieBuffer_free(LorieBuffer* buffer) {
@@ -258,21 +589,71 @@ __LIBC_HIDDEN__ void __LorieBuffer_free(LorieBuffer* buffer) {
     if (eglGetCurrentDisplay() && buffer->image)
         eglDestroyImageKHR(eglGetCurrentDisplay(), buffer->image);
 
-    switch (buffer->desc.type) {
-        case LORIEBUFFER_REGULAR:
-            free(buffer->desc.data);
-            break;
-        case LORIEBUFFER_FD:
-            munmap(buffer->desc.data, buffer->size);
-            close(buffer->fd);
-            break;
-        case LORIEBUFFER_AHARDWAREBUFFER:
-            AHardwareBuffer_release(buffer->desc.buffer);
-            break;
-        default: break;
+    // Buffers attached to GL are not pooled, only X server side allocations are.
+    if (buffer->poolable && !buffer->id && !buffer->image && poolPut(buffer))
+        return;
+
+    destroy(buffer);
+}
+
+__LIBC_HIDDEN__ void LorieBuffer_setRetireSerial(LorieBuffer* buffer, uint64_t serial) {
+    if (buffer)
+        buffer->retireSerial = serial;
+}
+
+__LIBC_HIDDEN__ void LorieBufferPool_setRetirementCounter(volatile uint64_t* counter) {
+    pool.retired = counter;
+}
+
+__LIBC_HIDDEN__ void LorieBufferPool_retireAll(void) {
+    LorieBuffer *buffer;
+    pthread_mutex_lock(&pool.lock);
+    xorg_list_for_each_entry(buffer, &pool.entries, link)
+        buffer->retireSerial = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+__LIBC_HIDDEN__ void LorieBufferPool_setBudget(size_t bytes) {
+    struct xorg_list evicted;
+    xorg_list_init(&evicted);
+    pthread_mutex_lock(&pool.lock);
+    pool.budget = bytes;
+    poolEvictLocked(0, &evicted);
+    pthread_mutex_unlock(&pool.lock);
+    destroyList(&evicted);
+}
+
+__LIBC_HIDDEN__ void LorieBufferPool_trim(uint32_t maxAgeMs) {
+    LorieBuffer *buffer, *tmp;
+    struct xorg_list expired;
+    uint64_t now = lorieMonotonicNs();
+
+    xorg_list_init(&expired);
+    pthread_mutex_lock(&pool.lock);
+    xorg_list_for_each_entry_safe(buffer, tmp, &pool.entries, link) {
+        if (now - buffer->releaseTime >= maxAgeMs * 1000000ULL) {
+            xorg_list_del(&buffer->link);
+            xorg_list_add(&buffer->link, &expired);
+            pool.bytes -= storageSize(buffer);
+            pool.count--;
+            pool.stats.evictions++;
+        }
     }
+    pthread_mutex_unlock(&pool.lock);
+    destroyList(&expired);
+}
 
-    free(buffer);
+__LIBC_HIDDEN__ void LorieBufferPool_getStats(LorieBufferPool_Stats* out, bool reset) {
+    if (!out)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    *out = pool.stats;
+    out->pooledBuffers = pool.count;
+    out->pooledBytes = pool.bytes;
+    if (reset)
+        pool.stats = (LorieBufferPool_Stats) {0};
+    pthread_mutex_unlock(&pool.lock);
 }
 
 __LIBC_HIDDEN__ const LorieBuffer_Desc* LorieBuffer_description(LorieBuffer* buffer) {
@@ -324,69 +705,125 @@ __LIBC_HIDDEN__ int LorieBuffer_unlock(LorieBuffer* buffer) {
     return ret;
 }
 
-__LIBC_HIDDEN__ void LorieBuffer_sendHandleToUnixSocket(LorieBuffer* _Nonnull buffer, int socketFd) {
-    if (socketFd < 0 || !buffer)
-        return;
+/*
+ * Buffer handles are sent in batches as a payload of one message:
+ * header, descriptors and file descriptors of all memory fragments go together.
+ * AHardwareBuffers can not be sent as plain file descriptors, so they are written
+ * to private socket which is passed as the last file descriptor of the batch.
+ * Descriptor carries only process independent data, receiver skips trailing fields it does not know.
+ */
+#define LORIEBUFFER_WIRE_VERSION 1
+#define LORIEBUFFER_WIRE_AHARDWAREBUFFER_SOCKET 1
+
+typedef struct {
+    uint8_t version, descSize, flags, count;
+} LorieBuffer_WireHeader;
+
+typedef struct {
+    int32_t width, stride, height;
+    uint8_t format, type;
+    uint16_t reserved;
+    uint64_t id;
+    uint64_t offset;
+} LorieBuffer_WireDesc;
+
+_Static_assert(sizeof(LorieBuffer_WireHeader) == 4, "LorieBuffer_WireHeader must be 4 bytes long");
+_Static_assert(sizeof(LorieBuffer_WireDesc) == 32, "LorieBuffer_WireDesc must be 32 bytes long");
+_Static_assert(LORIEBUFFER_MAX_HANDLES_SIZE == sizeof(LorieBuffer_WireHeader) + LORIEBUFFER_MAX_BATCH * sizeof(LorieBuffer_WireDesc), "LORIEBUFFER_MAX_HANDLES_SIZE does not match wire format");
+
+__LIBC_HIDDEN__ size_t LorieBuffer_encodeHandles(LorieBuffer* _Nonnull const* _Nonnull buffers, size_t count, uint8_t* _Nonnull out, int* _Nonnull fds, int* _Nonnull nfds, int* _Nonnull ahbSocket) {
+    LorieBuffer_WireHeader header = { .version = LORIEBUFFER_WIRE_VERSION, .descSize = sizeof(LorieBuffer_WireDesc) };
+    int ahb[2] = { -1, -1 };
+
+    *nfds = 0;
+    *ahbSocket = -1;
+    if (!buffers || !out || count > LORIEBUFFER_MAX_BATCH)
+        return 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (buffers[i]->desc.type == LORIEBUFFER_AHARDWAREBUFFER && ahb[0] == -1
+            && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ahb) != 0)
+            return 0;
+    }
 
-    write(socketFd, buffer, sizeof(*buffer));
-    if (buffer->desc.type == LORIEBUFFER_FD)
-        ancil_send_fd(socketFd, buffer->fd);
-    else if (buffer->desc.type == LORIEBUFFER_AHARDWAREBUFFER)
-        AHardwareBuffer_sendHandleToUnixSocket(buffer->desc.buffer, socketFd);
+    for (size_t i = 0; i < count; i++) {
+        LorieBuffer* buffer = buffers[i];
+        LorieBuffer_WireDesc desc = {
+            .width = buffer->desc.width, .stride = buffer->desc.stride, .height = buffer->desc.height,
+            .format = buffer->desc.format, .type = buffer->desc.type, .id = buffer->desc.id, .offset = buffer->offset,
+        };
+        memcpy(out + sizeof(header) + header.count++ * sizeof(desc), &desc, sizeof(desc));
+
+        if (buffer->desc.type == LORIEBUFFER_FD)
+            fds[(*nfds)++] = buffer->fd;
+        else if (buffer->desc.type == LORIEBUFFER_AHARDWAREBUFFER)
+            AHardwareBuffer_sendHandleToUnixSocket(buffer->desc.buffer, ahb[0]);
+    }
+
+    if (ahb[0] != -1) {
+        // Handles stay in the socket buffer after our end is closed.
+        close(ahb[0]);
+        fds[(*nfds)++] = *ahbSocket = ahb[1];
+        header.flags |= LORIEBUFFER_WIRE_AHARDWAREBUFFER_SOCKET;
+    }
+
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header) + header.count * sizeof(LorieBuffer_WireDesc);
 }
 
-__LIBC_HIDDEN__ void LorieBuffer_recvHandleFromUnixSocket(int socketFd, LorieBuffer** outBuffer) {
-    LorieBuffer buffer = {0}, *ret = NULL;
-    // We should read buffer from socket despite outbuffer is NULL, otherwise we will get protocol error
-    if (socketFd < 0)
-        return;
+__LIBC_HIDDEN__ int LorieBuffer_decodeHandles(const uint8_t* _Nonnull data, size_t size, int* _Nonnull fds, int nfds, LorieBuffer* _Nullable * _Nonnull outBuffers, size_t max) {
+    LorieBuffer_WireHeader header = {0};
+    LorieBuffer_WireDesc desc;
+    int usedFds = 0, ahbSocket = -1, received = 0;
 
-    // Reset process-specific data;
-    buffer.refcount = 0;
-    buffer.locked = false;
-    buffer.fd = -1;
-    buffer.lockedData = NULL;
-    __sync_fetch_and_add(&buffer.refcount, 1); // refcount is the first object in the struct
-
-    read(socketFd, &buffer, sizeof(buffer));
-    buffer.image = NULL; // Only for process-local use
-    if (buffer.desc.type == LORIEBUFFER_FD) {
-        size_t size = buffer.desc.stride * buffer.desc.height * sizeof(uint32_t);
-        buffer.fd = ancil_recv_fd(socketFd);
-        if (buffer.fd == -1) {
-            if (outBuffer)
-                *outBuffer = NULL;
-            return;
-        }
+    if (size < sizeof(header)) {
+        received = -1;
+        goto out;
+    }
 
-        buffer.desc.data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, buffer.fd, 0);
-        if (buffer.desc.data == NULL || buffer.desc.data == MAP_FAILED) {
-            close(buffer.fd);
-            if (outBuffer)
-                *outBuffer = NULL;
-            return;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != LORIEBUFFER_WIRE_VERSION || header.descSize < sizeof(desc) || size < sizeof(header) + header.count * header.descSize) {
+        dprintf(2, "FATAL: unsupported buffer batch (version %d, descriptor size %d), expected version %d\n", header.version, header.descSize, LORIEBUFFER_WIRE_VERSION);
+        received = -1;
+        goto out;
+    }
+
+    if (nfds && header.flags & LORIEBUFFER_WIRE_AHARDWAREBUFFER_SOCKET)
+        ahbSocket = fds[--nfds];
+
+    for (int i = 0; i < header.count; i++) {
+        LorieBuffer* buffer = NULL;
+        memcpy(&desc, data + sizeof(header) + i * header.descSize, sizeof(desc));
+        if (desc.type == LORIEBUFFER_FD && usedFds < nfds) {
+            int fd = fds[usedFds++];
+            // allocate takes ownership of the file descriptor only for acceptable descriptions.
+            if ((desc.format != AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM && desc.format != AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM) || desc.width <= 0 || desc.height <= 0)
+                close(fd);
+            else
+                buffer = allocate(desc.width, desc.stride, desc.height, desc.format, LORIEBUFFER_FD, NULL, fd, desc.stride * desc.height * sizeof(uint32_t), (off_t) desc.offset, true);
+        } else if (desc.type == LORIEBUFFER_AHARDWAREBUFFER && ahbSocket != -1) {
+            AHardwareBuffer* ahardwarebuffer = NULL;
+            if (AHardwareBuffer_recvHandleFromUnixSocket(ahbSocket, &ahardwarebuffer) == 0 && ahardwarebuffer)
+                buffer = allocate(0, 0, 0, 0, LORIEBUFFER_AHARDWAREBUFFER, ahardwarebuffer, -1, 0, 0, true);
         }
-    } else if (buffer.desc.type == LORIEBUFFER_AHARDWAREBUFFER)
-        AHardwareBuffer_recvHandleFromUnixSocket(socketFd, &buffer.desc.buffer);
 
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "MemoryLeak"
-    if (outBuffer)
-        ret = calloc(1, sizeof(buffer));
-#pragma clang diagnostic pop
-    if (!ret) {
-        if (buffer.fd >= 0)
-            close(buffer.fd);
-        if (buffer.desc.buffer)
-            AHardwareBuffer_release(buffer.desc.buffer);
-        if (outBuffer)
-            outBuffer = NULL;
-        return;
+        if (!buffer)
+            continue;
+
+        buffer->desc.id = desc.id; // Buffers are identified by ID assigned by sender.
+        if (outBuffers && (size_t) received < max)
+            outBuffers[received++] = buffer;
+        else
+            LorieBuffer_release(buffer);
     }
 
-    *ret = buffer;
-    xorg_list_init(&ret->link);
-    *outBuffer = ret;
+    out:
+    for (int i = usedFds; i < nfds; i++)
+        close(fds[i]);
+    if (ahbSocket != -1)
+        close(ahbSocket);
+
+    return received;
 }
 
 __LIBC_HIDDEN__ void LorieBuffer_attachToGL(LorieBuffer* buffer) {
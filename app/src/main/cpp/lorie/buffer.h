@@ -24,6 +24,19 @@ typedef struct {
 
 typedef struct LorieBuffer LorieBuffer;
 
+#define LORIEBUFFER_MAX_BATCH 64
+#define LORIEBUFFER_MAX_HANDLES_SIZE (4 + LORIEBUFFER_MAX_BATCH * 32)
+
+#define LORIEBUFFER_POOL_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+typedef struct {
+    uint64_t allocations; // Shareable buffer allocations, including conversions.
+    uint64_t hits; // Allocations satisfied by the pool.
+    uint64_t evictions;
+    uint64_t allocationTimeNs, maxAllocationTimeNs;
+    size_t pooledBuffers, pooledBytes;
+} LorieBufferPool_Stats;
+
 /**
  * Creates anonymous shared memory fragment in anonymous namespace
  *
@@ -45,6 +58,21 @@ int LorieBuffer_createRegion(char const* _Nonnull name, size_t size);
  */
 LorieBuffer* _Nullable LorieBuffer_allocate(int32_t width, int32_t height, int8_t format, int8_t type);
 
+/**
+ * Allocates new regular (not shareable) buffer.
+ * Buffer and private data of the caller are allocated together, small buffers share one block with their pixels.
+ * Pixels are not cleared, private data is.
+ * Private data is freed when the last reference to the buffer is released.
+ *
+ * @param width width of buffer.
+ * @param height height of buffer.
+ * @param format format of buffer. Accepts AHARDWAREBUFFER_FORMAT_B8G8R8A8_UNORM or AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM
+ * @param privSize size of private data of the caller.
+ * @param priv pointer to private data, NULL if privSize is 0 or allocation failed.
+ * @return returns the buffer itself or NULL on failure.
+ */
+LorieBuffer* _Nullable LorieBuffer_allocateRegular(int32_t width, int32_t height, int8_t format, size_t privSize, void* _Nullable * _Nullable priv);
+
 /**
  * Wraps given memory fragment file descriptor into LorieBuffer.
  * Takes ownership on the given file descriptor.
@@ -104,6 +132,50 @@ STATIC_INLINE void LorieBuffer_release(LorieBuffer* _Nullable buffer) {
         __LorieBuffer_free(buffer);
 }
 
+/**
+ * Set retirement serial of the buffer.
+ * Storage of the released buffer will not be reused until retirement counter reaches this serial.
+ *
+ * @param buffer the buffer
+ * @param serial the serial, 0 means buffer can be reused right after releasing
+ */
+void LorieBuffer_setRetireSerial(LorieBuffer* _Nullable buffer, uint64_t serial);
+
+/**
+ * Set the counter of buffers retired by the renderer.
+ * Counter is read atomically, it may reside in shared memory fragment.
+ *
+ * @param counter the counter, NULL means buffers are reused regardless of their serials.
+ */
+void LorieBufferPool_setRetirementCounter(volatile uint64_t* _Nullable counter);
+
+/**
+ * Mark all pooled buffers as retired. Should be used when renderer is disconnected.
+ */
+void LorieBufferPool_retireAll(void);
+
+/**
+ * Set the memory budget of the pool. Least recently released buffers are evicted to fit it.
+ *
+ * @param bytes budget in bytes, 0 disables pooling.
+ */
+void LorieBufferPool_setBudget(size_t bytes);
+
+/**
+ * Destroy pooled buffers released earlier than given amount of time.
+ *
+ * @param maxAgeMs maximal age of pooled buffer in milliseconds.
+ */
+void LorieBufferPool_trim(uint32_t maxAgeMs);
+
+/**
+ * Get pool statistics.
+ *
+ * @param out statistics
+ * @param reset reset allocation counters after reading
+ */
+void LorieBufferPool_getStats(LorieBufferPool_Stats* _Nullable out, bool reset);
+
 /**
  * Return a description of the LorieBuffer.
  *
@@ -133,20 +205,32 @@ int LorieBuffer_lock(LorieBuffer* _Nullable buffer, void* _Nullable * _Nonnull o
 int LorieBuffer_unlock(LorieBuffer* _Nullable buffer);
 
 /**
- * Send the AHardwareBuffer to an AF_UNIX socket.
+ * Serialize handles of shareable buffers to be sent to another process.
+ * Serialized batch and file descriptors must be sent together in one message.
  *
- * @param buffer
- * @param socketFd
+ * @param buffers buffers to be sent, must be LORIEBUFFER_FD or LORIEBUFFER_AHARDWAREBUFFER.
+ * @param count number of buffers, not more than LORIEBUFFER_MAX_BATCH.
+ * @param out array of at least LORIEBUFFER_MAX_HANDLES_SIZE bytes.
+ * @param fds array of at least LORIEBUFFER_MAX_BATCH + 1 file descriptors to be sent with the batch.
+ * @param nfds number of file descriptors stored in fds.
+ * @param ahbSocket private socket carrying AHardwareBuffer handles or -1, it is one of fds and must be closed by caller after sending.
+ * @return size of serialized batch, 0 on failure.
  */
-void LorieBuffer_sendHandleToUnixSocket(LorieBuffer* _Nonnull buffer, int socketFd);
+size_t LorieBuffer_encodeHandles(LorieBuffer* _Nonnull const* _Nonnull buffers, size_t count, uint8_t* _Nonnull out, int* _Nonnull fds, int* _Nonnull nfds, int* _Nonnull ahbSocket);
 
 /**
- * Receive an AHardwareBuffer from an AF_UNIX socket.
+ * Deserialize batch of buffer handles produced by LorieBuffer_encodeHandles.
+ * Takes ownership of all file descriptors, excess buffers are released.
  *
- * @param socketFd
- * @param outBuffer
+ * @param data serialized batch.
+ * @param size size of serialized batch.
+ * @param fds file descriptors received together with the batch.
+ * @param nfds number of file descriptors.
+ * @param outBuffers array to store received buffers.
+ * @param max size of outBuffers array.
+ * @return number of received buffers, -1 on failure.
  */
-void LorieBuffer_recvHandleFromUnixSocket(int socketFd, LorieBuffer* _Nullable * _Nullable outBuffer);
+int LorieBuffer_decodeHandles(const uint8_t* _Nonnull data, size_t size, int* _Nonnull fds, int nfds, LorieBuffer* _Nullable * _Nonnull outBuffers, size_t max);
 
 /**
  * Attach buffer to GL. Must be done on GL thread.
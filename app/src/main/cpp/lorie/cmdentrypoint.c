@@ -14,15 +14,21 @@
 #include <sys/socket.h>
 #include <sys/prctl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <libgen.h>
 #include <globals.h>
 #include <xkbsrv.h>
 #include <errno.h>
 #include <inpututils.h>
+#include <mi.h>
 #include <randrstr.h>
 #include <linux/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <wchar.h>
+#include <dixstruct.h>
+#include <windowstr.h>
 #include "lorie.h"
 
 #define log(prio, ...) __android_log_print(ANDROID_LOG_ ## prio, "LorieNative", __VA_ARGS__)
@@ -34,14 +40,21 @@ extern DeviceIntPtr lorieMouse, lorieTouch, lorieKeyboard, loriePen, lorieEraser
 extern ScreenPtr pScreenPtr;
 extern int ucs2keysym(long ucs);
 void lorieKeysymKeyboardEvent(KeySym keysym, int down);
+void lorieMapKeysyms(const KeySym *keysyms, int count);
 
 char *xtrans_unix_path_x11 = NULL;
 char *xtrans_unix_dir_x11 = NULL;
 
 struct xorg_list registeredBuffers;
+static uint64_t removedBuffersSent = 0;
+static struct lorie_event_ring* inputRing = NULL;
+static int inputRingFd = -1, inputDoorbell = -1;
+static Bool helloReceived = FALSE; // Written by input thread.
+static OsTimerPtr helloTimer = NULL;
 
 static void* startServer(__unused void* cookie) {
     char* envp[] = { NULL };
+    lorieStartupMark("dix_main");
     exit(dix_main(argc, (char**) argv, envp));
 }
 
@@ -73,6 +86,7 @@ JNIEXPORT jboolean JNICALL
 Java_com_termux_x11_CmdEntryPoint_start(JNIEnv *env, __unused jclass cls, jobjectArray args) {
     pthread_t t;
     JavaVM* vm = NULL;
+    lorieStartupMark("CmdEntryPoint.start");
     // execv's argv array is a bit incompatible with Java's String[], so we do some converting here...
     argc = (*env)->GetArrayLength(env, args) + 1; // Leading executable path
     argv = (char**) calloc(argc, sizeof(char*));
@@ -141,6 +155,7 @@ Java_com_termux_x11_CmdEntryPoint_start(JNIEnv *env, __unused jclass cls, jobjec
     }
 
     log(VERBOSE, "Using TMPDIR=\"%s\"", getenv("TMPDIR"));
+    lorieTraceStart("xserver", getenv("TMPDIR"));
 
     {
         const char *root_dir = dirname(getenv("TMPDIR"));
@@ -193,6 +208,7 @@ Java_com_termux_x11_CmdEntryPoint_start(JNIEnv *env, __unused jclass cls, jobjec
         return JNI_FALSE;
     }
 
+    lorieStartupMark("environment and font path ready");
     (*env)->GetJavaVM(env, &vm);
 
     AChoreographer *choreographer = AChoreographer_getInstance();
@@ -225,191 +241,707 @@ static Bool handleClipboardData(__unused ClientPtr pClient, void *closure) {
     return TRUE;
 }
 
-static Bool handleTouchEvent(__unused ClientPtr pClient, void *closure) {
+/*
+ * Text coming with EVENT_TEXT and EVENT_UNICODE is typed on X server thread since missing keysyms change keymap.
+ * Keysyms of the whole chunk are mapped with one keymap update, then keys are typed in bursts.
+ * Instead of sleeping between characters typing pauses only while focused client does not read its events.
+ */
+#define LORIE_TEXT_BURST 64
+#define LORIE_TEXT_RETRY_MS 2
+
+typedef struct {
+    struct xorg_list entry;
+    int count, position;
+    Bool mapped;
+    KeySym keysyms[];
+} lorieText;
+
+static struct xorg_list pendingText = { &pendingText, &pendingText };
+static OsTimerPtr textTimer = NULL;
+static Bool textWaiting = FALSE, textScheduled = FALSE;
+
+static lorieText* decodeText(const lorieEvent* e) {
+    size_t max = e->type == EVENT_TEXT ? e->text.length : 1;
+    lorieText* text = calloc(1, sizeof(*text) + max * sizeof(KeySym));
+    if (!text)
+        return NULL;
+
+    if (e->type == EVENT_UNICODE)
+        text->keysyms[text->count++] = ucs2keysym((long) e->unicode.code);
+    else {
+        const char *p = e->text.data, *end = p + e->text.length;
+        mbstate_t mbstate = { 0 };
+        while (p < end) {
+            wchar_t wc;
+            size_t len = mbrtowc(&wc, p, end - p, &mbstate);
+            if (len == (size_t) -1 || len == (size_t) -2 || len == 0)
+                break;
+
+            text->keysyms[text->count++] = ucs2keysym((long) wc);
+            p += len;
+        }
+    }
+
+    if (!text->count) {
+        free(text);
+        return NULL;
+    }
+
+    return text;
+}
+
+static Bool focusClientBacklogged(void) {
+    FocusClassPtr focus = GetMaster(lorieKeyboard, MASTER_KEYBOARD)->focus;
+    WindowPtr win = focus ? focus->win : NoneWin;
+    ClientPtr client;
+    if (win == NoneWin || win == PointerRootWin || win == FollowKeyboardWin)
+        return FALSE;
+
+    // Client stays in output pending list only if its socket is full, that means it did not read previous events yet.
+    client = wClient(win);
+    FlushAllOutput();
+    return client && !client->clientGone && !xorg_list_is_empty(&client->output_pending);
+}
+
+static Bool typePendingText(__unused ClientPtr pClient, __unused void *closure);
+
+// Maps keysyms of all texts received so far with one keymap update.
+static void mapPendingText(void) {
+    lorieText* text;
+    KeySym* keysyms;
+    int count = 0;
+
+    xorg_list_for_each_entry(text, &pendingText, entry)
+        if (!text->mapped)
+            count += text->count;
+
+    keysyms = count ? malloc(count * sizeof(KeySym)) : NULL;
+    count = 0;
+    xorg_list_for_each_entry(text, &pendingText, entry) {
+        if (!text->mapped && keysyms)
+            memcpy(keysyms + count, text->keysyms, text->count * sizeof(KeySym));
+        count += text->mapped ? 0 : text->count;
+        text->mapped = TRUE;
+    }
+
+    // Keysyms are mapped one by one while typing if allocation failed.
+    if (keysyms)
+        lorieMapKeysyms(keysyms, count);
+    free(keysyms);
+}
+
+static CARD32 textTimerCallback(__unused OsTimerPtr timer, __unused CARD32 time, __unused void *arg) {
+    QueueWorkProc(typePendingText, NULL, NULL);
+    return 0;
+}
+
+static Bool typePendingText(__unused ClientPtr pClient, __unused void *closure) {
+    // This must be done only on X server thread.
+    int burst = 0;
+    textWaiting = textScheduled = FALSE;
+    while (!xorg_list_is_empty(&pendingText)) {
+        lorieText* text = xorg_list_first_entry(&pendingText, lorieText, entry);
+        if (!text->mapped) {
+            mapPendingText();
+            burst = LORIE_TEXT_BURST; // Check if client got MappingNotify.
+        }
+
+        if (burst >= LORIE_TEXT_BURST) {
+            burst = 0;
+            if (focusClientBacklogged()) {
+                textWaiting = TRUE;
+                textTimer = TimerSet(textTimer, 0, LORIE_TEXT_RETRY_MS, textTimerCallback, NULL);
+                return TRUE;
+            }
+        }
+
+        for (; text->position < text->count && burst < LORIE_TEXT_BURST; burst++) {
+            KeySym ks = text->keysyms[text->position++];
+            lorieKeysymKeyboardEvent(ks, TRUE);
+            lorieKeysymKeyboardEvent(ks, FALSE);
+        }
+
+        if (text->position == text->count) {
+            xorg_list_del(&text->entry);
+            free(text);
+        }
+    }
+
+    return TRUE;
+}
+
+static Bool handleText(__unused ClientPtr pClient, void *closure) {
+    // This must be done only on X server thread.
+    lorieText* text = closure;
+    xorg_list_append(&text->entry, &pendingText);
+    // Typing runs after all texts queued so far are appended, so their keysyms are mapped together.
+    if (!textWaiting && !textScheduled) {
+        textScheduled = TRUE;
+        QueueWorkProc(typePendingText, NULL, NULL);
+    }
+    return TRUE;
+}
+
+static void queueTimedEvents(DeviceIntPtr device, int nevents, CARD32 time) {
+    // The same as queueing part of QueuePointerEvents/QueueTouchEvents, but events get timestamp of original sample.
+    // Historical samples may be older than events queued with current time, timestamps of device must not go backwards.
+    static CARD32 lastTime[MAXDEVICES] = {0};
+    for (int i = 0; i < nevents; i++) {
+        if (time)
+            InputEventList[i].any.time = time;
+        if ((int32_t) (InputEventList[i].any.time - lastTime[device->id]) < 0)
+            InputEventList[i].any.time = lastTime[device->id];
+        lastTime[device->id] = InputEventList[i].any.time;
+        mieqEnqueue(device, &InputEventList[i]);
+    }
+}
+
+static void queueTouchEvent(const lorieEvent* e, CARD32 time) {
+    // DDX touch points belong to input side, so this is done right in input thread with input_lock held.
     ValuatorMask mask;
-    lorieEvent *e = closure;
-    double x = max(min((float) e->touch.x, pScreenPtr->width), 0);
-    double y = max(min((float) e->touch.y, pScreenPtr->height), 0);
+    int type = e->touch.type;
+    double x = max(min((float) e->touch.x, pScreenPtr->width), 0) * 0xFFFF / (float) pScreenPtr->width;
+    double y = max(min((float) e->touch.y, pScreenPtr->height), 0) * 0xFFFF / (float) pScreenPtr->height;
     valuator_mask_zero(&mask);
     DDXTouchPointInfoPtr touch = TouchFindByDDXID(lorieTouch, e->touch.id, FALSE);
 
     // Avoid duplicating events
     if (touch && touch->active) {
         double oldx = 0, oldy = 0;
-        if (e->touch.type == XI_TouchUpdate &&
+        if (type == XI_TouchUpdate &&
             valuator_mask_fetch_double(touch->valuators, 0, &oldx) &&
             valuator_mask_fetch_double(touch->valuators, 1, &oldy) &&
             oldx == x && oldy == y)
-            goto end;
+            return;
     }
 
     // Sometimes activity part does not send XI_TouchBegin and sends only XI_TouchUpdate.
-    if (e->touch.type == XI_TouchUpdate && (!touch || !touch->active))
-        e->touch.type = XI_TouchBegin;
+    if (type == XI_TouchUpdate && (!touch || !touch->active))
+        type = XI_TouchBegin;
 
-    if (e->touch.type == XI_TouchEnd && (!touch || !touch->active))
-        goto end;
+    if (type == XI_TouchEnd && (!touch || !touch->active))
+        return;
 
-    valuator_mask_set_double(&mask, 0, x * 0xFFFF / (float) pScreenPtr->width);
-    valuator_mask_set_double(&mask, 1, y * 0xFFFF / (float) pScreenPtr->height);
-    QueueTouchEvents(lorieTouch, e->touch.type, e->touch.id, 0, &mask);
+    valuator_mask_set_double(&mask, 0, x);
+    valuator_mask_set_double(&mask, 1, y);
+    queueTimedEvents(lorieTouch, GetTouchEvents(InputEventList, lorieTouch, e->touch.id, type, 0, &mask), time);
+}
 
-    end:
-    free(e);
-    return TRUE;
+static void queueMouseMotion(Bool relative, float x, float y) {
+    int flags = relative ? POINTER_RELATIVE | POINTER_ACCELERATE : POINTER_ABSOLUTE | POINTER_SCREEN | POINTER_NORAW;
+    ValuatorMask mask;
+    valuator_mask_zero(&mask);
+    if (!relative) {
+        x = max(0, min(x, pScreenPtr->width));
+        y = max(0, min(y, pScreenPtr->height));
+    }
+    valuator_mask_set_double(&mask, 0, (double) x);
+    valuator_mask_set_double(&mask, 1, (double) y);
+    queueTimedEvents(lorieMouse, GetPointerEvents(InputEventList, lorieMouse, MotionNotify, 0, flags, &mask), 0);
 }
 
-void handleLorieEvents(int fd, __unused int ready, __unused void *ignored) {
+static void queueStylusMotion(DeviceIntPtr device, const lorieEvent* e, CARD32 time) {
+    int flags = POINTER_ABSOLUTE | POINTER_DESKTOP | (device == lorieMouse ? POINTER_NORAW : 0);
     ValuatorMask mask;
-    lorieEvent e = {0};
     valuator_mask_zero(&mask);
+    valuator_mask_set_double(&mask, 0, max(min(e->stylus.x, pScreenPtr->width), 0));
+    valuator_mask_set_double(&mask, 1, max(min(e->stylus.y, pScreenPtr->height), 0));
+    if (device != lorieMouse) {
+        valuator_mask_set_double(&mask, 2, e->stylus.pressure);
+        valuator_mask_set_double(&mask, 3, e->stylus.tilt_x);
+        valuator_mask_set_double(&mask, 4, e->stylus.tilt_y);
+        valuator_mask_set_double(&mask, 5, e->stylus.orientation);
+    }
+    queueTimedEvents(device, GetPointerEvents(InputEventList, device, MotionNotify, 0, flags, &mask), time);
+}
 
-    if (ready & X_NOTIFY_ERROR) {
-        LorieBuffer* buf;
-        InputThreadUnregisterDev(fd);
-        close(fd);
-        conn_fd = -1;
-        lorieEnableClipboardSync(FALSE);
-        while ((buf = LorieBufferList_first(&registeredBuffers)))
-            LorieBuffer_removeFromList(buf);
+/*
+ * Android delivers motion at the rate of the touchscreen/mouse which is often higher than display refresh rate,
+ * but clients redraw only once per frame. Motion is accumulated here and queued once per frame:
+ * relative deltas are summed, for absolute motion only the latest position per device or touch ID is kept.
+ * Anything which is not pure motion (buttons, keys, touch begin/end) flushes pending motion first to keep ordering.
+ * Coalescing is turned off while some client selects raw events, they expect every sample.
+ * If resampling is enabled touch and stylus positions queued at frame boundary are resampled to the frame time
+ * and the real latest positions stay pending marked as exact. They are queued as is before the next boundary
+ * or at the next frame if no newer samples arrive, so pointer always ends up where Android reported it.
+ * Only samples with Android event time are used for resampling, time of arrival is too noisy to compute velocity,
+ * so mouse motion which does not carry it is never resampled.
+ * Must be accessed only with input_lock held.
+ */
+#define LORIE_MAX_COALESCED_TOUCHES 16
+
+lorieResampleConfig lorieResampling = LORIE_RESAMPLE_DEFAULTS;
+static volatile Bool motionCoalescing = TRUE;
+static struct {
+    Bool relative, absolute;
+    float x, y;
+    DeviceIntPtr stylusDevice;
+    lorieEvent stylus;
+    int touchCount;
+    lorieEvent touches[LORIE_MAX_COALESCED_TOUCHES];
+    Bool stylusExact;
+    uint32_t touchesExact; // bit per touches[] entry
+} pendingMotion = {0};
+
+static struct {
+    lorieResampler stylus[3];
+    struct {
+        Bool active;
+        uint16_t id;
+        lorieResampler resampler;
+    } touches[LORIE_MAX_COALESCED_TOUCHES];
+} resamplers = {0};
+
+static lorieResampler* stylusResampler(DeviceIntPtr device) {
+    return &resamplers.stylus[device == lorieMouse ? 0 : (device == loriePen ? 1 : 2)];
+}
+
+static lorieResampler* touchResampler(uint16_t id, Bool create) {
+    int slot = -1;
+    for (int i = 0; i < LORIE_MAX_COALESCED_TOUCHES; i++) {
+        if (resamplers.touches[i].active && resamplers.touches[i].id == id)
+            return &resamplers.touches[i].resampler;
+        if (!resamplers.touches[i].active && slot == -1)
+            slot = i;
+    }
+
+    if (!create || slot == -1)
+        return NULL;
+
+    resamplers.touches[slot].active = TRUE;
+    resamplers.touches[slot].id = id;
+    lorieResamplerReset(&resamplers.touches[slot].resampler);
+    return &resamplers.touches[slot].resampler;
+}
+
+static void touchResamplerRelease(uint16_t id) {
+    // Touch sequence ended or started, motion of the next sequence has nothing to do with samples of this one.
+    for (int i = 0; i < LORIE_MAX_COALESCED_TOUCHES; i++)
+        if (resamplers.touches[i].active && resamplers.touches[i].id == id)
+            resamplers.touches[i].active = FALSE;
+}
+
+// Returns TRUE if any of pending positions was resampled.
+static Bool resamplePendingMotion(CARD32 frameTime) {
+    lorieResampler* resampler;
+    Bool resampled = FALSE;
+    float x, y;
+
+    if (pendingMotion.stylusDevice && !pendingMotion.stylusExact)
+        resampled |= lorieResample(stylusResampler(pendingMotion.stylusDevice), &lorieResampling, frameTime,
+                                   &pendingMotion.stylus.stylus.x, &pendingMotion.stylus.stylus.y);
+
+    for (int i = 0; i < pendingMotion.touchCount; i++) {
+        lorieEvent* e = &pendingMotion.touches[i];
+        if (pendingMotion.touchesExact & (1u << i))
+            continue;
+        if ((resampler = touchResampler(e->touch.id, FALSE)) && lorieResample(resampler, &lorieResampling, frameTime, &x, &y)) {
+            e->touch.x = (uint16_t) max(x + 0.5f, 0);
+            e->touch.y = (uint16_t) max(y + 0.5f, 0);
+            resampled = TRUE;
+        }
+    }
+
+    return resampled;
+}
+
+static void flushMotionLocked(void) {
+    if (pendingMotion.relative || pendingMotion.absolute || pendingMotion.stylusDevice || pendingMotion.touchCount)
+        lorieTraceInstant("motion queued", pendingMotion.touchCount);
+    if (pendingMotion.relative || pendingMotion.absolute)
+        queueMouseMotion(pendingMotion.relative, pendingMotion.x, pendingMotion.y);
+    if (pendingMotion.stylusDevice)
+        queueStylusMotion(pendingMotion.stylusDevice, &pendingMotion.stylus, 0);
+    for (int i = 0; i < pendingMotion.touchCount; i++)
+        queueTouchEvent(&pendingMotion.touches[i], 0);
+
+    pendingMotion.relative = pendingMotion.absolute = FALSE;
+    pendingMotion.x = pendingMotion.y = 0;
+    pendingMotion.stylusDevice = NULL;
+    pendingMotion.touchCount = 0;
+    pendingMotion.stylusExact = FALSE;
+    pendingMotion.touchesExact = 0;
+}
+
+void lorieFlushMotion(CARD32 frameTime) {
+    __typeof__(pendingMotion) exact, resampled;
+    input_lock();
+    exact = pendingMotion;
+    if (!lorieResampling.enabled || !resamplePendingMotion(frameTime)) {
+        flushMotionLocked();
+        input_unlock();
         return;
     }
 
-    again:
-    if (read(fd, &e, sizeof(e)) == sizeof(e)) {
-        switch(e.type) {
-            case EVENT_SCREEN_SIZE: {
-                lorieEvent *copy = calloc(1, sizeof(lorieEvent) + e.screenSize.name_size + 1);
-                memcpy(copy, &e, sizeof(e));
-                copy->screenSize.name = copy->screenSize.name_size ? (char*) (copy + 1) : NULL;
-                if (copy->screenSize.name_size)
-                    read(fd, copy->screenSize.name, copy->screenSize.name_size);
-                QueueWorkProc(sendConfigureNotify, NULL, copy);
-                lorieWakeServer();
-                break;
-            }
-            case EVENT_TOUCH: {
-                lorieEvent *copy = calloc(1, sizeof(lorieEvent));
-                memcpy(copy, &e, sizeof(e));
-                QueueWorkProc(handleTouchEvent, NULL, copy);
-                lorieWakeServer();
+    resampled = pendingMotion;
+    flushMotionLocked();
+
+    // Keep real positions which were not queued.
+    if (exact.stylusDevice && !exact.stylusExact
+            && (exact.stylus.stylus.x != resampled.stylus.stylus.x || exact.stylus.stylus.y != resampled.stylus.stylus.y)) {
+        pendingMotion.stylusDevice = exact.stylusDevice;
+        pendingMotion.stylus = exact.stylus;
+        pendingMotion.stylusExact = TRUE;
+    }
+
+    for (int i = 0; i < exact.touchCount; i++) {
+        if ((exact.touchesExact & (1u << i)) || (exact.touches[i].touch.x == resampled.touches[i].touch.x
+                                                 && exact.touches[i].touch.y == resampled.touches[i].touch.y))
+            continue;
+        pendingMotion.touchesExact |= 1u << pendingMotion.touchCount;
+        pendingMotion.touches[pendingMotion.touchCount++] = exact.touches[i];
+    }
+
+    input_unlock();
+}
+
+void lorieSetMotionCoalescing(Bool enable) {
+    if (motionCoalescing == enable)
+        return;
+
+    input_lock();
+    motionCoalescing = enable;
+    flushMotionLocked();
+    input_unlock();
+}
+
+static void coalesceMouseMotion(Bool relative, float x, float y) {
+    if (!motionCoalescing) {
+        queueMouseMotion(relative, x, y);
+        return;
+    }
+
+    if (relative ? pendingMotion.absolute : pendingMotion.relative)
+        flushMotionLocked();
+
+    if (relative) {
+        pendingMotion.relative = TRUE;
+        pendingMotion.x += x;
+        pendingMotion.y += y;
+    } else {
+        pendingMotion.absolute = TRUE;
+        pendingMotion.x = x;
+        pendingMotion.y = y;
+    }
+}
+
+static void coalesceStylusMotion(DeviceIntPtr device, const lorieEvent* e, CARD32 time) {
+    if (!motionCoalescing) {
+        queueStylusMotion(device, e, time);
+        return;
+    }
+
+    if (pendingMotion.stylusDevice && pendingMotion.stylusDevice != device)
+        flushMotionLocked();
+
+    pendingMotion.stylusDevice = device;
+    pendingMotion.stylus = *e;
+    pendingMotion.stylusExact = FALSE;
+    if (time)
+        lorieResamplerAdd(stylusResampler(device), time, e->stylus.x, e->stylus.y);
+    else
+        lorieResamplerReset(stylusResampler(device));
+}
+
+static void coalesceTouchEvent(const lorieEvent* e, CARD32 time) {
+    lorieResampler* resampler;
+    int i;
+    if (e->touch.type != XI_TouchUpdate)
+        touchResamplerRelease(e->touch.id);
+
+    if (!motionCoalescing || e->touch.type != XI_TouchUpdate) {
+        flushMotionLocked();
+        queueTouchEvent(e, time);
+        return;
+    }
+
+    for (i = 0; i < pendingMotion.touchCount; i++)
+        if (pendingMotion.touches[i].touch.id == e->touch.id)
+            break;
+
+    if (i == LORIE_MAX_COALESCED_TOUCHES) {
+        flushMotionLocked();
+        i = 0;
+    }
+
+    pendingMotion.touches[i] = *e;
+    pendingMotion.touchCount = max(pendingMotion.touchCount, i + 1);
+    pendingMotion.touchesExact &= ~(1u << i);
+    if ((resampler = touchResampler(e->touch.id, TRUE)) && time)
+        lorieResamplerAdd(resampler, time, e->touch.x, e->touch.y);
+    else if (resampler)
+        lorieResamplerReset(resampler);
+}
+
+static int stylusButtons = 0;
+static void handleStylusEvent(const lorieEvent* e, CARD32 time) {
+    uint32_t released, pressed, diff;
+    DeviceIntPtr device = e->stylus.mouse ? lorieMouse : (e->stylus.eraser ? lorieEraser : loriePen);
+    if (!device) {
+        lorieTraceInstant("stylus event without device", 0);
+        return;
+    }
+    lorieTraceInstant("stylus event", e->stylus.pressure);
+
+    coalesceStylusMotion(device, e, time);
+
+    diff = stylusButtons ^ e->stylus.buttons;
+    released = diff & ~e->stylus.buttons;
+    pressed = diff & e->stylus.buttons;
+    if (diff)
+        flushMotionLocked(); // Buttons must be pressed at the latest position.
+
+    for (int i=0; i<3; i++) {
+        if (released & 0x1) {
+            queueTimedEvents(device, GetPointerEvents(InputEventList, device, ButtonRelease, i + 1, POINTER_RELATIVE, NULL), 0);
+            lorieTraceInstant("stylus button released", i + 1);
+        }
+        if (pressed & 0x1) {
+            queueTimedEvents(device, GetPointerEvents(InputEventList, device, ButtonPress, i + 1, POINTER_RELATIVE, NULL), 0);
+            lorieTraceInstant("stylus button pressed", i + 1);
+        }
+        released >>= 1;
+        pressed >>= 1;
+    }
+    stylusButtons = e->stylus.buttons;
+}
+
+static void handleMotionBatch(const lorieEvent* e) {
+    // Samples of one Android MotionEvent: history first, the current sample last.
+    CARD32 now = GetTimeInMillis();
+    lorieMotionSample sample;
+
+    for (int i = 0; i < e->motionBatch.count; i++) {
+        lorieDecodeMotionSample(e, i, &sample);
+        // Sample time can not be in the future, clocks of both processes may be slightly different.
+        sample.time = (int32_t) (sample.time - now) > 0 ? now : sample.time;
+        if (e->motionBatch.device == LORIE_MOTION_TOUCH) {
+            lorieEvent touch = { .touch = { .t = EVENT_TOUCH, .type = XI_TouchUpdate, .id = sample.id, .x = (uint16_t) sample.x, .y = (uint16_t) sample.y } };
+            coalesceTouchEvent(&touch, sample.time);
+        } else {
+            lorieEvent stylus = { .stylus = {
+                    .t = EVENT_STYLUS, .x = sample.x, .y = sample.y, .pressure = sample.pressure,
+                    .tilt_x = sample.tilt_x, .tilt_y = sample.tilt_y, .orientation = sample.orientation,
+                    // Buttons changed at the time of the current sample, history was recorded with previous state.
+                    .buttons = i == e->motionBatch.count - 1 ? e->motionBatch.buttons : stylusButtons, .eraser = e->motionBatch.eraser, .mouse = e->motionBatch.mouse,
+            } };
+            handleStylusEvent(&stylus, sample.time);
+        }
+    }
+}
+
+static void handleLorieInputRing(int fd, __unused int ready, __unused void *ignored);
+static void handleLorieEvent(int fd, lorieEvent* e) {
+    ValuatorMask mask;
+    valuator_mask_zero(&mask);
+    lorieTraceInstant("input received", e->type);
+
+    if (!__atomic_load_n(&helloReceived, __ATOMIC_ACQUIRE) && e->type != EVENT_HELLO) {
+        log(ERROR, "Activity sent message %d before protocol handshake, disconnecting", e->type);
+        shutdown(fd, SHUT_RDWR); // Connection will be dropped in the next handleLorieEvents call.
+        return;
+    }
+
+    switch(e->type) {
+        case EVENT_TOUCH:
+        case EVENT_MOUSE:
+        case EVENT_KEY:
+        case EVENT_STYLUS:
+        case EVENT_UNICODE:
+        case EVENT_MOTION_BATCH:
+        case EVENT_TEXT:
+            lorieNoteInput();
+            break;
+        default:
+            break;
+    }
+
+    switch(e->type) {
+        case EVENT_TOUCH:
+        case EVENT_STYLUS:
+        case EVENT_MOTION_BATCH:
+            break; // These handle pending motion themselves.
+        case EVENT_MOUSE:
+            if (e->mouse.detail == 0) // BUTTON_UNDEFINED
                 break;
-            }
-            case EVENT_STYLUS: {
-                static int buttons_prev = 0;
-                uint32_t released, pressed, diff;
-                DeviceIntPtr device = e.stylus.mouse ? lorieMouse : (e.stylus.eraser ? lorieEraser : loriePen);
-                if (!device) {
-                    __android_log_print(ANDROID_LOG_DEBUG, "LorieNative", "got stylus event but device is not requested\n");
+            // fallthrough
+        default:
+            flushMotionLocked();
+    }
+
+    switch(e->type) {
+        case EVENT_SCREEN_SIZE: {
+            lorieEvent *copy = calloc(1, sizeof(lorieEvent) + e->screenSize.name_size + 1);
+            memcpy(copy, e, sizeof(*e));
+            // Decoded name points to the message buffer which will be reused.
+            copy->screenSize.name = copy->screenSize.name_size ? (char*) (copy + 1) : NULL;
+            if (copy->screenSize.name_size)
+                memcpy(copy->screenSize.name, e->screenSize.name, copy->screenSize.name_size);
+            QueueWorkProc(sendConfigureNotify, NULL, copy);
+            lorieWakeServer();
+            break;
+        }
+        case EVENT_TOUCH:
+            coalesceTouchEvent(e, 0);
+            break;
+        case EVENT_STYLUS:
+            handleStylusEvent(e, 0);
+            break;
+        case EVENT_MOTION_BATCH:
+            handleMotionBatch(e);
+            break;
+        case EVENT_STYLUS_ENABLE: {
+            lorieSetStylusEnabled(e->stylusEnable.enable);
+            break;
+        }
+        case EVENT_MOUSE: {
+            switch(e->mouse.detail) {
+                case 0: // BUTTON_UNDEFINED
+                    coalesceMouseMotion(e->mouse.relative, e->mouse.x, e->mouse.y);
                     break;
-                }
-                __android_log_print(ANDROID_LOG_DEBUG, "LorieNative", "got stylus event %f %f %d %d %d %d %s\n", e.stylus.x, e.stylus.y, e.stylus.pressure, e.stylus.tilt_x, e.stylus.tilt_y, e.stylus.orientation,
-                                    device == lorieMouse ? "lorieMouse" : (device == loriePen ? "loriePen" : "lorieEraser"));
-
-                valuator_mask_set_double(&mask, 0, max(min(e.stylus.x, pScreenPtr->width), 0));
-                valuator_mask_set_double(&mask, 1, max(min(e.stylus.y, pScreenPtr->height), 0));
-                if (device != lorieMouse) {
-                    valuator_mask_set_double(&mask, 2, e.stylus.pressure);
-                    valuator_mask_set_double(&mask, 3, e.stylus.tilt_x);
-                    valuator_mask_set_double(&mask, 4, e.stylus.tilt_y);
-                    valuator_mask_set_double(&mask, 5, e.stylus.orientation);
-                }
-                QueuePointerEvents(device, MotionNotify, 0, POINTER_ABSOLUTE | POINTER_DESKTOP | (device == lorieMouse ? POINTER_NORAW : 0), &mask);
-
-                diff = buttons_prev ^ e.stylus.buttons;
-                released = diff & ~e.stylus.buttons;
-                pressed = diff & e.stylus.buttons;
-
-                for (int i=0; i<3; i++) {
-                    if (released & 0x1) {
-                        QueuePointerEvents(device, ButtonRelease, i + 1, POINTER_RELATIVE, NULL);
-                        __android_log_print(ANDROID_LOG_DEBUG, "LorieNative", "sending %d press", i+1);
+                case 1: // BUTTON_LEFT
+                case 2: // BUTTON_MIDDLE
+                case 3: // BUTTON_RIGHT
+                    queueTimedEvents(lorieMouse, GetPointerEvents(InputEventList, lorieMouse, e->mouse.down ? ButtonPress : ButtonRelease, e->mouse.detail, POINTER_RELATIVE, NULL), 0);
+                    break;
+                case 4: // BUTTON_SCROLL
+                    if (e->mouse.x) {
+                        valuator_mask_zero(&mask);
+                        valuator_mask_set_double(&mask, 2, (double) e->mouse.x / 120);
+                        queueTimedEvents(lorieMouse, GetPointerEvents(InputEventList, lorieMouse, MotionNotify, 0, POINTER_RELATIVE, &mask), 0);
                     }
-                    if (pressed & 0x1) {
-                        QueuePointerEvents(device, ButtonPress, i + 1, POINTER_RELATIVE, NULL);
-                        __android_log_print(ANDROID_LOG_DEBUG, "LorieNative", "sending %d release", i+1);
+                    if (e->mouse.y) {
+                        valuator_mask_zero(&mask);
+                        valuator_mask_set_double(&mask, 3, (double) e->mouse.y / 120);
+                        queueTimedEvents(lorieMouse, GetPointerEvents(InputEventList, lorieMouse, MotionNotify, 0, POINTER_RELATIVE, &mask), 0);
                     }
-                    released >>= 1;
-                    pressed >>= 1;
-                }
-                buttons_prev = e.stylus.buttons;
-
-                break;
-            }
-            case EVENT_STYLUS_ENABLE: {
-                lorieSetStylusEnabled(e.stylusEnable.enable);
-                break;
+                    break;
             }
-            case EVENT_MOUSE: {
-                int flags;
-                switch(e.mouse.detail) {
-                    case 0: // BUTTON_UNDEFINED
-                        flags = (e.mouse.relative) ? POINTER_RELATIVE | POINTER_ACCELERATE : POINTER_ABSOLUTE | POINTER_SCREEN | POINTER_NORAW;
-                        if (!e.mouse.relative) {
-                            e.mouse.x = max(0, min(e.mouse.x, pScreenPtr->width));
-                            e.mouse.y = max(0, min(e.mouse.y, pScreenPtr->height));
-                        }
-                        valuator_mask_set_double(&mask, 0, (double) e.mouse.x);
-                        valuator_mask_set_double(&mask, 1, (double) e.mouse.y);
-                        QueuePointerEvents(lorieMouse, MotionNotify, 0, flags, &mask);
-                        break;
-                    case 1: // BUTTON_LEFT
-                    case 2: // BUTTON_MIDDLE
-                    case 3: // BUTTON_RIGHT
-                        QueuePointerEvents(lorieMouse, e.mouse.down ? ButtonPress : ButtonRelease, e.mouse.detail, POINTER_RELATIVE, NULL);
-                        break;
-                    case 4: // BUTTON_SCROLL
-                        if (e.mouse.x) {
-                            valuator_mask_zero(&mask);
-                            valuator_mask_set_double(&mask, 2, (double) e.mouse.x / 120);
-                            QueuePointerEvents(lorieMouse, MotionNotify, 0, POINTER_RELATIVE, &mask);
-                        }
-                        if (e.mouse.y) {
-                            valuator_mask_zero(&mask);
-                            valuator_mask_set_double(&mask, 3, (double) e.mouse.y / 120);
-                            QueuePointerEvents(lorieMouse, MotionNotify, 0, POINTER_RELATIVE, &mask);
-                        }
-                        break;
-                }
-                break;
+            break;
+        }
+        case EVENT_KEY:
+            QueueKeyboardEvents(lorieKeyboard, e->key.state ? KeyPress : KeyRelease, e->key.key);
+            break;
+        case EVENT_UNICODE:
+        case EVENT_TEXT: {
+            // Decoded text points to the message buffer which will be reused.
+            lorieText* text = decodeText(e);
+            if (text) {
+                QueueWorkProc(handleText, NULL, text);
+                lorieWakeServer();
             }
-            case EVENT_KEY:
-                QueueKeyboardEvents(lorieKeyboard, e.key.state ? KeyPress : KeyRelease, e.key.key);
-                break;
-            case EVENT_UNICODE: {
-                int ks = ucs2keysym((long) e.unicode.code);
-                __android_log_print(ANDROID_LOG_DEBUG, "LorieNative", "Trying to input keysym %d\n", ks);
-                lorieKeysymKeyboardEvent(ks, TRUE);
-                lorieKeysymKeyboardEvent(ks, FALSE);
+            break;
+        }
+        case EVENT_CLIPBOARD_ENABLE:
+            lorieEnableClipboardSync(e->clipboardEnable.enable);
+            break;
+        case EVENT_CLIPBOARD_ANNOUNCE:
+            QueueWorkProc(handleClipboardAnnounce, NULL, NULL);
+            lorieWakeServer();
+            break;
+        case EVENT_CLIPBOARD_SEND: {
+            char *data;
+            if (lorieRecvPayload(fd, e->clipboardSend.count, &data) != 0) {
+                shutdown(fd, SHUT_RDWR); // Connection will be dropped in the next handleLorieEvents call.
                 break;
             }
-            case EVENT_CLIPBOARD_ENABLE:
-                lorieEnableClipboardSync(e.clipboardEnable.enable);
-                break;
-            case EVENT_CLIPBOARD_ANNOUNCE:
-                QueueWorkProc(handleClipboardAnnounce, NULL, NULL);
-                lorieWakeServer();
-                break;
-            case EVENT_CLIPBOARD_SEND: {
-                char *data = calloc(1, e.clipboardSend.count + 1);
-                read(conn_fd, data, e.clipboardSend.count);
-                data[e.clipboardSend.count] = 0;
+
+            if (data) {
                 QueueWorkProc(handleClipboardData, NULL, data);
                 lorieWakeServer();
             }
+            break;
         }
+        case EVENT_HELLO:
+            if (!lorieCheckHello(e)) {
+                shutdown(fd, SHUT_RDWR); // Connection will be dropped in the next handleLorieEvents call.
+                break;
+            }
+
+            __atomic_store_n(&helloReceived, TRUE, __ATOMIC_RELEASE);
+            if (inputDoorbell != -1)
+                handleLorieInputRing(inputDoorbell, 0, NULL); // Events written before handshake were not read.
+            break;
+    }
+}
+
+void handleLorieEvents(int fd, __unused int ready, __unused void *ignored) {
+    static uint8_t data[LORIE_MESSAGE_MAX_SIZE]; // Used only in input thread.
+    lorieEvent e = {0};
+    int n;
 
-        int n;
-        if (ioctl(fd, FIONREAD, &n) >= 0 && n > sizeof(e))
-            goto again;
+    if (ready & X_NOTIFY_ERROR) {
+        LorieBuffer* buf;
+        InputThreadUnregisterDev(fd);
+        if (inputDoorbell != -1)
+            InputThreadUnregisterDev(inputDoorbell);
+        close(fd);
+        conn_fd = -1;
+        lorieEnableClipboardSync(FALSE);
+        while ((buf = LorieBufferList_first(&registeredBuffers)))
+            LorieBuffer_removeFromList(buf);
+        LorieBufferPool_retireAll(); // Renderer releases all buffers on disconnect.
+        return;
     }
+
+    do {
+        if (lorieRecvEvent(fd, &e, data, NULL, NULL) != 0)
+            break;
+        handleLorieEvent(fd, &e);
+    } while (ioctl(fd, FIONREAD, &n) >= 0 && n > 0);
+}
+
+static void handleLorieInputRing(int fd, __unused int ready, __unused void *ignored) {
+    uint8_t data[LORIE_MOTION_BATCH_MAX_SIZE]; // Input events are not longer than that, longer records are skipped.
+    lorieEvent e;
+    uint64_t count;
+    read(fd, &count, sizeof(count)); // Reset the doorbell
+    if (!__atomic_load_n(&helloReceived, __ATOMIC_ACQUIRE))
+        return; // Ring is drained when hello arrives.
+
+    lorieEventRingWake(inputRing);
+
+    do {
+        int32_t size;
+        while ((size = lorieEventRingRead(inputRing, data, sizeof(data))) >= 0)
+            if (size <= sizeof(data) && lorieDecodeEvent(data, size, &e) > 0)
+                handleLorieEvent(conn_fd, &e);
+    } while (!lorieEventRingSleep(inputRing));
+}
+
+static void lorieSendInputRing(void) {
+    if (!inputRing) {
+        int fd = LorieBuffer_createRegion("lorie-input", sizeof(*inputRing));
+        struct lorie_event_ring* ring = fd < 0 ? MAP_FAILED : mmap(NULL, sizeof(*inputRing), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        int doorbell = ring == MAP_FAILED ? -1 : eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (doorbell < 0) {
+            // Activity will use socket for input events.
+            log(ERROR, "Failed to create input event ring: %s", strerror(errno));
+            if (ring != MAP_FAILED)
+                munmap(ring, sizeof(*inputRing));
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        inputRing = ring;
+        inputRingFd = fd;
+        inputDoorbell = doorbell;
+    }
+
+    InputThreadUnregisterDev(inputDoorbell);
+    lorieEventRingReset(inputRing);
+    InputThreadRegisterDev(inputDoorbell, handleLorieInputRing, NULL);
+
+    lorieEvent e = { .type = EVENT_INPUT_RING };
+    lorieSendEvent(conn_fd, &e, (int[]) { inputRingFd, inputDoorbell }, 2);
 }
 
 void lorieSendClipboardData(const char* data) {
     if (data && conn_fd != -1) {
         size_t len = strlen(data);
         lorieEvent e = { .clipboardSend = { .t = EVENT_CLIPBOARD_SEND, .count = len } };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
         write(conn_fd, data, len);
     }
 }
@@ -417,7 +949,7 @@ void lorieSendClipboardData(const char* data) {
 void lorieRequestClipboard(void) {
     if (conn_fd != -1) {
         lorieEvent e = { .type = EVENT_CLIPBOARD_REQUEST };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
     }
 }
 
@@ -430,9 +962,24 @@ bool lorieConnectionAlive(void) {
     return !(poll(&p, 1, 0) == 1 && (p.revents & (POLLERR | POLLNVAL | POLLRDHUP | POLLHUP)));
 }
 
+static CARD32 helloTimeout(__unused OsTimerPtr timer, __unused CARD32 time, void *arg) {
+    int fd = (int) (int64_t) arg;
+    if (conn_fd == fd && !__atomic_load_n(&helloReceived, __ATOMIC_ACQUIRE)) {
+        log(ERROR, "Activity did not complete protocol handshake in %d ms, disconnecting", LORIE_HELLO_TIMEOUT_MS);
+        dprintf(2, "Termux:X11 activity did not complete protocol handshake, disconnecting\n");
+        shutdown(fd, SHUT_RDWR);
+    }
+    return 0;
+}
+
 static Bool addFd(__unused ClientPtr pClient, void *closure) {
+    __atomic_store_n(&helloReceived, FALSE, __ATOMIC_RELEASE);
     InputThreadRegisterDev((int) (int64_t) closure, handleLorieEvents, NULL);
     conn_fd = (int) (int64_t) closure;
+    removedBuffersSent = 0;
+    helloTimer = TimerSet(helloTimer, 0, LORIE_HELLO_TIMEOUT_MS, helloTimeout, closure);
+    lorieSendEvent(conn_fd, &(lorieEvent) { .hello = { .t = EVENT_HELLO, .version = LORIE_PROTOCOL_VERSION } }, NULL, 0);
+    lorieSendInputRing();
     lorieActivityConnected();
     return TRUE;
 }
@@ -440,26 +987,67 @@ static Bool addFd(__unused ClientPtr pClient, void *closure) {
 void lorieSendSharedServerState(int memfd) {
     if (conn_fd != -1) {
         lorieEvent e = { .type = EVENT_SHARED_SERVER_STATE };
-        write(conn_fd, &e, sizeof(e));
-        ancil_send_fd(conn_fd, memfd);
+        lorieSendEvent(conn_fd, &e, &memfd, 1);
     }
 }
 
-void lorieRegisterBuffer(LorieBuffer* buffer) {
-    unsigned long id = LorieBuffer_description(buffer)->id;
-    if (conn_fd == -1 || LorieBufferList_findById(&registeredBuffers, id))
-        return; // Already registered
+// Buffers are marked as registered only if renderer got them, so failed ones are sent again next time.
+static void lorieSendBufferBatch(LorieBuffer** batch, size_t count) {
+    uint8_t handles[LORIEBUFFER_MAX_HANDLES_SIZE];
+    int fds[LORIE_MESSAGE_MAX_FDS], nfds, ahbSocket, ret;
+    lorieEvent e = { .addBuffer = { .t = EVENT_ADD_BUFFER, .data = handles } };
+    if (!count)
+        return;
 
-    if (conn_fd != -1 && buffer) {
-        lorieEvent e = { .type = EVENT_ADD_BUFFER };
-        write(conn_fd, &e, sizeof(e));
-        LorieBuffer_sendHandleToUnixSocket(buffer, conn_fd);
-        LorieBuffer_addToList(buffer, &registeredBuffers);
-        const LorieBuffer_Desc* desc = LorieBuffer_description(buffer);
+    if (!(e.addBuffer.size = LorieBuffer_encodeHandles(batch, count, handles, fds, &nfds, &ahbSocket))) {
+        log(ERROR, "Failed to serialize %zu shared buffers: %s", count, strerror(errno));
+        return;
+    }
+
+    ret = lorieSendEvent(conn_fd, &e, fds, nfds);
+    if (ahbSocket != -1)
+        close(ahbSocket);
+    if (ret != 0) {
+        log(ERROR, "Failed to send %zu shared buffers: %s", count, strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const LorieBuffer_Desc* desc = LorieBuffer_description(batch[i]);
+        LorieBuffer_addToList(batch[i], &registeredBuffers);
         log(INFO, "Sent shared buffer width %d stride %d height %d format %d type %d id %llu", desc->width, desc->stride, desc->height, desc->format, desc->type, desc->id);
     }
 }
 
+void lorieRegisterBuffers(LorieBuffer** buffers, size_t count) {
+    LorieBuffer* batch[LORIEBUFFER_MAX_BATCH];
+    size_t n = 0;
+    if (conn_fd == -1 || !buffers)
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t j;
+        if (!buffers[i] || LorieBufferList_findById(&registeredBuffers, LorieBuffer_description(buffers[i])->id))
+            continue; // Already registered
+
+        for (j = 0; j < n && batch[j] != buffers[i]; j++);
+        if (j < n)
+            continue; // Already in this batch
+
+        batch[n++] = buffers[i];
+        if (n == LORIEBUFFER_MAX_BATCH) {
+            lorieSendBufferBatch(batch, n);
+            n = 0;
+        }
+    }
+
+    lorieSendBufferBatch(batch, n);
+}
+
+void lorieRegisterBuffer(LorieBuffer* buffer) {
+    lorieRegisterBuffers(&buffer, 1);
+}
+
 void lorieUnregisterBuffer(LorieBuffer* buffer) {
     unsigned long id;
     if (!buffer || (!LorieBufferList_findById(&registeredBuffers, (id = LorieBuffer_description(buffer)->id))))
@@ -467,8 +1055,9 @@ void lorieUnregisterBuffer(LorieBuffer* buffer) {
 
     if (conn_fd != -1 && buffer) {
         lorieEvent e = { .removeBuffer = { .t = EVENT_REMOVE_BUFFER, .id = id } };
-        write(conn_fd, &e, sizeof(e));
+        lorieSendEvent(conn_fd, &e, NULL, 0);
         LorieBuffer_removeFromList(buffer);
+        LorieBuffer_setRetireSerial(buffer, ++removedBuffersSent);
     }
 }
 
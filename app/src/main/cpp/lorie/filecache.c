@@ -0,0 +1,174 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "filecache.h"
+
+typedef struct {
+    struct timespec mtime;
+    off_t size;
+    char name[NAME_MAX + 1];
+} CacheEntry;
+
+static const char* cacheDir(char* dir, size_t size, const char* cache) {
+    snprintf(dir, size, "%s/%s", getenv("TMPDIR") ?: "/tmp", cache);
+    return dir;
+}
+
+__LIBC_HIDDEN__ uint64_t lorieCacheHash(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    return hash;
+}
+
+__LIBC_HIDDEN__ uint64_t lorieCacheHashFile(uint64_t hash, const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return lorieCacheHash(hash, "-", 1); // File appearing later must change the key too.
+
+    hash = lorieCacheHash(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = lorieCacheHash(hash, &st.st_size, sizeof(st.st_size));
+    return lorieCacheHash(hash, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+__LIBC_HIDDEN__ bool lorieCacheEntryPath(char* path, size_t size, const char* cache, uint64_t hash, const char* suffix) {
+    char dir[PATH_MAX];
+    int len;
+
+    cacheDir(dir, sizeof(dir), cache);
+    mkdir(dir, 0700);
+    len = snprintf(path, size, "%s/%016" PRIx64 "%s", dir, hash, suffix ?: "");
+    return len > 0 && (size_t) len < size;
+}
+
+__LIBC_HIDDEN__ void lorieCacheTouch(const char* path) {
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+__LIBC_HIDDEN__ bool lorieCacheLinkFile(const char* from, const char* to) {
+    struct stat st;
+    void* data = MAP_FAILED;
+    int in, out = -1;
+    bool ok = false;
+
+    if (link(from, to) == 0)
+        return true;
+
+    // Copy through mmap, i.e. on filesystems which do not support hard links.
+    if ((in = open(from, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+
+    if (fstat(in, &st) != 0 || st.st_size <= 0)
+        goto out;
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+    out = open(to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (data == MAP_FAILED || out < 0)
+        goto out;
+
+    ok = write(out, data, st.st_size) == st.st_size;
+
+out:
+    if (data != MAP_FAILED)
+        munmap(data, st.st_size);
+    if (out >= 0 && close(out) != 0)
+        ok = false;
+    if (out >= 0 && !ok)
+        unlink(to);
+    close(in);
+    return ok;
+}
+
+static bool publish(const char* tmp, const char* path, bool written) {
+    if (written && rename(tmp, path) == 0)
+        return true;
+
+    unlink(tmp);
+    return false;
+}
+
+__LIBC_HIDDEN__ bool lorieCachePublishData(const char* path, const void* data, size_t size) {
+    char tmp[PATH_MAX + 16];
+    bool ok;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return false;
+
+    ok = write(fd, data, size) == (ssize_t) size;
+    ok = close(fd) == 0 && ok;
+    return publish(tmp, path, ok);
+}
+
+__LIBC_HIDDEN__ bool lorieCachePublishFile(const char* path, const char* from) {
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    unlink(tmp);
+    return publish(tmp, path, lorieCacheLinkFile(from, tmp));
+}
+
+static int compareEntries(const void* a, const void* b) {
+    const struct timespec *x = &((const CacheEntry*) a)->mtime, *y = &((const CacheEntry*) b)->mtime;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/*
+ * Called after publishing new entry. Temporary files left by killed processes are old, so they are removed the same way.
+ * Hard linked entries are counted with their full size although removing them may not free any space.
+ */
+__LIBC_HIDDEN__ void lorieCacheTrim(const char* cache, uint64_t maxBytes) {
+    CacheEntry* entries = NULL;
+    size_t count = 0, capacity = 0, i;
+    uint64_t total = 0;
+    char dir[PATH_MAX], path[PATH_MAX + NAME_MAX + 2];
+    struct dirent* d;
+    struct stat st;
+    DIR* dp;
+
+    if (!(dp = opendir(cacheDir(dir, sizeof(dir), cache))))
+        return;
+
+    while ((d = readdir(dp))) {
+        snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+        if (d->d_name[0] == '.' || lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (count == capacity) {
+            CacheEntry* grown = realloc(entries, (capacity = capacity ? capacity * 2 : 64) * sizeof(*entries));
+            if (!grown)
+                break;
+            entries = grown;
+        }
+
+        entries[count].mtime = st.st_mtim;
+        entries[count].size = st.st_size;
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", d->d_name);
+        total += st.st_size;
+        count++;
+    }
+    closedir(dp);
+
+    if (total > maxBytes) {
+        qsort(entries, count, sizeof(*entries), compareEntries);
+        for (i = 0; i < count && total > maxBytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0)
+                total -= entries[i].size;
+        }
+    }
+
+    free(entries);
+}
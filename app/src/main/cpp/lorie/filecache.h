@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Helpers shared by on-disk caches of X server (compiled keymaps, parsed font directories).
+ * Cache entries live in $TMPDIR/<cache name>, file name is a hash of everything the entry depends on,
+ * so any change of inputs makes the old entry unused instead of stale. Unused entries are removed by trimming,
+ * the least recently used go first (hits update mtime of the entry).
+ * Entries are written to a temporary file and published with rename, so partially written file can not be picked up.
+ */
+
+#define LORIE_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+// FNV-1a
+uint64_t lorieCacheHash(uint64_t hash, const void* data, size_t size);
+// Hashes inode, size and mtime of the file, missing file changes the hash too.
+uint64_t lorieCacheHashFile(uint64_t hash, const char* path);
+
+// Fills path of the entry and creates cache directory. Returns false if path does not fit.
+bool lorieCacheEntryPath(char* path, size_t size, const char* cache, uint64_t hash, const char* suffix);
+// Marks entry as recently used.
+void lorieCacheTouch(const char* path);
+// Hard links file to new path or copies it where hard links are not allowed, destination must not exist.
+bool lorieCacheLinkFile(const char* from, const char* to);
+// Publishes data or existing file as cache entry.
+bool lorieCachePublishData(const char* path, const void* data, size_t size);
+bool lorieCachePublishFile(const char* path, const char* from);
+// Removes the least recently used entries until the cache is not larger than maxBytes.
+void lorieCacheTrim(const char* cache, uint64_t maxBytes);
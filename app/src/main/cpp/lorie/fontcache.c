@@ -0,0 +1,182 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <X11/fonts/fntfilst.h>
+#include "filecache.h"
+
+/*
+ * Font directory cache.
+ * libXfont reads and parses fonts.dir and fonts.alias of every font path element at startup and on every font path change.
+ * It is slow with big font packages, especially in proot or chroot containers.
+ * dirfile.c is built with FontFileReadDirectory, FontFileAddFontFile and FontFileAddFontAlias renamed (see Xfont2.cmake),
+ * so we can record which fonts and aliases parsing adds to the directory and replay the same calls next time.
+ * Font files themselves are opened only when font is requested, as before.
+ *
+ * Cache files are kept in $TMPDIR/.font-cache (see filecache.h), key is a hash of directory name and
+ * inode, size and mtime of the directory, fonts.dir and fonts.alias.
+ */
+
+#define FONT_CACHE_MAGIC 0x31434e46 // "FNC1"
+#define FONT_CACHE_DIR ".font-cache"
+#define FONT_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+int FontFileReadDirectoryUncached(const char *directory, FontDirectoryPtr *pdir);
+
+typedef struct {
+    uint32_t magic, count;
+    uint64_t dirMtime, aliasMtime;
+} FontCacheHeader;
+
+// Followed by name and file name, both NUL-terminated.
+typedef struct {
+    uint8_t alias;
+    uint8_t pad;
+    uint16_t nameLength, fileLength;
+} FontCacheRecord;
+
+static FILE* recording = NULL;
+static uint32_t recorded = 0;
+
+static void recordEntry(Bool alias, const char* name, const char* file) {
+    FontCacheRecord record = { .alias = alias, .nameLength = strlen(name) + 1, .fileLength = strlen(file) + 1 };
+    if (!recording)
+        return;
+
+    fwrite(&record, sizeof(record), 1, recording);
+    fwrite(name, record.nameLength, 1, recording);
+    fwrite(file, record.fileLength, 1, recording);
+    recorded++;
+}
+
+Bool lorieFontCacheAddFontFile(FontDirectoryPtr dir, char *fontName, char *fileName) {
+    recordEntry(FALSE, fontName, fileName);
+    return FontFileAddFontFile(dir, fontName, fileName);
+}
+
+Bool lorieFontCacheAddFontAlias(FontDirectoryPtr dir, char *aliasName, char *fontName) {
+    recordEntry(TRUE, aliasName, fontName);
+    return FontFileAddFontAlias(dir, aliasName, fontName);
+}
+
+static uint64_t hashFile(uint64_t hash, const char* dir, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return lorieCacheHashFile(hash, path);
+}
+
+static int loadCachedDirectory(const char* cached, const char* directory, FontDirectoryPtr *pdir) {
+    FontDirectoryPtr dir;
+    FontCacheHeader* header;
+    struct stat st;
+    uint8_t *data, *p, *end;
+    uint32_t i;
+    int fd = open(cached, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return BadFontPath;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(FontCacheHeader)) {
+        close(fd);
+        return BadFontPath;
+    }
+
+    // Private writable mapping: libXfont takes non-const names, although it copies them.
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return BadFontPath;
+
+    header = (FontCacheHeader*) data;
+    end = data + st.st_size;
+    if (header->magic != FONT_CACHE_MAGIC || !(dir = FontFileMakeDir(directory, header->count ?: 10))) {
+        munmap(data, st.st_size);
+        return BadFontPath;
+    }
+
+    dir->dir_mtime = header->dirMtime;
+    dir->alias_mtime = header->aliasMtime;
+    for (i = 0, p = data + sizeof(*header); i < header->count; i++) {
+        FontCacheRecord record;
+        char *name, *file;
+        if (end - p < (ptrdiff_t) sizeof(record))
+            break;
+
+        memcpy(&record, p, sizeof(record));
+        name = (char*) p + sizeof(record);
+        file = name + record.nameLength;
+        if (!record.nameLength || !record.fileLength || (uint8_t*) file + record.fileLength > end
+                || name[record.nameLength - 1] || file[record.fileLength - 1])
+            break;
+
+        if (record.alias)
+            FontFileAddFontAlias(dir, name, file);
+        else
+            FontFileAddFontFile(dir, name, file);
+        p = (uint8_t*) file + record.fileLength;
+    }
+
+    munmap(data, st.st_size);
+    if (i != header->count) {
+        // Corrupted entry, read directory the usual way.
+        FontFileFreeDir(dir);
+        unlink(cached);
+        return BadFontPath;
+    }
+
+    FontFileSortDir(dir);
+    lorieCacheTouch(cached);
+    *pdir = dir;
+    return Successful;
+}
+
+int FontFileReadDirectory(const char *directory, FontDirectoryPtr *pdir) {
+    char dirPath[PATH_MAX], cached[PATH_MAX];
+    const char* attributes = strchr(directory, ':');
+    uint64_t hash = LORIE_CACHE_HASH_INIT;
+    FontCacheHeader header = { .magic = FONT_CACHE_MAGIC };
+    char* data = NULL;
+    size_t size = 0;
+    int status;
+    FILE* out;
+
+    // Directory name may be followed by attributes, like "/usr/share/fonts/misc:unscaled".
+    snprintf(dirPath, sizeof(dirPath), "%.*s", (int) (attributes ? attributes - directory : strlen(directory)), directory);
+    hash = lorieCacheHash(hash, directory, strlen(directory) + 1);
+    hash = hashFile(hash, dirPath, ".");
+    hash = hashFile(hash, dirPath, FontDirFile);
+    hash = hashFile(hash, dirPath, FontAliasFile);
+
+    if (!lorieCacheEntryPath(cached, sizeof(cached), FONT_CACHE_DIR, hash, NULL))
+        return FontFileReadDirectoryUncached(directory, pdir);
+    if (loadCachedDirectory(cached, directory, pdir) == Successful)
+        return Successful;
+
+    if (!(out = open_memstream(&data, &size)))
+        return FontFileReadDirectoryUncached(directory, pdir);
+
+    fwrite(&header, sizeof(header), 1, out);
+    recording = out;
+    recorded = 0;
+    status = FontFileReadDirectoryUncached(directory, pdir);
+    recording = NULL;
+
+    if (fclose(out) == 0 && data && status == Successful) {
+        header.count = recorded;
+        header.dirMtime = (*pdir)->dir_mtime;
+        header.aliasMtime = (*pdir)->alias_mtime;
+        memcpy(data, &header, sizeof(header));
+        if (lorieCachePublishData(cached, data, size))
+            lorieCacheTrim(FONT_CACHE_DIR, FONT_CACHE_MAX_BYTES);
+    }
+
+    free(data);
+    return status;
+}
@@ -14,6 +14,8 @@
 #include <sys/socket.h>
 #include "linux/input-event-codes.h"
 #include "buffer.h"
+#include "resample.h"
+#include "trace.h"
 
 #define PORT 7892
 #define MAGIC "0xDEADBEEF"
@@ -29,15 +31,26 @@ void lorieHandleClipboardAnnounce(void);
 void lorieHandleClipboardData(const char* data);
 void lorieSetStylusEnabled(Bool enabled);
 void lorieWakeServer(void);
-void lorieChoreographerFrameCallback(__unused long t, AChoreographer* d);
+void lorieFlushMotion(CARD32 frameTime);
+void lorieNoteInput(void);
+void lorieSetMotionCoalescing(Bool enable);
+extern lorieResampleConfig lorieResampling;
+void lorieChoreographerFrameCallback(long t, AChoreographer* d);
 void lorieActivityConnected(void);
 void lorieSendSharedServerState(int memfd);
 void lorieRegisterBuffer(LorieBuffer* buffer);
+void lorieRegisterBuffers(LorieBuffer** buffers, size_t count);
 void lorieUnregisterBuffer(LorieBuffer* buffer);
 bool lorieConnectionAlive(void);
+Bool lorieXvInit(ScreenPtr pScreen);
+void lorieStartupSetDirectory(const char* dir);
+void lorieStartupReset(void);
+void lorieStartupMark(const char* phase);
+void lorieStartupFinish(const char* process);
+void lorieRequestProfilerInit(Bool start);
 
 __unused void rendererInit(JNIEnv* env);
-__unused void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip);
+__unused void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip, bool reprobe);
 __unused void rendererSetWindow(ANativeWindow* newWin);
 __unused void rendererSetSharedState(struct lorie_shared_server_state* newState);
 __unused void rendererAddBuffer(LorieBuffer* buf);
@@ -86,6 +99,12 @@ static inline __always_inline void lorie_mutex_unlock(pthread_mutex_t* mutex, pi
     pthread_mutex_unlock(mutex);
 }
 
+static inline __always_inline uint64_t lorieMonotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 typedef enum {
     EVENT_UNKNOWN __unused = 0,
     EVENT_SHARED_SERVER_STATE,
@@ -102,10 +121,52 @@ typedef enum {
     EVENT_CLIPBOARD_ANNOUNCE,
     EVENT_CLIPBOARD_REQUEST,
     EVENT_CLIPBOARD_SEND,
+    EVENT_INPUT_RING,
+    EVENT_HELLO,
+    EVENT_MOTION_BATCH,
+    EVENT_TEXT,
 } eventType;
 
+#define LORIE_PROTOCOL_VERSION 7
+// Both sides send EVENT_HELLO first and drop connection if the other side sends anything else before it or does not send it in time.
+#define LORIE_HELLO_TIMEOUT_MS 5000
+#define LORIE_MESSAGE_HEADER_SIZE 4
+#define LORIE_MESSAGE_MAX_SIZE (LORIE_MESSAGE_HEADER_SIZE + UINT16_MAX)
+#define LORIE_MESSAGE_MAX_FDS (LORIEBUFFER_MAX_BATCH + 1)
+// Clipboard content following EVENT_CLIPBOARD_SEND, longer content is skipped.
+#define LORIE_CLIPBOARD_MAX_SIZE (256 * 1024 * 1024)
+
+#define LORIE_MOTION_TOUCH 0
+#define LORIE_MOTION_STYLUS 1
+#define LORIE_MOTION_SAMPLE_SIZE 20
+#define LORIE_MAX_MOTION_SAMPLES 64
+#define LORIE_MOTION_BATCH_MAX_SIZE (LORIE_MESSAGE_HEADER_SIZE + 4 + LORIE_MAX_MOTION_SAMPLES * LORIE_MOTION_SAMPLE_SIZE)
+// Longer text is split to several EVENT_TEXT messages at code point boundaries, the chunk must fit input ring record.
+#define LORIE_MAX_TEXT_CHUNK 1024
+
+/*
+ * One sample of touch or stylus motion. Android batches samples coming faster than frame rate,
+ * they are sent together in EVENT_MOTION_BATCH to let X server queue all of them with original timestamps.
+ */
+typedef struct {
+    float x, y;
+    uint16_t pressure, id; // id is touch pointer ID
+    int8_t tilt_x, tilt_y;
+    int16_t orientation;
+    uint32_t time; // milliseconds of CLOCK_MONOTONIC, the same clock X server uses for timestamps
+} lorieMotionSample;
+
+/*
+ * Decoded form of the message, it is never sent as is.
+ * See protocol.c for the wire format.
+ */
 typedef union {
     uint8_t type;
+    struct {
+        uint8_t t;
+        uint32_t magic;
+        uint16_t version;
+    } hello;
     struct {
         uint8_t t;
         uint16_t width, height, framerate;
@@ -114,7 +175,12 @@ typedef union {
     } screenSize;
     struct {
         uint8_t t;
-        unsigned long id;
+        uint16_t size;
+        const uint8_t *data;
+    } addBuffer;
+    struct {
+        uint8_t t;
+        uint64_t id;
     } removeBuffer;
     struct {
         uint8_t t;
@@ -152,9 +218,87 @@ typedef union {
     struct {
         uint8_t t;
         uint32_t count;
+        char *data; // filled only by lorieMessageReader
     } clipboardSend;
+    struct {
+        uint8_t t;
+        uint8_t device, buttons, eraser, mouse;
+        uint16_t count;
+        const uint8_t *samples; // see lorieEncodeMotionSample and lorieDecodeMotionSample
+    } motionBatch;
+    struct {
+        uint8_t t;
+        uint16_t length;
+        const char *data; // UTF-8, not NUL-terminated
+    } text;
 } lorieEvent;
 
+/*
+ * Buffered reader of incoming messages.
+ * Reads as much as socket has at once, parses all complete messages from the buffer
+ * and keeps incomplete one until the next wakeup.
+ * Clipboard content following EVENT_CLIPBOARD_SEND is collected to separate heap buffer.
+ */
+typedef struct {
+    uint8_t *data; // LORIE_MESSAGE_MAX_SIZE bytes, allocated on first use
+    size_t start, end;
+    int fds[LORIE_MESSAGE_MAX_FDS * 2], nfds;
+    lorieEvent pending; // message waiting for its trailing content
+    bool payloadPending;
+    char *payload;
+    size_t payloadReceived;
+} lorieMessageReader;
+
+/*
+ * Frame latency histograms, recorded by both processes into the shared server state.
+ * Values below 8 microseconds get a bucket each, every next power of two is split into 4 buckets,
+ * so percentiles are precise to 12.5%. The last bucket also takes everything longer than ~16 seconds.
+ * Every metric is written by a single thread, X server only resets maxUs when it publishes them.
+ */
+#define LORIE_HISTOGRAM_BUCKETS 96
+
+typedef enum {
+    LORIE_METRIC_DAMAGE_TO_REQUEST, // X server: root window damaged -> renderer is asked to draw it
+    LORIE_METRIC_WAKE_TO_LOCK, // renderer: woken up -> root window lock acquired
+    LORIE_METRIC_LOCK_HOLD, // renderer: root window lock held
+    LORIE_METRIC_UPLOAD, // renderer: root window and cursor texture upload and drawing
+    LORIE_METRIC_SWAP, // renderer: eglSwapBuffers
+    LORIE_METRIC_DAMAGE_TO_PRESENT, // root window damaged -> frame with it swapped
+    LORIE_METRIC_GPU_ROOT, // renderer: GPU time of root window upload and drawing, if GL_EXT_disjoint_timer_query is supported
+    LORIE_METRIC_GPU_CURSOR, // renderer: GPU time of cursor upload and drawing
+    LORIE_METRIC_INPUT_TO_PRESENT, // input event received by X server -> frame with the first damage after it swapped
+    LORIE_METRIC_COUNT,
+} lorieMetric;
+
+typedef struct {
+    uint64_t count, sumUs, maxUs;
+    uint64_t buckets[LORIE_HISTOGRAM_BUCKETS];
+} lorieHistogram;
+
+static inline __always_inline int lorieHistogramBucket(uint64_t us) {
+    int octave, bucket;
+    if (us < 8)
+        return (int) us;
+
+    octave = 63 - __builtin_clzll(us);
+    bucket = 8 + (octave - 3) * 4 + (int) ((us >> (octave - 2)) & 3);
+    return bucket < LORIE_HISTOGRAM_BUCKETS ? bucket : LORIE_HISTOGRAM_BUCKETS - 1;
+}
+
+// Smallest value (in microseconds) counted by the bucket.
+static inline __always_inline uint64_t lorieHistogramBucketStart(int bucket) {
+    return bucket < 8 ? (uint64_t) bucket : (uint64_t) (4 + (bucket - 8) % 4) << ((bucket - 8) / 4 + 1);
+}
+
+static inline __always_inline void lorieHistogramRecord(lorieHistogram* histogram, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    __atomic_fetch_add(&histogram->buckets[lorieHistogramBucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sumUs, us, __ATOMIC_RELAXED);
+    if (us > __atomic_load_n(&histogram->maxUs, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->maxUs, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELEASE);
+}
+
 struct lorie_shared_server_state {
     /*
      * Renderer and X server are separated into 2 different processes.
@@ -198,6 +342,32 @@ struct lorie_shared_server_state {
     /* Needed to show FPS counter in logcat */
     volatile int renderedFrames;
 
+    /*
+     * CLOCK_MONOTONIC time (ns) of the oldest damage renderer has not drawn yet, 0 if there is none.
+     * Set by X server, taken by renderer under the lock.
+     */
+    uint64_t damageTime;
+
+    /* The same for the oldest input event received before that damage, 0 if there was no input. */
+    uint64_t inputTime;
+
+    /* See lorieMetric. X server publishes percentiles in _TERMUX_X11_FRAME_METRICS property of the root window. */
+    lorieHistogram metrics[LORIE_METRIC_COUNT];
+
+    /*
+     * Number of EVENT_REMOVE_BUFFER events renderer has completely processed since connection.
+     * X server does not reuse storage of released buffer until renderer stops using it.
+     */
+    volatile uint64_t retiredBuffers;
+
+    /*
+     * X server increments flipSerial after setting rootWindowTextureID to the flipped pixmap.
+     * Renderer reads it before reading rootWindowTextureID and stores the value to flipSerialAcked,
+     * since then it never samples pixmaps which were flipped before. X server completes the flip
+     * (and makes previous pixmap idle) only after that, so it never waits for the renderer's lock.
+     */
+    volatile uint64_t flipSerial, flipSerialAcked;
+
     struct {
         // We should not allow updating cursor content the same time renderer draws it.
         // locking the mutex protecting the root window can cause waiting for the frame to be drawn which is unacceptable
@@ -210,6 +380,42 @@ struct lorie_shared_server_state {
     } cursor;
 };
 
+#define LORIE_EVENT_RING_SIZE (64 * 1024)
+
+/*
+ * Input events are passed from activity to X server through this ring instead of the socket,
+ * socket is used only for control messages and file descriptors.
+ * Ring lives in shared memory fragment created by X server and sent with EVENT_INPUT_RING together with eventfd.
+ * Activity writes eventfd only if X server's input thread is going to sleep.
+ */
+struct lorie_event_ring {
+    volatile uint32_t head; // written by activity
+    uint8_t pad0[60];
+    volatile uint32_t tail; // written by X server
+    volatile uint32_t consumerWaiting; // written by X server
+    uint8_t pad1[56];
+    uint8_t data[LORIE_EVENT_RING_SIZE];
+};
+
+size_t lorieEncodeEvent(const lorieEvent* e, uint8_t* out, size_t size);
+ssize_t lorieDecodeEvent(const uint8_t* data, size_t size, lorieEvent* e);
+bool lorieCheckHello(const lorieEvent* e);
+void lorieEncodeMotionSample(uint8_t* out, const lorieMotionSample* sample);
+void lorieDecodeMotionSample(const lorieEvent* e, int index, lorieMotionSample* sample);
+int lorieSendEvent(int fd, const lorieEvent* e, const int* fds, int nfds);
+int lorieRecvEvent(int fd, lorieEvent* e, uint8_t* data, int* fds, int* nfds);
+// Reads content following EVENT_CLIPBOARD_SEND to NUL-terminated heap buffer, *out is NULL if content was skipped.
+int lorieRecvPayload(int fd, uint32_t size, char** out);
+int lorieReaderFill(lorieMessageReader* r, int fd);
+int lorieReaderNext(lorieMessageReader* r, lorieEvent* e, int* fds, int* nfds);
+void lorieReaderReset(lorieMessageReader* r);
+
+void lorieEventRingReset(struct lorie_event_ring* ring);
+bool lorieEventRingWrite(struct lorie_event_ring* ring, int doorbell, const void* data, uint32_t size);
+int32_t lorieEventRingRead(struct lorie_event_ring* ring, void* data, uint32_t max);
+void lorieEventRingWake(struct lorie_event_ring* ring);
+bool lorieEventRingSleep(struct lorie_event_ring* ring);
+
 static int android_to_linux_keycode[304] = {
         [ 4   /* ANDROID_KEYCODE_BACK */] = KEY_ESC,
         [ 7   /* ANDROID_KEYCODE_0 */] = KEY_0,
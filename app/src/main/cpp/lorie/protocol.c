@@ -0,0 +1,545 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "lorie.h"
+
+/*
+ * lorieEvent is never sent as is, its layout depends on ABI of the process.
+ * Every message is 4 byte header (type, number of file descriptors attached, payload length)
+ * followed by payload of explicitly sized little-endian fields specific to message type.
+ * File descriptors are attached to the header with SCM_RIGHTS.
+ * Screen name and buffer handles are a part of payload, clipboard content follows the message
+ * as raw bytes since it may be longer than maximal payload.
+ */
+
+#define LORIE_PROTOCOL_MAGIC 0x4549524C // "LRIE"
+
+static inline uint8_t* put8(uint8_t* p, uint8_t v) {
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t* put16(uint8_t* p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+    return p + 2;
+}
+
+static inline uint8_t* put32(uint8_t* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+    return p + 4;
+}
+
+static inline uint8_t* put64(uint8_t* p, uint64_t v) {
+    return put32(put32(p, (uint32_t) v), (uint32_t) (v >> 32));
+}
+
+static inline uint8_t* putf32(uint8_t* p, float v) {
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return put32(p, u);
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+    return p[0] | (uint16_t) p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline uint64_t get64(const uint8_t* p) {
+    return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static inline float getf32(const uint8_t* p) {
+    uint32_t u = get32(p);
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// Payload length of every message type, screen size message is followed by screen name.
+static const uint16_t payloadLength[] = {
+        [EVENT_HELLO] = 6,
+        [EVENT_SHARED_SERVER_STATE] = 0,
+        [EVENT_ADD_BUFFER] = 0, // followed by serialized buffer handles
+        [EVENT_REMOVE_BUFFER] = 8,
+        [EVENT_SCREEN_SIZE] = 6,
+        [EVENT_TOUCH] = 8,
+        [EVENT_MOUSE] = 11,
+        [EVENT_KEY] = 3,
+        [EVENT_STYLUS] = 17,
+        [EVENT_STYLUS_ENABLE] = 1,
+        [EVENT_UNICODE] = 4,
+        [EVENT_CLIPBOARD_ENABLE] = 1,
+        [EVENT_CLIPBOARD_ANNOUNCE] = 0,
+        [EVENT_CLIPBOARD_REQUEST] = 0,
+        [EVENT_CLIPBOARD_SEND] = 4,
+        [EVENT_INPUT_RING] = 0,
+        [EVENT_MOTION_BATCH] = 4, // followed by samples
+        [EVENT_TEXT] = 0, // followed by UTF-8 text
+};
+
+_Static_assert(LORIE_MESSAGE_HEADER_SIZE + LORIE_MAX_TEXT_CHUNK <= LORIE_MOTION_BATCH_MAX_SIZE, "text chunk must fit input ring record");
+
+// Length of encoded message including header or 0 if message can not be encoded.
+static size_t lorieEventLength(const lorieEvent* e) {
+    size_t length;
+    if (!e || e->type >= sizeof(payloadLength) / sizeof(*payloadLength) || e->type == EVENT_UNKNOWN)
+        return 0;
+
+    length = payloadLength[e->type];
+    if (e->type == EVENT_SCREEN_SIZE)
+        length += e->screenSize.name_size;
+    else if (e->type == EVENT_ADD_BUFFER)
+        length += e->addBuffer.size;
+    else if (e->type == EVENT_MOTION_BATCH)
+        length += e->motionBatch.count * LORIE_MOTION_SAMPLE_SIZE;
+    else if (e->type == EVENT_TEXT)
+        length += e->text.length;
+    return length > UINT16_MAX ? 0 : LORIE_MESSAGE_HEADER_SIZE + length;
+}
+
+__LIBC_HIDDEN__ size_t lorieEncodeEvent(const lorieEvent* e, uint8_t* out, size_t size) {
+    uint8_t* p = out + LORIE_MESSAGE_HEADER_SIZE;
+    size_t length = lorieEventLength(e);
+    if (!length || length > size)
+        return 0;
+
+    length -= LORIE_MESSAGE_HEADER_SIZE;
+
+    switch (e->type) {
+        case EVENT_HELLO:
+            p = put16(put32(p, LORIE_PROTOCOL_MAGIC), e->hello.version);
+            break;
+        case EVENT_ADD_BUFFER:
+            if (e->addBuffer.size)
+                memcpy(p, e->addBuffer.data, e->addBuffer.size);
+            break;
+        case EVENT_REMOVE_BUFFER:
+            p = put64(p, e->removeBuffer.id);
+            break;
+        case EVENT_SCREEN_SIZE:
+            p = put16(put16(put16(p, e->screenSize.width), e->screenSize.height), e->screenSize.framerate);
+            if (e->screenSize.name_size)
+                memcpy(p, e->screenSize.name, e->screenSize.name_size);
+            break;
+        case EVENT_TOUCH:
+            p = put16(put16(put16(put16(p, e->touch.type), e->touch.id), e->touch.x), e->touch.y);
+            break;
+        case EVENT_MOUSE:
+            p = put8(put8(put8(putf32(putf32(p, e->mouse.x), e->mouse.y), e->mouse.detail), e->mouse.down), e->mouse.relative);
+            break;
+        case EVENT_KEY:
+            p = put8(put16(p, e->key.key), e->key.state);
+            break;
+        case EVENT_STYLUS:
+            p = putf32(putf32(p, e->stylus.x), e->stylus.y);
+            p = put8(put8(put16(p, e->stylus.pressure), e->stylus.tilt_x), e->stylus.tilt_y);
+            p = put8(put8(put8(put16(p, e->stylus.orientation), e->stylus.buttons), e->stylus.eraser), e->stylus.mouse);
+            break;
+        case EVENT_STYLUS_ENABLE:
+            p = put8(p, e->stylusEnable.enable);
+            break;
+        case EVENT_UNICODE:
+            p = put32(p, e->unicode.code);
+            break;
+        case EVENT_CLIPBOARD_ENABLE:
+            p = put8(p, e->clipboardEnable.enable);
+            break;
+        case EVENT_CLIPBOARD_SEND:
+            p = put32(p, e->clipboardSend.count);
+            break;
+        case EVENT_MOTION_BATCH:
+            p = put8(put8(put8(put8(p, e->motionBatch.device), e->motionBatch.buttons), e->motionBatch.eraser), e->motionBatch.mouse);
+            if (e->motionBatch.count)
+                memcpy(p, e->motionBatch.samples, e->motionBatch.count * LORIE_MOTION_SAMPLE_SIZE);
+            break;
+        case EVENT_TEXT:
+            if (e->text.length)
+                memcpy(p, e->text.data, e->text.length);
+            break;
+        default: break;
+    }
+
+    put16(put8(put8(out, e->type), 0), length);
+    return LORIE_MESSAGE_HEADER_SIZE + length;
+}
+
+__LIBC_HIDDEN__ ssize_t lorieDecodeEvent(const uint8_t* data, size_t size, lorieEvent* e) {
+    const uint8_t* p = data + LORIE_MESSAGE_HEADER_SIZE;
+    uint16_t length;
+    if (size < LORIE_MESSAGE_HEADER_SIZE)
+        return 0;
+
+    length = get16(data + 2);
+    if (size < LORIE_MESSAGE_HEADER_SIZE + length)
+        return 0;
+
+    memset(e, 0, sizeof(*e));
+    e->type = data[0];
+    if (e->type >= sizeof(payloadLength) / sizeof(*payloadLength) || length < payloadLength[e->type]) {
+        // Unknown messages are skipped, they may come from newer build with the same protocol version.
+        e->type = EVENT_UNKNOWN;
+        return LORIE_MESSAGE_HEADER_SIZE + length;
+    }
+
+    switch (e->type) {
+        case EVENT_HELLO:
+            e->hello.magic = get32(p);
+            e->hello.version = get16(p + 4);
+            break;
+        case EVENT_ADD_BUFFER:
+            // Handles point to the message.
+            e->addBuffer.size = length;
+            e->addBuffer.data = length ? p : NULL;
+            break;
+        case EVENT_REMOVE_BUFFER:
+            e->removeBuffer.id = get64(p);
+            break;
+        case EVENT_SCREEN_SIZE:
+            e->screenSize.width = get16(p);
+            e->screenSize.height = get16(p + 2);
+            e->screenSize.framerate = get16(p + 4);
+            // Name points to the message, it is not NUL-terminated.
+            e->screenSize.name_size = length - payloadLength[EVENT_SCREEN_SIZE];
+            e->screenSize.name = e->screenSize.name_size ? (char*) p + payloadLength[EVENT_SCREEN_SIZE] : NULL;
+            break;
+        case EVENT_TOUCH:
+            e->touch.type = get16(p);
+            e->touch.id = get16(p + 2);
+            e->touch.x = get16(p + 4);
+            e->touch.y = get16(p + 6);
+            break;
+        case EVENT_MOUSE:
+            e->mouse.x = getf32(p);
+            e->mouse.y = getf32(p + 4);
+            e->mouse.detail = p[8];
+            e->mouse.down = p[9];
+            e->mouse.relative = p[10];
+            break;
+        case EVENT_KEY:
+            e->key.key = get16(p);
+            e->key.state = p[2];
+            break;
+        case EVENT_STYLUS:
+            e->stylus.x = getf32(p);
+            e->stylus.y = getf32(p + 4);
+            e->stylus.pressure = get16(p + 8);
+            e->stylus.tilt_x = (int8_t) p[10];
+            e->stylus.tilt_y = (int8_t) p[11];
+            e->stylus.orientation = (int16_t) get16(p + 12);
+            e->stylus.buttons = p[14];
+            e->stylus.eraser = p[15];
+            e->stylus.mouse = p[16];
+            break;
+        case EVENT_STYLUS_ENABLE:
+            e->stylusEnable.enable = p[0];
+            break;
+        case EVENT_UNICODE:
+            e->unicode.code = get32(p);
+            break;
+        case EVENT_CLIPBOARD_ENABLE:
+            e->clipboardEnable.enable = p[0];
+            break;
+        case EVENT_CLIPBOARD_SEND:
+            e->clipboardSend.count = get32(p);
+            break;
+        case EVENT_MOTION_BATCH:
+            e->motionBatch.device = p[0];
+            e->motionBatch.buttons = p[1];
+            e->motionBatch.eraser = p[2];
+            e->motionBatch.mouse = p[3];
+            // Samples point to the message.
+            e->motionBatch.count = (length - payloadLength[EVENT_MOTION_BATCH]) / LORIE_MOTION_SAMPLE_SIZE;
+            e->motionBatch.samples = p + payloadLength[EVENT_MOTION_BATCH];
+            break;
+        case EVENT_TEXT:
+            // Text points to the message.
+            e->text.length = length;
+            e->text.data = length ? (const char*) p : NULL;
+            break;
+        default: break;
+    }
+
+    return LORIE_MESSAGE_HEADER_SIZE + length;
+}
+
+__LIBC_HIDDEN__ bool lorieCheckHello(const lorieEvent* e) {
+    if (e->hello.magic == LORIE_PROTOCOL_MAGIC && e->hello.version == LORIE_PROTOCOL_VERSION)
+        return true;
+
+    __android_log_print(ANDROID_LOG_ERROR, "LorieNative", "FATAL: protocol mismatch: other side speaks version %u (magic 0x%X), we speak version %u. "
+                        "Termux:X11 app and termux-x11 package versions do not match, please update both of them.",
+                        e->hello.version, e->hello.magic, LORIE_PROTOCOL_VERSION);
+    dprintf(2, "FATAL: Termux:X11 protocol mismatch: other side speaks version %u, we speak version %u. Please update both Termux:X11 app and termux-x11 package.\n",
+            e->hello.version, LORIE_PROTOCOL_VERSION);
+    return false;
+}
+
+__LIBC_HIDDEN__ void lorieEncodeMotionSample(uint8_t* out, const lorieMotionSample* sample) {
+    uint8_t* p = putf32(putf32(out, sample->x), sample->y);
+    p = put16(put16(p, sample->pressure), sample->id);
+    p = put16(put8(put8(p, sample->tilt_x), sample->tilt_y), sample->orientation);
+    put32(p, sample->time);
+}
+
+__LIBC_HIDDEN__ void lorieDecodeMotionSample(const lorieEvent* e, int index, lorieMotionSample* sample) {
+    const uint8_t* p = e->motionBatch.samples + index * LORIE_MOTION_SAMPLE_SIZE;
+    sample->x = getf32(p);
+    sample->y = getf32(p + 4);
+    sample->pressure = get16(p + 8);
+    sample->id = get16(p + 10);
+    sample->tilt_x = (int8_t) p[12];
+    sample->tilt_y = (int8_t) p[13];
+    sample->orientation = (int16_t) get16(p + 14);
+    sample->time = get32(p + 16);
+}
+
+static int transfer(int fd, uint8_t* data, size_t size, bool out) {
+    while (size) {
+        ssize_t len = out ? write(fd, data, size) : read(fd, data, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        data += len;
+        size -= len;
+    }
+    return 0;
+}
+
+__LIBC_HIDDEN__ int lorieSendEvent(int fd, const lorieEvent* e, const int* fds, int nfds) {
+    // Most of messages are a few bytes long, only buffer handles, screen names and text need heap.
+    uint8_t small[LORIE_MOTION_BATCH_MAX_SIZE], *data = small;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * LORIE_MESSAGE_MAX_FDS)];
+    } control;
+    size_t length = lorieEventLength(e);
+    struct iovec iov = { 0 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    ssize_t sent;
+    int ret;
+
+    if (fd < 0 || nfds < 0 || nfds > LORIE_MESSAGE_MAX_FDS || !length)
+        return -1;
+
+    if (length > sizeof(small) && !(data = malloc(length)))
+        return -1;
+
+    iov.iov_base = data;
+    if (!(iov.iov_len = lorieEncodeEvent(e, data, length))) {
+        ret = -1;
+        goto end;
+    }
+
+    data[1] = nfds;
+    if (nfds) {
+        struct cmsghdr* cmsg;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    // File descriptors are attached to the first chunk, the rest of message can be written as is.
+    ret = sent < 0 ? -1 : transfer(fd, data + sent, iov.iov_len - sent, true);
+
+    end:
+    if (data != small)
+        free(data);
+    return ret;
+}
+
+__LIBC_HIDDEN__ int lorieRecvEvent(int fd, lorieEvent* e, uint8_t* data, int* fds, int* nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * LORIE_MESSAGE_MAX_FDS)];
+    } control;
+    struct iovec iov = { .iov_base = data, .iov_len = LORIE_MESSAGE_HEADER_SIZE };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    size_t received, length;
+    ssize_t len;
+    int count = 0;
+
+    while ((len = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (len <= 0)
+        return -1;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < n; i++) {
+                int received_fd = ((int*) CMSG_DATA(cmsg))[i];
+                if (fds && nfds && count < LORIE_MESSAGE_MAX_FDS)
+                    fds[count++] = received_fd;
+                else
+                    close(received_fd);
+            }
+        }
+    }
+
+    if (nfds)
+        *nfds = count;
+
+    received = len;
+    if (transfer(fd, data + received, LORIE_MESSAGE_HEADER_SIZE - received, false) != 0)
+        goto fail;
+
+    length = get16(data + 2);
+    if (transfer(fd, data + LORIE_MESSAGE_HEADER_SIZE, length, false) != 0
+            || lorieDecodeEvent(data, LORIE_MESSAGE_HEADER_SIZE + length, e) <= 0)
+        goto fail;
+
+    return 0;
+
+    fail:
+    for (int i = 0; nfds && i < *nfds; i++)
+        close(fds[i]);
+    if (nfds)
+        *nfds = 0;
+    return -1;
+}
+
+__LIBC_HIDDEN__ int lorieRecvPayload(int fd, uint32_t size, char** out) {
+    uint8_t skipped[4096];
+    *out = size <= LORIE_CLIPBOARD_MAX_SIZE ? malloc(size + 1) : NULL;
+    if (*out) {
+        (*out)[size] = 0;
+        if (transfer(fd, (uint8_t*) *out, size, false) == 0)
+            return 0;
+
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+
+    // Content is consumed anyway, otherwise the rest of it would be parsed as messages.
+    __android_log_print(ANDROID_LOG_ERROR, "LorieNative", "Skipping clipboard content of %u bytes", size);
+    for (uint32_t n; size; size -= n)
+        if (transfer(fd, skipped, n = min(size, sizeof(skipped)), false) != 0)
+            return -1;
+    return 0;
+}
+
+static void readerAddFds(lorieMessageReader* r, struct msghdr* msg) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < n; i++) {
+                int received_fd = ((int*) CMSG_DATA(cmsg))[i];
+                if (r->nfds < sizeof(r->fds) / sizeof(*r->fds))
+                    r->fds[r->nfds++] = received_fd;
+                else
+                    close(received_fd);
+            }
+        }
+    }
+}
+
+__LIBC_HIDDEN__ int lorieReaderFill(lorieMessageReader* r, int fd) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * LORIE_MESSAGE_MAX_FDS)];
+    } control;
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    ssize_t len;
+
+    if (!r->data && !(r->data = malloc(LORIE_MESSAGE_MAX_SIZE)))
+        return -1;
+
+    if (r->payloadPending && r->payload && r->start == r->end) {
+        // Clipboard content goes straight to its destination without passing through message buffer.
+        iov.iov_base = r->payload + r->payloadReceived;
+        iov.iov_len = r->pending.clipboardSend.count - r->payloadReceived;
+    } else {
+        if (r->start) {
+            memmove(r->data, r->data + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        iov.iov_base = r->data + r->end;
+        iov.iov_len = LORIE_MESSAGE_MAX_SIZE - r->end;
+    }
+
+    while ((len = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (len < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    if (len == 0)
+        return -1;
+
+    readerAddFds(r, &msg);
+    if (iov.iov_base == r->data + r->end)
+        r->end += len;
+    else
+        r->payloadReceived += len;
+
+    return 1;
+}
+
+__LIBC_HIDDEN__ int lorieReaderNext(lorieMessageReader* r, lorieEvent* e, int* fds, int* nfds) {
+    ssize_t len;
+    int count;
+
+    *nfds = 0;
+    payload:
+    if (r->payloadPending) {
+        size_t n = min(r->end - r->start, r->pending.clipboardSend.count - r->payloadReceived);
+        if (r->payload)
+            memcpy(r->payload + r->payloadReceived, r->data + r->start, n);
+        r->start += n;
+        r->payloadReceived += n;
+        if (r->payloadReceived < r->pending.clipboardSend.count)
+            return 0;
+
+        // Content is owned by reader and stays valid until the next call.
+        r->payloadPending = false;
+        *e = r->pending;
+        e->clipboardSend.data = r->payload;
+        return 1;
+    }
+
+    free(r->payload);
+    r->payload = NULL;
+
+    if (!r->data || (len = lorieDecodeEvent(r->data + r->start, r->end - r->start, e)) <= 0)
+        return 0;
+
+    count = min(r->data[r->start + 1], r->nfds);
+    r->start += len;
+    for (int i = 0; i < count; i++)
+        fds[(*nfds)++] = r->fds[i];
+    memmove(r->fds, r->fds + count, sizeof(int) * (r->nfds - count));
+    r->nfds -= count;
+
+    if (e->type == EVENT_CLIPBOARD_SEND && e->clipboardSend.count) {
+        r->pending = *e;
+        r->payloadPending = true;
+        r->payloadReceived = 0;
+        if (e->clipboardSend.count <= LORIE_CLIPBOARD_MAX_SIZE && (r->payload = malloc(e->clipboardSend.count + 1)))
+            r->payload[e->clipboardSend.count] = 0;
+        else
+            __android_log_print(ANDROID_LOG_ERROR, "LorieNative", "Skipping clipboard content of %u bytes", e->clipboardSend.count);
+        goto payload;
+    }
+
+    return 1;
+}
+
+__LIBC_HIDDEN__ void lorieReaderReset(lorieMessageReader* r) {
+    for (int i = 0; i < r->nfds; i++)
+        close(r->fds[i]);
+    free(r->data);
+    free(r->payload);
+    memset(r, 0, sizeof(*r));
+}
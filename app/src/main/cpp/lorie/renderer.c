@@ -17,14 +17,20 @@
 #include <android/native_window_jni.h>
 #include <android/log.h>
 #include <dlfcn.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/system_properties.h>
 #include "list.h"
 #include "lorie.h"
+#include "filecache.h"
 
 #define log(...) __android_log_print(ANDROID_LOG_DEBUG, "gles-renderer", __VA_ARGS__)
 #define loge(...) __android_log_print(ANDROID_LOG_ERROR, "gles-renderer", __VA_ARGS__)
 
 static GLuint createProgram(const char* p_vertex_source, const char* p_fragment_source);
+static void gpuTimerInit(void);
 
 static int printEglError(char* msg, int line) {
     char descBuf[32] = {0};
@@ -122,9 +128,34 @@ static volatile ANativeWindow* pendingWin = NULL;
 
 static pthread_mutex_t stateLock;
 static pthread_cond_t stateCond;
+static uint64_t wakeTime; // Used only in renderer thread.
 static pthread_cond_t stateChangeFinishCond;
 static pthread_spinlock_t bufferLock;
+static uint64_t retiredBuffers = 0; // guarded by bufferLock
 static volatile struct lorie_shared_server_state* state = NULL;
+
+/*
+ * GPU time of drawing root window and cursor (including texture uploads), measured with GL_EXT_disjoint_timer_query.
+ * Every frame uses its own set of queries, results are read a few frames later only if they are already available,
+ * so renderer never waits for GPU. Frame is not measured if its queries are still in flight.
+ */
+#define GPU_TIMER_FRAMES 4
+
+enum { GPU_TIMER_ROOT, GPU_TIMER_CURSOR, GPU_TIMER_COUNT };
+
+static struct {
+    bool available;
+    int frame;
+    GLuint queries[GPU_TIMER_FRAMES][GPU_TIMER_COUNT];
+    bool pending[GPU_TIMER_FRAMES][GPU_TIMER_COUNT];
+    bool disjoint[GPU_TIMER_FRAMES][GPU_TIMER_COUNT];
+    PFNGLGENQUERIESEXTPROC genQueries;
+    PFNGLBEGINQUERYEXTPROC beginQuery;
+    PFNGLENDQUERYEXTPROC endQuery;
+    PFNGLGETQUERYOBJECTUIVEXTPROC getQueryObjectuiv;
+    PFNGLGETQUERYOBJECTUI64VEXTPROC getQueryObjectui64v;
+} gpuTimer = {0};
+
 static struct {
     GLuint id;
     bool cursorChanged;
@@ -235,6 +266,7 @@ int rendererInitThread(JavaVM *vm) {
     glActiveTexture(GL_TEXTURE0);
     glGenTextures(1, &cursor.id);
 
+    gpuTimerInit();
     rendererThread();
     return 1;
 }
@@ -258,7 +290,11 @@ void rendererInit(JNIEnv* env) {
     pthread_create(&t, NULL, (void*(*)(void*)) rendererInitThread, vm);
 }
 
-void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
+/*
+ * Returns false if probe could not decide because of unrelated failure (i.e. allocation failed because of memory pressure),
+ * such result must not be cached. Legacy drawing is still forced for this run.
+ */
+static bool rendererProbeCapabilities(int* legacy_drawing, uint8_t* flip, char* glRenderer, size_t glRendererSize) {
     // Some devices do not support sampling from HAL_PIXEL_FORMAT_BGRA_8888, here we are checking it.
     const EGLint imageAttributes[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
     EGLint numConfigs;
@@ -277,7 +313,7 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
     if (egl_display == EGL_NO_DISPLAY) {
         egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
         if (egl_display == EGL_NO_DISPLAY)
-            return vprintEglError("Got no EGL display", __LINE__);
+            return printEglError("Got no EGL display", __LINE__);
     }
 
     status = AHardwareBuffer_allocate(&d0, &new);
@@ -285,11 +321,12 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
         loge("Failed to allocate native buffer (%p, error %d)", new, status);
         loge("Forcing legacy drawing");
         *legacy_drawing = 1;
-        return;
+        return false;
     }
 
     uint32_t *pixels;
-    if (AHardwareBuffer_lock(new, AHARDWAREBUFFER_USAGE_CPU_WRITE_OFTEN | AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, -1, NULL, (void **) &pixels) == 0) {
+    status = AHardwareBuffer_lock(new, AHARDWAREBUFFER_USAGE_CPU_WRITE_OFTEN | AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, -1, NULL, (void **) &pixels);
+    if (status == 0) {
         pixels[0] = 0xAABBCCDD;
         AHardwareBuffer_unlock(new, NULL);
     } else {
@@ -297,14 +334,15 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
         loge("Forcing legacy drawing");
         *legacy_drawing = 1;
         AHardwareBuffer_release(new);
-        return;
+        return false;
     }
 
     clientBuffer = eglGetNativeClientBufferANDROID(new);
     if (!clientBuffer) {
         *legacy_drawing = 1;
         AHardwareBuffer_release(new);
-        return vprintEglError("Failed to obtain EGLClientBuffer from AHardwareBuffer, forcing legacy drawing", __LINE__);
+        vprintEglError("Failed to obtain EGLClientBuffer from AHardwareBuffer, forcing legacy drawing", __LINE__);
+        return false;
     }
 
     if (!(img = eglCreateImageKHR(egl_display, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_ANDROID, clientBuffer, imageAttributes))) {
@@ -315,6 +353,8 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
             loge("Failed to obtain EGLImageKHR from EGLClientBuffer");
             loge("Forcing legacy drawing");
             *legacy_drawing = 1;
+            AHardwareBuffer_release(new);
+            return false;
         }
         AHardwareBuffer_release(new);
     } else {
@@ -328,11 +368,11 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
         EGLConfig checkcfg = 0;
         GLuint fbo = 0, texture = 0;
         if (eglChooseConfig(egl_display, configAttribs, &checkcfg, 1, &numConfigs) != EGL_TRUE)
-            return vprintEglError("check eglChooseConfig failed", __LINE__);
+            return printEglError("check eglChooseConfig failed", __LINE__);
 
         EGLContext testctx = eglCreateContext(egl_display, checkcfg, NULL, ctxattribs);
         if (testctx == EGL_NO_CONTEXT)
-            return vprintEglError("check eglCreateContext failed", __LINE__);
+            return printEglError("check eglCreateContext failed", __LINE__);
 
         const EGLint pbufferAttributes[] = {
                 EGL_WIDTH, 64,
@@ -342,7 +382,10 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
         EGLSurface checksfc = eglCreatePbufferSurface(egl_display, checkcfg, pbufferAttributes);
 
         if (eglMakeCurrent(egl_display, checksfc, checksfc, testctx) != EGL_TRUE)
-            return vprintEglError("check eglMakeCurrent failed", __LINE__);
+            return printEglError("check eglMakeCurrent failed", __LINE__);
+
+        const char* renderer = (const char*) glGetString(GL_RENDERER);
+        snprintf(glRenderer, glRendererSize, "%s", renderer ?: "");
 
         glActiveTexture(GL_TEXTURE0); checkGlError();
         glGenTextures(1, &texture); checkGlError();
@@ -366,6 +409,62 @@ void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip) {
         eglDestroySurface(egl_display, checksfc);
         AHardwareBuffer_release(new);
     }
+
+    return true;
+}
+
+/*
+ * Probing is a noticeable part of startup on slow drivers, so its result is kept in $TMPDIR/.renderer-caps.
+ * Cached result is used only on the same system and graphics driver build and with the same Xlorie build,
+ * EGL and GL strings are not available without initializing the driver so system properties identify it.
+ */
+static void rendererCapabilitiesFingerprint(char* out, size_t size) {
+    static const char* properties[] = {
+            "ro.build.fingerprint", "ro.vendor.build.fingerprint", "ro.hardware.egl", "ro.board.platform", "ro.gfx.driver.0",
+    };
+    char value[PROP_VALUE_MAX];
+    uint64_t hash = LORIE_CACHE_HASH_INIT;
+    Dl_info info;
+    for (size_t i = 0; i < sizeof(properties) / sizeof(*properties); i++) {
+        int len = __system_property_get(properties[i], value);
+        hash = lorieCacheHash(hash, value, len + 1); // NUL separates values.
+    }
+    if (dladdr((void*) rendererTestCapabilities, &info) && info.dli_fname)
+        hash = lorieCacheHashFile(hash, info.dli_fname);
+    snprintf(out, size, "%016" PRIx64, hash);
+}
+
+void rendererTestCapabilities(int* legacy_drawing, uint8_t* flip, bool reprobe) {
+    char path[PATH_MAX], data[256], fingerprint[32], cachedFingerprint[32], glRenderer[128] = {0};
+    int legacy = 0, cachedLegacy, len;
+    bool conclusive;
+    uint8_t bgra = 0;
+    unsigned cachedFlip;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/.renderer-caps", getenv("TMPDIR") ?: "/tmp");
+    rendererCapabilitiesFingerprint(fingerprint, sizeof(fingerprint));
+
+    if (!reprobe && (f = fopen(path, "re"))) {
+        int count = fscanf(f, "fingerprint=%31s legacy_drawing=%d flip=%u", cachedFingerprint, &cachedLegacy, &cachedFlip);
+        fclose(f);
+        if (count == 3 && !strcmp(fingerprint, cachedFingerprint)) {
+            log("Xlorie: using cached renderer capabilities: legacy drawing %d, flip %u\n", cachedLegacy, cachedFlip);
+            *legacy_drawing |= cachedLegacy;
+            *flip |= cachedFlip;
+            return;
+        }
+    }
+
+    conclusive = rendererProbeCapabilities(&legacy, &bgra, glRenderer, sizeof(glRenderer));
+    *legacy_drawing |= legacy;
+    *flip |= bgra;
+    if (!conclusive)
+        return;
+
+    len = snprintf(data, sizeof(data), "fingerprint=%s\nlegacy_drawing=%d\nflip=%u\ngl_renderer=%s\n", fingerprint, legacy, bgra, glRenderer);
+    if (len > 0 && (size_t) len < sizeof(data))
+        lorieCachePublishData(path, data, len);
 }
 
 __unused void rendererSetSharedState(struct lorie_shared_server_state* newState) {
@@ -389,6 +488,7 @@ void rendererAddBuffer(LorieBuffer* buf) {
 
 void rendererRemoveBuffer(uint64_t id) {
     pthread_spin_lock(&bufferLock);
+    retiredBuffers++;
     LorieBuffer* buf = LorieBufferList_findById(&addedBuffers, id);
     if (buf)
         // Buffer was not attached to GL yet, it is safe to release it now.
@@ -401,6 +501,7 @@ void rendererRemoveBuffer(uint64_t id) {
             LorieBuffer_addToList(buf, &removedBuffers);
         }
     }
+    pthread_cond_signal(&stateCond);
     pthread_spin_unlock(&bufferLock);
 }
 
@@ -517,10 +618,82 @@ void rendererRefreshContext(void) {
 static void draw(GLuint id, float x0, float y0, float x1, float y1, float xfactor, uint8_t flip);
 static void drawCursor(float displayWidth, float displayHeight);
 
+static void gpuTimerInit(void) {
+    const char* extensions = (const char*) glGetString(GL_EXTENSIONS);
+    if (!extensions || !strstr(extensions, "GL_EXT_disjoint_timer_query"))
+        return;
+
+    gpuTimer.genQueries = (PFNGLGENQUERIESEXTPROC) eglGetProcAddress("glGenQueriesEXT");
+    gpuTimer.beginQuery = (PFNGLBEGINQUERYEXTPROC) eglGetProcAddress("glBeginQueryEXT");
+    gpuTimer.endQuery = (PFNGLENDQUERYEXTPROC) eglGetProcAddress("glEndQueryEXT");
+    gpuTimer.getQueryObjectuiv = (PFNGLGETQUERYOBJECTUIVEXTPROC) eglGetProcAddress("glGetQueryObjectuivEXT");
+    gpuTimer.getQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC) eglGetProcAddress("glGetQueryObjectui64vEXT");
+    if (!gpuTimer.genQueries || !gpuTimer.beginQuery || !gpuTimer.endQuery || !gpuTimer.getQueryObjectuiv || !gpuTimer.getQueryObjectui64v)
+        return;
+
+    gpuTimer.genQueries(GPU_TIMER_FRAMES * GPU_TIMER_COUNT, &gpuTimer.queries[0][0]);
+    gpuTimer.available = true;
+    log("Xlorie: GPU timer queries are available\n");
+}
+
+// Records results of finished queries. Results of queries which were in flight when GPU reported disjoint operation are dropped.
+static void gpuTimerCollect(void) {
+    static const lorieMetric metrics[GPU_TIMER_COUNT] = { LORIE_METRIC_GPU_ROOT, LORIE_METRIC_GPU_CURSOR };
+    GLint disjoint = 0;
+    if (!gpuTimer.available)
+        return;
+
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    for (int i = 0; i < GPU_TIMER_FRAMES; i++) {
+        for (int j = 0; j < GPU_TIMER_COUNT; j++) {
+            GLuint ready = 0;
+            GLuint64 ns = 0;
+            if (!gpuTimer.pending[i][j])
+                continue;
+
+            gpuTimer.disjoint[i][j] |= disjoint;
+            gpuTimer.getQueryObjectuiv(gpuTimer.queries[i][j], GL_QUERY_RESULT_AVAILABLE_EXT, &ready);
+            if (!ready)
+                continue;
+
+            gpuTimer.pending[i][j] = false;
+            if (gpuTimer.disjoint[i][j] || !state)
+                continue;
+
+            gpuTimer.getQueryObjectui64v(gpuTimer.queries[i][j], GL_QUERY_RESULT_EXT, &ns);
+            lorieHistogramRecord(&state->metrics[metrics[j]], ns);
+            lorieTraceCounter(j == GPU_TIMER_ROOT ? "gpu root us" : "gpu cursor us", (int64_t) (ns / 1000));
+        }
+    }
+}
+
+static bool gpuTimerBegin(int timer) {
+    int frame = gpuTimer.frame % GPU_TIMER_FRAMES;
+    if (!gpuTimer.available || gpuTimer.pending[frame][timer])
+        return false;
+
+    gpuTimer.beginQuery(GL_TIME_ELAPSED_EXT, gpuTimer.queries[frame][timer]);
+    return true;
+}
+
+static void gpuTimerEnd(int timer, bool started) {
+    int frame = gpuTimer.frame % GPU_TIMER_FRAMES;
+    if (!started)
+        return;
+
+    gpuTimer.endQuery(GL_TIME_ELAPSED_EXT);
+    gpuTimer.pending[frame][timer] = true;
+    gpuTimer.disjoint[frame][timer] = false;
+}
+
 void rendererRedrawLocked(bool* waitingForBuffers) {
     float xfactor = 1.f;
     LorieBuffer_Desc *desc = NULL;
+    uint64_t lockTime, uploadTime, swapTime, damageTime, inputTime, now;
+    bool gpuTimerStarted;
     EGLSync fence;
+    // X server publishes texture ID of flipped pixmap before the serial, see flipSerial.
+    uint64_t flipSerial = __atomic_load_n(&state->flipSerial, __ATOMIC_ACQUIRE);
     // The buffer will not be released until this function ends, but main thread can modify buffer list
     pthread_spin_lock(&bufferLock);
     LorieBuffer *buffer = LorieBufferList_findById(&buffers, state->rootWindowTextureID);
@@ -528,46 +701,77 @@ void rendererRedrawLocked(bool* waitingForBuffers) {
     if (!buffer)
         buffer = LorieBufferList_findById(&removedBuffers, state->rootWindowTextureID);
     pthread_spin_unlock(&bufferLock);
+    __atomic_store_n(&state->flipSerialAcked, flipSerial, __ATOMIC_RELEASE);
     if (!buffer) {
-        log("Buffer %llu not found", state->rootWindowTextureID);
+        lorieTraceInstant("renderer buffer not found", state->rootWindowTextureID);
         *waitingForBuffers = true;
         return;
     }
 
     desc = LorieBuffer_description(buffer);
+    gpuTimerCollect();
 
     // We should signal X server to not use root window while we actively copy it
+    lorieTraceBegin("renderer lock wait");
     lorie_mutex_lock(&state->lock, &state->lockingPid);
+    lorieTraceEnd("renderer lock wait");
+    lockTime = lorieMonotonicNs();
+    lorieHistogramRecord(&state->metrics[LORIE_METRIC_WAKE_TO_LOCK], lockTime - wakeTime);
+    damageTime = __atomic_exchange_n(&state->damageTime, 0, __ATOMIC_RELAXED);
+    inputTime = __atomic_exchange_n(&state->inputTime, 0, __ATOMIC_RELAXED);
     state->drawRequested = FALSE;
 
+    uploadTime = lorieMonotonicNs();
+    lorieTraceBegin("renderer draw");
+    gpuTimerStarted = gpuTimerBegin(GPU_TIMER_ROOT);
     LorieBuffer_bindTexture(buffer);
     if (desc->type == LORIEBUFFER_FD)
         xfactor = (float) desc->width/(float) desc->stride;
     draw(0, -1.f, -1.f, 1.f, 1.f, xfactor, LorieBuffer_isRgba(buffer));
+    gpuTimerEnd(GPU_TIMER_ROOT, gpuTimerStarted);
     fence = eglCreateSyncKHR(egl_display, EGL_SYNC_FENCE_KHR, NULL);
     glFlush();
+    lorieTraceEnd("renderer draw");
 
+    gpuTimerStarted = gpuTimerBegin(GPU_TIMER_CURSOR);
     if (state->cursor.updated) {
-        log("Xlorie: updating cursor\n");
+        lorieTraceBegin("renderer cursor upload");
         lorie_mutex_lock(&state->cursor.lock, &state->cursor.lockingPid);
         state->cursor.updated = false;
         bindLinearTexture(cursor.id);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, (GLsizei) state->cursor.width, (GLsizei) state->cursor.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, state->cursor.bits);
         lorie_mutex_unlock(&state->cursor.lock, &state->cursor.lockingPid);
+        lorieTraceEnd("renderer cursor upload");
     }
 
     state->cursor.moved = FALSE;
     drawCursor((float) (LorieBuffer_getWidth(buffer)), (float) (LorieBuffer_getHeight(buffer)));
+    gpuTimerEnd(GPU_TIMER_CURSOR, gpuTimerStarted);
     glFlush();
+    lorieHistogramRecord(&state->metrics[LORIE_METRIC_UPLOAD], lorieMonotonicNs() - uploadTime);
 
     // Wait until root window drawing is finished before giving control back to X server
     eglClientWaitSyncKHR(egl_display, fence, 0, EGL_FOREVER);
     eglDestroySyncKHR(egl_display, fence);
     state->waitForNextFrame = true;
+    swapTime = lorieMonotonicNs();
+    lorieHistogramRecord(&state->metrics[LORIE_METRIC_LOCK_HOLD], swapTime - lockTime);
     lorie_mutex_unlock(&state->lock, &state->lockingPid);
 
+    lorieTraceBegin("renderer swap");
     if (eglSwapBuffers(egl_display, sfc) != EGL_TRUE)
         printEglError("Failed to swap buffers", __LINE__);
+    lorieTraceEnd("renderer swap");
+    gpuTimer.frame++;
+    now = lorieMonotonicNs();
+    lorieHistogramRecord(&state->metrics[LORIE_METRIC_SWAP], now - swapTime);
+    if (damageTime)
+        lorieHistogramRecord(&state->metrics[LORIE_METRIC_DAMAGE_TO_PRESENT], now - damageTime);
+    if (inputTime)
+        lorieHistogramRecord(&state->metrics[LORIE_METRIC_INPUT_TO_PRESENT], now - inputTime);
+
+    lorieStartupMark("first frame drawn");
+    lorieStartupFinish("activity");
 
     // Perform a little drawing operation to make sure the next buffer is ready on the next invocation of drawing
     glEnable(GL_SCISSOR_TEST);
@@ -585,7 +789,8 @@ void rendererRedrawLocked(bool* waitingForBuffers) {
 static inline __always_inline bool rendererShouldWait(const bool *waitingForBuffers) {
     bool buffersChanged;
     pthread_spin_lock(&bufferLock);
-    buffersChanged = !xorg_list_is_empty(&addedBuffers) || !xorg_list_is_empty(&removedBuffers);
+    buffersChanged = !xorg_list_is_empty(&addedBuffers) || !xorg_list_is_empty(&removedBuffers)
+            || (state && state->retiredBuffers != retiredBuffers);
     pthread_spin_unlock(&bufferLock);
     if (stateChanged || windowChanged || buffersChanged)
         // If there are pending changes we should process them immediately.
@@ -609,6 +814,8 @@ __noreturn static void* rendererThread(void) {
     while (true) {
         while (rendererShouldWait(&waitingForBuffers))
             pthread_cond_wait(&stateCond, &stateLock);
+        lorieTraceInstant("renderer wake", 0);
+        wakeTime = lorieMonotonicNs();
 
         if (stateChanged) {
             struct lorie_shared_server_state* oldState = NULL;
@@ -619,6 +826,11 @@ __noreturn static void* rendererThread(void) {
             pendingState = NULL;
             stateChanged = false;
 
+            // Retirement counter is per connection.
+            pthread_spin_lock(&bufferLock);
+            retiredBuffers = 0;
+            pthread_spin_unlock(&bufferLock);
+
             if (state)
                 state->surfaceAvailable = win != defaultWin;
             else if (win != defaultWin) {
@@ -654,6 +866,9 @@ __noreturn static void* rendererThread(void) {
         // Remove all buffers which were attached to GL.
         while((buf = LorieBufferList_first(&removedBuffers)))
             LorieBuffer_release(buf);
+        // Let X server reuse storage of buffers renderer does not use anymore.
+        if (state)
+            __atomic_store_n(&state->retiredBuffers, retiredBuffers, __ATOMIC_RELEASE);
         pthread_spin_unlock(&bufferLock);
         pthread_mutex_lock(&stateLock);
     }
@@ -0,0 +1,256 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <X11/Xatom.h>
+#include <dixstruct.h>
+#include <extnsionst.h>
+#include <propertyst.h>
+#include <windowstr.h>
+#include <client.h>
+#include "lorie.h"
+
+/*
+ * Request profiler.
+ * Counts requests and time spent handling them per (major, minor) opcode and per client.
+ * When it is running every entry of ProcVector and SwappedProcVector points to lorieProfileRequest which calls the original handler,
+ * so when it is stopped dispatching is not affected at all.
+ *
+ * It is started with -profile-requests option or controlled with root window property:
+ *     xprop -root -f _TERMUX_X11_PROFILE 8s -set _TERMUX_X11_PROFILE start|stop|reset|report
+ * Report is written to stderr and to $TMPDIR/termux-x11-requests-<pid>.txt, opcodes are the ones from Xproto.h and extension headers.
+ * While it is running, totals of every second and the busiest request and client are written to the trace ring.
+ */
+
+#define LORIE_PROFILE_REPORT_LINES 40
+#define LORIE_PROFILE_SAMPLE_MS 1000
+
+typedef struct {
+    uint64_t count, ns, sampledCount, sampledNs;
+} LorieRequestStats;
+
+typedef struct {
+    uint64_t count, ns, sampledNs;
+    char name[64];
+} LorieClientStats;
+
+typedef int (*LorieProcPtr)(ClientPtr);
+
+static LorieRequestStats* requestStats = NULL; // [major << 8 | minor]
+static LorieClientStats* clientStats = NULL; // [client index]
+static LorieProcPtr originalProcs[256], originalSwappedProcs[256];
+static OsTimerPtr sampleTimer = NULL;
+static Bool running = FALSE;
+static Atom profileAtom = None;
+
+static int lorieProfileRequest(ClientPtr client) {
+    int major = client->majorOp, index = client->index, result;
+    LorieRequestStats* request = &requestStats[major << 8 | client->minorOp];
+    uint64_t start = lorieMonotonicNs(), ns;
+
+    result = (client->swapped ? originalSwappedProcs : originalProcs)[major](client);
+
+    // Client may be gone after this point, index is enough.
+    ns = lorieMonotonicNs() - start;
+    request->count++;
+    request->ns += ns;
+    clientStats[index].count++;
+    clientStats[index].ns += ns;
+    return result;
+}
+
+static CARD32 lorieProfileSample(__unused OsTimerPtr timer, __unused CARD32 time, __unused void *arg) {
+    uint64_t count = 0, ns = 0, busiestNs = 0;
+    int busiestRequest = -1, busiestClient = -1;
+    for (int i = 0; i < 256 * 256; i++) {
+        uint64_t delta = requestStats[i].ns - requestStats[i].sampledNs;
+        if (requestStats[i].count == requestStats[i].sampledCount)
+            continue;
+
+        count += requestStats[i].count - requestStats[i].sampledCount;
+        ns += delta;
+        requestStats[i].sampledCount = requestStats[i].count;
+        requestStats[i].sampledNs = requestStats[i].ns;
+        if (delta > busiestNs) {
+            busiestNs = delta;
+            busiestRequest = i;
+        }
+    }
+
+    busiestNs = 0;
+    for (int i = 0; i < MAXCLIENTS; i++) {
+        uint64_t delta = clientStats[i].ns - clientStats[i].sampledNs;
+        clientStats[i].sampledNs = clientStats[i].ns;
+        if (delta > busiestNs) {
+            busiestNs = delta;
+            busiestClient = i;
+        }
+    }
+
+    lorieTraceCounter("X request time us", (int64_t) (ns / 1000));
+    lorieTraceCounter("X requests", (int64_t) count);
+    lorieTraceCounter("X busiest request (major << 8 | minor)", busiestRequest);
+    lorieTraceCounter("X busiest client", busiestClient);
+    return LORIE_PROFILE_SAMPLE_MS;
+}
+
+static void lorieProfileClientState(__unused CallbackListPtr *list, __unused void *closure, void *data) {
+    ClientPtr client = ((NewClientInfoRec *) data)->client;
+    const char* name;
+    if (!clientStats || client->clientState != ClientStateRunning)
+        return;
+
+    // Index is reused by new client.
+    name = GetClientCmdName(client);
+    memset(&clientStats[client->index], 0, sizeof(*clientStats));
+    snprintf(clientStats[client->index].name, sizeof(clientStats->name), "%s", name ?: "unknown");
+}
+
+static void lorieProfileStart(void) {
+    if (!requestStats)
+        requestStats = calloc(256 * 256, sizeof(*requestStats));
+    if (!clientStats)
+        clientStats = calloc(MAXCLIENTS, sizeof(*clientStats));
+    if (!requestStats || !clientStats) {
+        LogMessage(X_ERROR, "Request profiler: not enough memory\n");
+        return;
+    }
+
+    // Handlers which are already wrapped are skipped, extensions fill their entries again on server regeneration.
+    for (int i = 0; i < 256; i++) {
+        if (ProcVector[i] != lorieProfileRequest) {
+            originalProcs[i] = ProcVector[i];
+            ProcVector[i] = lorieProfileRequest;
+        }
+        if (SwappedProcVector[i] != lorieProfileRequest) {
+            originalSwappedProcs[i] = SwappedProcVector[i];
+            SwappedProcVector[i] = lorieProfileRequest;
+        }
+    }
+
+    for (int i = 1; i < currentMaxClients; i++)
+        if (clients[i] && !clientStats[i].name[0])
+            snprintf(clientStats[i].name, sizeof(clientStats->name), "%s", GetClientCmdName(clients[i]) ?: "unknown");
+
+    sampleTimer = TimerSet(sampleTimer, 0, LORIE_PROFILE_SAMPLE_MS, lorieProfileSample, NULL);
+    if (!running)
+        LogMessage(X_INFO, "Request profiler started\n");
+    running = TRUE;
+}
+
+static void lorieProfileStop(void) {
+    if (!running)
+        return;
+
+    for (int i = 0; i < 256; i++) {
+        ProcVector[i] = originalProcs[i];
+        SwappedProcVector[i] = originalSwappedProcs[i];
+    }
+
+    TimerCancel(sampleTimer);
+    running = FALSE;
+    LogMessage(X_INFO, "Request profiler stopped\n");
+}
+
+static void lorieProfileReset(void) {
+    if (requestStats)
+        memset(requestStats, 0, 256 * 256 * sizeof(*requestStats));
+    if (clientStats)
+        for (int i = 0; i < MAXCLIENTS; i++)
+            clientStats[i].count = clientStats[i].ns = clientStats[i].sampledNs = 0;
+    lorieTraceInstant("X request profile reset", 0);
+}
+
+static int compareRequests(const void* a, const void* b) {
+    uint64_t x = requestStats[*(const int*) a].ns, y = requestStats[*(const int*) b].ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compareClients(const void* a, const void* b) {
+    uint64_t x = clientStats[*(const int*) a].ns, y = clientStats[*(const int*) b].ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void lorieProfileReportTo(FILE* f, const int* requests, int requestCount, const int* clientIndices, int clientCount) {
+    fprintf(f, "%-24s %6s %6s %12s %12s %10s\n", "request", "major", "minor", "count", "total ms", "avg us");
+    for (int i = 0; i < min(requestCount, LORIE_PROFILE_REPORT_LINES); i++) {
+        const LorieRequestStats* stats = &requestStats[requests[i]];
+        int major = requests[i] >> 8, minor = requests[i] & 0xFF;
+        ExtensionEntry* extension = major >= 128 ? GetExtensionEntry(major) : NULL;
+        fprintf(f, "%-24s %6d %6d %12llu %12.3f %10.3f\n", major < 128 ? "core" : (extension ? extension->name : "unknown"), major, minor,
+                (unsigned long long) stats->count, stats->ns / 1000000.0, stats->ns / 1000.0 / stats->count);
+    }
+
+    fprintf(f, "\n%-32s %6s %12s %12s\n", "client", "index", "requests", "total ms");
+    for (int i = 0; i < min(clientCount, LORIE_PROFILE_REPORT_LINES); i++) {
+        const LorieClientStats* stats = &clientStats[clientIndices[i]];
+        fprintf(f, "%-32s %6d %12llu %12.3f\n", stats->name, clientIndices[i], (unsigned long long) stats->count, stats->ns / 1000000.0);
+    }
+}
+
+static void lorieProfileReport(void) {
+    static int requests[256 * 256], clientIndices[MAXCLIENTS];
+    int requestCount = 0, clientCount = 0;
+    char path[PATH_MAX];
+    FILE* f;
+
+    if (!requestStats || !clientStats)
+        return;
+
+    for (int i = 0; i < 256 * 256; i++)
+        if (requestStats[i].count)
+            requests[requestCount++] = i;
+    for (int i = 0; i < MAXCLIENTS; i++)
+        if (clientStats[i].count)
+            clientIndices[clientCount++] = i;
+
+    qsort(requests, requestCount, sizeof(*requests), compareRequests);
+    qsort(clientIndices, clientCount, sizeof(*clientIndices), compareClients);
+
+    fprintf(stderr, "Request profile:\n");
+    lorieProfileReportTo(stderr, requests, requestCount, clientIndices, clientCount);
+    fflush(stderr);
+
+    snprintf(path, sizeof(path), "%s/termux-x11-requests-%d.txt", getenv("TMPDIR") ?: "/tmp", getpid());
+    if ((f = fopen(path, "we"))) {
+        lorieProfileReportTo(f, requests, requestCount, clientIndices, clientCount);
+        fclose(f);
+        LogMessage(X_INFO, "Request profile written to %s\n", path);
+    }
+}
+
+static void lorieProfilePropertyState(__unused CallbackListPtr *list, __unused void *closure, void *data) {
+    PropertyStateRec* rec = data;
+    char command[16] = {0};
+    if (rec->state != PropertyNewValue || rec->prop->propertyName != profileAtom || rec->win->parent
+            || rec->prop->format != 8 || rec->prop->type != XA_STRING)
+        return;
+
+    memcpy(command, rec->prop->data, min(rec->prop->size, sizeof(command) - 1));
+    if (!strcmp(command, "start"))
+        lorieProfileStart();
+    else if (!strcmp(command, "stop"))
+        lorieProfileStop();
+    else if (!strcmp(command, "reset"))
+        lorieProfileReset();
+    else if (!strcmp(command, "report"))
+        lorieProfileReport();
+}
+
+/* Called from ddxReady, when all extensions have already filled ProcVector. */
+__LIBC_HIDDEN__ void lorieRequestProfilerInit(Bool start) {
+    static const char property[] = "_TERMUX_X11_PROFILE";
+    profileAtom = MakeAtom(property, sizeof(property) - 1, TRUE);
+    // Callback lists are reset on server regeneration.
+    AddCallback(&PropertyStateCallback, lorieProfilePropertyState, NULL);
+    AddCallback(&ClientStateCallback, lorieProfileClientState, NULL);
+    if (start || running)
+        lorieProfileStart();
+}
@@ -0,0 +1,58 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#include <string.h>
+#include "resample.h"
+
+/*
+ * Android delivers touch and stylus samples at the rate of digitizer which is not synchronized with display.
+ * Sending the latest sample at every frame makes motion stutter since the distance between
+ * positions drawn in consecutive frames changes depending on the phase of digitizer.
+ * Like Android's own input resampling we compute position for a moment slightly before the frame
+ * using two latest samples: interpolate if that moment is between them or extrapolate a bit if it is after the latest one.
+ */
+
+#ifndef __LIBC_HIDDEN__
+#define __LIBC_HIDDEN__ // Allows building outside of Android
+#endif
+
+__LIBC_HIDDEN__ void lorieResamplerReset(lorieResampler* r) {
+    memset(r, 0, sizeof(*r));
+}
+
+__LIBC_HIDDEN__ void lorieResamplerAdd(lorieResampler* r, uint32_t time, float x, float y) {
+    if (r->count && r->samples[1].time == time) {
+        // Samples with the same timestamp can not be used to compute velocity.
+        r->samples[1] = (lorieResampleSample) { .time = time, .x = x, .y = y };
+        return;
+    }
+
+    r->samples[0] = r->samples[1];
+    r->samples[1] = (lorieResampleSample) { .time = time, .x = x, .y = y };
+    r->count += r->count < 2;
+}
+
+__LIBC_HIDDEN__ bool lorieResample(const lorieResampler* r, const lorieResampleConfig* config, uint32_t frameTime, float* x, float* y) {
+    const lorieResampleSample *a = &r->samples[0], *b = &r->samples[1];
+    int32_t delta, offset;
+    float alpha;
+
+    if (!config->enabled || r->count < 2)
+        return false;
+
+    delta = (int32_t) (b->time - a->time);
+    if (delta < (int32_t) config->minDelta || delta > (int32_t) config->maxDelta)
+        return false;
+
+    offset = (int32_t) (frameTime - config->latency - b->time);
+    if (offset > 0) {
+        // Motion may change direction at any moment, so prediction is limited to half of sample interval.
+        int32_t limit = (int32_t) config->maxPrediction < delta / 2 ? (int32_t) config->maxPrediction : delta / 2;
+        offset = offset < limit ? offset : limit;
+    } else if (offset < -delta)
+        return false; // The latest sample is too new, it is better to send it as is.
+
+    alpha = (float) offset / (float) delta;
+    *x = b->x + (b->x - a->x) * alpha;
+    *y = b->y + (b->y - a->y) * alpha;
+    return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Resampling of absolute motion to display frames.
+ * This part does not depend on Android or X server, so it can be built on any Linux machine
+ * and fed with recorded traces of (time, x, y) samples.
+ */
+
+typedef struct {
+    bool enabled;
+    uint32_t latency; // position is computed for frame time minus latency, in milliseconds
+    uint32_t maxPrediction; // limit of extrapolation, in milliseconds
+    uint32_t minDelta; // samples closer than that are too noisy to be used, in milliseconds
+    uint32_t maxDelta; // samples farther than that are too old to be used, in milliseconds
+} lorieResampleConfig;
+
+#define LORIE_RESAMPLE_DEFAULTS { .enabled = false, .latency = 5, .maxPrediction = 8, .minDelta = 2, .maxDelta = 20 }
+
+typedef struct {
+    uint32_t time;
+    float x, y;
+} lorieResampleSample;
+
+typedef struct {
+    lorieResampleSample samples[2]; // samples[1] is the latest one
+    int count;
+} lorieResampler;
+
+/**
+ * Forget all samples, must be done when motion is interrupted (i.e. touch ended).
+ *
+ * @param r
+ */
+void lorieResamplerReset(lorieResampler* r);
+
+/**
+ * Remember the sample. Samples must be added in the order of their timestamps.
+ *
+ * @param r
+ * @param time timestamp of the sample in milliseconds, wrapping around is fine.
+ * @param x
+ * @param y
+ */
+void lorieResamplerAdd(lorieResampler* r, uint32_t time, float x, float y);
+
+/**
+ * Compute position for given frame using two latest samples.
+ *
+ * @param r
+ * @param config
+ * @param frameTime time of the frame in milliseconds, the same clock as samples use.
+ * @param x resampled position, not changed if resampling is not possible.
+ * @param y resampled position, not changed if resampling is not possible.
+ * @return true if position was resampled.
+ */
+bool lorieResample(const lorieResampler* r, const lorieResampleConfig* config, uint32_t frameTime, float* x, float* y);
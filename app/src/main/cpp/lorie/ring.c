@@ -0,0 +1,86 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "lorie.h"
+
+/*
+ * Single producer single consumer ring of variable length records.
+ * Activity writes input events to the ring, X server reads them in input thread.
+ * `head` and `tail` are free running byte counters, each record is 32-bit length followed by payload.
+ * Records may wrap around the end of data array, so no padding is needed.
+ */
+
+#define RING_MASK (LORIE_EVENT_RING_SIZE - 1)
+
+_Static_assert((LORIE_EVENT_RING_SIZE & RING_MASK) == 0, "LORIE_EVENT_RING_SIZE must be power of 2");
+
+static inline void ringCopyIn(struct lorie_event_ring* ring, uint32_t pos, const void* data, uint32_t size) {
+    uint32_t offset = pos & RING_MASK, first = min(size, LORIE_EVENT_RING_SIZE - offset);
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const uint8_t*) data + first, size - first);
+}
+
+static inline void ringCopyOut(struct lorie_event_ring* ring, uint32_t pos, void* data, uint32_t size) {
+    uint32_t offset = pos & RING_MASK, first = min(size, LORIE_EVENT_RING_SIZE - offset);
+    memcpy(data, ring->data + offset, first);
+    memcpy((uint8_t*) data + first, ring->data, size - first);
+}
+
+__LIBC_HIDDEN__ void lorieEventRingReset(struct lorie_event_ring* ring) {
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+    // Consumer is not running until doorbell rings.
+    __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+}
+
+__LIBC_HIDDEN__ bool lorieEventRingWrite(struct lorie_event_ring* ring, int doorbell, const void* data, uint32_t size) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LORIE_EVENT_RING_SIZE - (head - tail) < sizeof(uint32_t) + size)
+        return false;
+
+    ringCopyIn(ring, head, &size, sizeof(size));
+    ringCopyIn(ring, head + sizeof(uint32_t), data, size);
+    __atomic_store_n(&ring->head, head + sizeof(uint32_t) + size, __ATOMIC_SEQ_CST);
+
+    // Pairs with lorieEventRingSleep: either consumer sees new head or we see it is going to sleep.
+    if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_SEQ_CST))
+        write(doorbell, &(uint64_t) {1}, sizeof(uint64_t));
+
+    return true;
+}
+
+__LIBC_HIDDEN__ int32_t lorieEventRingRead(struct lorie_event_ring* ring, void* data, uint32_t max) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t size;
+    if (head - tail < sizeof(uint32_t))
+        return -1;
+
+    ringCopyOut(ring, tail, &size, sizeof(size));
+    if (size > head - tail - sizeof(uint32_t)) {
+        // Producer wrote garbage, there is no way to resynchronize.
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    ringCopyOut(ring, tail + sizeof(uint32_t), data, min(size, max));
+    __atomic_store_n(&ring->tail, tail + sizeof(uint32_t) + size, __ATOMIC_RELEASE);
+    return (int32_t) size;
+}
+
+__LIBC_HIDDEN__ void lorieEventRingWake(struct lorie_event_ring* ring) {
+    __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+}
+
+__LIBC_HIDDEN__ bool lorieEventRingSleep(struct lorie_event_ring* ring) {
+    __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+        return true;
+
+    // Producer published records before noticing we are going to sleep.
+    __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+    return false;
+}
@@ -0,0 +1,110 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/system_properties.h>
+#include <android/log.h>
+#include "lorie.h"
+
+/*
+ * Startup timeline.
+ * Both processes record CLOCK_MONOTONIC timestamps of startup phases, it costs a few nanoseconds per phase so it is always on.
+ * X server process finishes the timeline when the first client connects, activity process when it draws the first frame.
+ * Marks made after that (i.e. keymap compiled on layout change) are ignored.
+ *
+ * The summary is printed only if TERMUX_X11_STARTUP_TRACE environment variable (X server)
+ * or debug.termux.x11.startup_trace system property (both processes) is set to non-zero value.
+ * The timeline is also appended to termux-x11-startup.trace in $TMPDIR (X server) or in the cache directory of the app (activity),
+ * one phase per line:
+ *     <process> <pid> <monotonic timestamp, ns> <milliseconds since first phase> <phase>
+ * Timestamps of both processes come from the same clock, so lines from logcat and the file can be merged.
+ */
+
+#define LORIE_STARTUP_MAX_PHASES 32
+
+static struct {
+    const char* phase;
+    uint64_t ns;
+} phases[LORIE_STARTUP_MAX_PHASES];
+static atomic_int phaseCount = 0;
+static atomic_bool finished = false;
+static char traceDir[PATH_MAX];
+
+static bool traceRequested(void) {
+    char prop[PROP_VALUE_MAX] = {0};
+    const char* env = getenv("TERMUX_X11_STARTUP_TRACE");
+    if (env && *env && strcmp(env, "0") != 0)
+        return true;
+
+    return __system_property_get("debug.termux.x11.startup_trace", prop) > 0 && strcmp(prop, "0") != 0;
+}
+
+// Activity process has no $TMPDIR, it passes the cache directory of the app.
+__LIBC_HIDDEN__ void lorieStartupSetDirectory(const char* dir) {
+    snprintf(traceDir, sizeof(traceDir), "%s", dir ?: "");
+}
+
+// Starts new timeline, used by activity process which lives longer than X server.
+__LIBC_HIDDEN__ void lorieStartupReset(void) {
+    atomic_store(&phaseCount, 0);
+    atomic_store(&finished, false);
+}
+
+// phase must be a string literal, it is not copied.
+__LIBC_HIDDEN__ void lorieStartupMark(const char* phase) {
+    int i;
+    if (atomic_load_explicit(&finished, memory_order_relaxed))
+        return;
+
+    i = atomic_fetch_add(&phaseCount, 1);
+    if (i >= LORIE_STARTUP_MAX_PHASES)
+        return;
+
+    phases[i].ns = lorieMonotonicNs();
+    phases[i].phase = phase;
+}
+
+__LIBC_HIDDEN__ void lorieStartupFinish(const char* process) {
+    const char* dir = traceDir[0] ? traceDir : getenv("TMPDIR");
+    char path[PATH_MAX];
+    FILE* trace = NULL;
+    int count, i;
+    if (atomic_load_explicit(&finished, memory_order_relaxed) || atomic_exchange(&finished, true))
+        return;
+
+    count = atomic_load(&phaseCount);
+    if (count > LORIE_STARTUP_MAX_PHASES)
+        count = LORIE_STARTUP_MAX_PHASES;
+    if (!count || !traceRequested())
+        return;
+
+    if (dir) {
+        snprintf(path, sizeof(path), "%s/termux-x11-startup.trace", dir);
+        trace = fopen(path, "ae");
+    }
+
+    __android_log_print(ANDROID_LOG_INFO, "LorieStartup", "%s startup timeline:", process);
+    dprintf(2, "%s startup timeline:\n", process);
+    for (i = 0; i < count; i++) {
+        double total = (double) (phases[i].ns - phases[0].ns) / 1000000.;
+        double delta = (double) (phases[i].ns - phases[i ? i - 1 : 0].ns) / 1000000.;
+        if (!phases[i].phase)
+            continue; // Mark is being recorded by another thread right now.
+
+        __android_log_print(ANDROID_LOG_INFO, "LorieStartup", "%10.3f ms (+%8.3f ms) %s", total, delta, phases[i].phase);
+        dprintf(2, "%10.3f ms (+%8.3f ms) %s\n", total, delta, phases[i].phase);
+        if (trace)
+            fprintf(trace, "%s %d %" PRIu64 " %.3f %s\n", process, getpid(), phases[i].ns, total, phases[i].phase);
+    }
+
+    if (trace)
+        fclose(trace);
+}
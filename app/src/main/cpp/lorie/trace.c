@@ -0,0 +1,173 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/system_properties.h>
+#include <android/log.h>
+#include "trace.h"
+
+#define LORIE_TRACE_RING_SIZE 16384 // Records per thread, must be power of two.
+#define LORIE_TRACE_EXPORT_MARGIN 256 // Records owner thread may overwrite while they are exported.
+
+typedef struct {
+    uint64_t ns;
+    const char* name;
+    int64_t value;
+    char type;
+} LorieTraceRecord;
+
+typedef struct LorieTraceRing {
+    struct LorieTraceRing* next;
+    pid_t tid;
+    char threadName[16];
+    uint64_t head; // Written only by owner thread.
+    LorieTraceRecord records[LORIE_TRACE_RING_SIZE];
+} LorieTraceRing;
+
+__LIBC_HIDDEN__ bool lorieTraceEnabled = false;
+static LorieTraceRing* rings = NULL;
+static __thread LorieTraceRing* threadRing = NULL;
+static char tracePath[PATH_MAX];
+static const char* traceProcess = NULL;
+static int exportDoorbell = -1;
+
+// Rings are never freed, so records of exited threads are still exported.
+static LorieTraceRing* lorieTraceRingCreate(void) {
+    LorieTraceRing* ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->tid = gettid();
+    pthread_getname_np(pthread_self(), ring->threadName, sizeof(ring->threadName));
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return threadRing = ring;
+}
+
+__LIBC_HIDDEN__ void lorieTraceRecord(char type, const char* name, int64_t value) {
+    LorieTraceRing* ring = threadRing ?: lorieTraceRingCreate();
+    LorieTraceRecord* record;
+    struct timespec ts;
+    uint64_t head;
+    if (!ring)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    head = ring->head;
+    record = &ring->records[head & (LORIE_TRACE_RING_SIZE - 1)];
+    record->ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->name = name;
+    record->value = value;
+    record->type = type;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Timestamps are CLOCK_MONOTONIC microseconds, the same clock in both processes,
+ * so trace files of X server and activity can be opened together.
+ */
+__LIBC_HIDDEN__ bool lorieTraceExport(const char* path) {
+    char tmp[PATH_MAX + 16];
+    const char* separator = "\n";
+    LorieTraceRing* ring;
+    bool ok;
+    FILE* f;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if (!(f = fopen(tmp, "we")))
+        return false;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    if (traceProcess) {
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", separator, getpid(), traceProcess);
+        separator = ",\n";
+    }
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), i;
+        uint64_t start = head > LORIE_TRACE_RING_SIZE - LORIE_TRACE_EXPORT_MARGIN ? head - (LORIE_TRACE_RING_SIZE - LORIE_TRACE_EXPORT_MARGIN) : 0;
+
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, getpid(), ring->tid, ring->threadName);
+        separator = ",\n";
+        for (i = start; i < head; i++) {
+            LorieTraceRecord record = ring->records[i & (LORIE_TRACE_RING_SIZE - 1)];
+            if (!record.name)
+                continue;
+
+            fprintf(f, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03u",
+                    record.type, record.name, getpid(), ring->tid, record.ns / 1000, (unsigned) (record.ns % 1000));
+            if (record.type == LORIE_TRACE_INSTANT)
+                fprintf(f, ",\"s\":\"t\",\"args\":{\"value\":%" PRId64 "}}", record.value);
+            else if (record.type == LORIE_TRACE_COUNTER)
+                fprintf(f, ",\"args\":{\"value\":%" PRId64 "}}", record.value);
+            else
+                fprintf(f, "}");
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    ok = fclose(f) == 0 && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
+
+static void requestExport(__unused int sig) {
+    uint64_t one = 1;
+    write(exportDoorbell, &one, sizeof(one));
+}
+
+static void exportAtExit(void) {
+    lorieTraceExport(tracePath);
+}
+
+__noreturn static void* exportThread(__unused void* cookie) {
+    uint64_t count;
+    pthread_setname_np(pthread_self(), "LorieTraceExport");
+    while (true) {
+        if (read(exportDoorbell, &count, sizeof(count)) != sizeof(count))
+            continue;
+
+        if (lorieTraceExport(tracePath))
+            __android_log_print(ANDROID_LOG_INFO, "LorieTrace", "Trace written to %s", tracePath);
+        else
+            __android_log_print(ANDROID_LOG_ERROR, "LorieTrace", "Failed to write trace to %s", tracePath);
+    }
+}
+
+__LIBC_HIDDEN__ void lorieTraceStart(const char* process, const char* dir) {
+#ifdef LORIE_TRACE
+    struct sigaction sa = { .sa_handler = requestExport, .sa_flags = SA_RESTART };
+    char prop[PROP_VALUE_MAX] = {0};
+    const char* env = getenv("TERMUX_X11_TRACE");
+    pthread_t t;
+
+    if (exportDoorbell != -1)
+        return;
+
+    if (!(env && *env && strcmp(env, "0") != 0)
+            && !(__system_property_get("debug.termux.x11.trace", prop) > 0 && strcmp(prop, "0") != 0))
+        return;
+
+    if ((exportDoorbell = eventfd(0, EFD_CLOEXEC)) < 0)
+        return;
+
+    traceProcess = process;
+    snprintf(tracePath, sizeof(tracePath), "%s/termux-x11-trace-%s-%d.json", dir ?: "/tmp", process, getpid());
+    pthread_create(&t, NULL, exportThread, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    atexit(exportAtExit);
+    __atomic_store_n(&lorieTraceEnabled, true, __ATOMIC_RELAXED);
+    __android_log_print(ANDROID_LOG_INFO, "LorieTrace", "Tracing enabled, send SIGUSR2 to %d to write %s", getpid(), tracePath);
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Binary trace ring.
+ * Every thread which hits an enabled trace point gets its own ring of fixed-size records,
+ * so recording is a relaxed check of global flag, clock_gettime and a few stores, without locks or syscalls.
+ * Trace points are compiled in only if LORIE_TRACE is defined (see LORIE_TRACE option in xserver.cmake),
+ * otherwise they expand to nothing. Names must be string literals, they are stored as pointers.
+ * Rings are exported in Chrome trace (JSON) format which Perfetto UI and chrome://tracing open.
+ */
+
+#define LORIE_TRACE_BEGIN 'B'
+#define LORIE_TRACE_END 'E'
+#define LORIE_TRACE_INSTANT 'i'
+#define LORIE_TRACE_COUNTER 'C'
+
+#ifdef LORIE_TRACE
+extern bool lorieTraceEnabled;
+void lorieTraceRecord(char type, const char* name, int64_t value);
+#define lorieTraceEvent(type, name, value) do { \
+        if (__builtin_expect(__atomic_load_n(&lorieTraceEnabled, __ATOMIC_RELAXED), 0)) \
+            lorieTraceRecord(type, name, value); \
+    } while (0)
+#else
+#define lorieTraceEvent(type, name, value) do {} while (0)
+#endif
+
+#define lorieTraceBegin(name) lorieTraceEvent(LORIE_TRACE_BEGIN, name, 0)
+#define lorieTraceEnd(name) lorieTraceEvent(LORIE_TRACE_END, name, 0)
+#define lorieTraceInstant(name, value) lorieTraceEvent(LORIE_TRACE_INSTANT, name, value)
+#define lorieTraceCounter(name, value) lorieTraceEvent(LORIE_TRACE_COUNTER, name, value)
+
+/*
+ * Enables tracing if it was requested with TERMUX_X11_TRACE environment variable or debug.termux.x11.trace system property.
+ * Rings are written to <dir>/termux-x11-trace-<process>-<pid>.json when process gets SIGUSR2 and when it exits.
+ * Does nothing if trace points are not compiled in.
+ */
+void lorieTraceStart(const char* process, const char* dir);
+bool lorieTraceExport(const char* path);
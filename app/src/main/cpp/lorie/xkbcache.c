@@ -0,0 +1,139 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <os.h>
+#include "lorie.h"
+#include "filecache.h"
+
+/*
+ * Compiled keymap cache.
+ * X server runs embedded xkbcomp on every start and every layout change, parsing XKB sources takes a lot of time on slow devices.
+ * Compiled XKM files are kept in $TMPDIR/.xkm-cache (see filecache.h), key is a hash of everything compiler output depends on:
+ * keymap source X server feeds to xkbcomp (it names components selected by rules, model, layout, variant and options),
+ * modification times of XKB component directories and of files the keymap source includes,
+ * and the library xkbcomp is linked to.
+ */
+
+#define XKM_CACHE_VERSION "1"
+#define XKM_CACHE_DIR ".xkm-cache"
+#define XKM_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+static const struct {
+    const char *keyword, *dir;
+} xkbComponents[] = {
+    { "xkb_keycodes", "keycodes" },
+    { "xkb_types", "types" },
+    { "xkb_compat", "compat" },
+    { "xkb_symbols", "symbols" },
+    { "xkb_geometry", "geometry" },
+};
+
+/*
+ * Keymap source looks like
+ *     xkb_symbols { include "pc+us+inet(evdev)" };
+ * Files included from these files are not tracked, but packages replace files with rename, so directory mtime changes anyway.
+ */
+static uint64_t hashSources(uint64_t hash, const char* base, const char* text) {
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < sizeof(xkbComponents) / sizeof(*xkbComponents); i++) {
+        snprintf(path, sizeof(path), "%s/%s", base, xkbComponents[i].dir);
+        hash = lorieCacheHashFile(hash, path);
+    }
+
+    for (const char *line = text, *next; line; line = next) {
+        const char *names, *end;
+        next = strchr(line, '\n');
+        next = next ? next + 1 : NULL;
+        for (i = 0; i < sizeof(xkbComponents) / sizeof(*xkbComponents); i++)
+            if (!strncmp(line + strspn(line, " \t"), xkbComponents[i].keyword, strlen(xkbComponents[i].keyword)))
+                break;
+
+        if (i == sizeof(xkbComponents) / sizeof(*xkbComponents) || !(names = strstr(line, "include \"")))
+            continue;
+
+        names += strlen("include \"");
+        end = strpbrk(names, "\"\n");
+        while (names < end) {
+            size_t len = strcspn(names, "+|\"\n"), name = strcspn(names, "(:+|\"\n");
+            if (name) {
+                snprintf(path, sizeof(path), "%s/%s/%.*s", base, xkbComponents[i].dir, (int) name, names);
+                hash = lorieCacheHashFile(hash, path);
+            }
+            names += len + 1;
+        }
+    }
+
+    return hash;
+}
+
+/*
+ * Writes keymap source with callback and puts compiled XKM to xkmfile, taking it from cache if possible.
+ * Called by RunXkbComp (see xserver.patch). Returns 1 if keymap is ready, -1 if compiler failed
+ * (it already reported errors, running it again gives nothing) and 0 if X server should run compiler the usual way.
+ */
+__LIBC_HIDDEN__ int lorieRunXkbComp(void (*callback)(FILE*, void*), void* userdata, const char* base, const char* xkmfile) {
+    char *text = NULL, cached[PATH_MAX];
+    uint64_t hash = LORIE_CACHE_HASH_INIT;
+    size_t size = 0;
+    Dl_info info;
+    FILE* out;
+
+    lorieStartupMark("XKB compile started");
+    if (!(out = open_memstream(&text, &size)))
+        return 0;
+
+    callback(out, userdata);
+    if (fclose(out) != 0 || !text) {
+        free(text);
+        return 0;
+    }
+
+    hash = lorieCacheHash(hash, XKM_CACHE_VERSION, sizeof(XKM_CACHE_VERSION));
+    if (dladdr((void*) lorieRunXkbComp, &info) && info.dli_fname)
+        hash = lorieCacheHashFile(hash, info.dli_fname);
+    hash = lorieCacheHash(hash, base, strlen(base) + 1);
+    hash = hashSources(hash, base, text);
+    hash = lorieCacheHash(hash, text, size);
+
+    if (!lorieCacheEntryPath(cached, sizeof(cached), XKM_CACHE_DIR, hash, ".xkm")) {
+        free(text);
+        return 0;
+    }
+
+    // xkbcomp truncates existing output file, it must not be linked to cache entry.
+    unlink(xkmfile);
+    if (lorieCacheLinkFile(cached, xkmfile)) {
+        LogMessage(X_INFO, "XKB: Using cached keymap %s\n", cached);
+        lorieStartupMark("XKB keymap taken from cache");
+        lorieCacheTouch(cached);
+        free(text);
+        return 1;
+    }
+
+    if (!(out = Popen("xkbcomp", "w"))) {
+        free(text);
+        return 0;
+    }
+
+    fwrite(text, 1, size, out);
+    free(text);
+    if (Pclose(out) != 0)
+        return -1;
+
+    lorieStartupMark("XKB keymap compiled");
+    if (lorieCachePublishFile(cached, xkmfile))
+        lorieCacheTrim(XKM_CACHE_DIR, XKM_CACHE_MAX_BYTES);
+
+    return 1;
+}
@@ -1,6 +1,12 @@
 #include <stdint.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
 
 struct xshmfence {
     uint8_t is_futex;
@@ -40,9 +46,28 @@ void xshmfence_reset(struct xshmfence *f) {
 }
 
 int xshmfence_alloc_shm(void) {
-    // xcb_dri3_fd_from_fence is not used in mesa so I assume it will not be used in applications.
-    // also we can not find out which implementation is used in X client (futex, glibc pthread, bionic pthread) so we will not implement it at all.
-    return -1;
+    // Fences allocated by X server (DRI3 FDFromFence, SyncFence created by server) are always futex-based.
+    // Futex fence is a single 32-bit word, xshmfence_map_shm recognizes it by the size of shared memory fragment.
+    // Only clients whose libxshmfence uses the futex backend (the default on Linux, regardless of libc) can use it.
+    // Clients built with the pthread backend expect a bigger fragment with pthread primitives and can not map it;
+    // we can not tell which backend client uses, so such clients must not rely on server-created fences.
+    int fd = (int) syscall(__NR_memfd_create, "xshmfence", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        char path[PATH_MAX] = {0};
+        snprintf(path, sizeof(path), "%s/shmfd-XXXXXX", getenv("TMPDIR") ?: "/tmp");
+        if ((fd = mkostemp(path, O_CLOEXEC)) < 0)
+            return -1;
+        unlink(path);
+    }
+
+    if (ftruncate(fd, sizeof(int32_t)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Nobody should be able to resize the fence and make us guess the wrong implementation.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    return fd;
 }
 
 struct xshmfence * xshmfence_map_shm(int fd) {
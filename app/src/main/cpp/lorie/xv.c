@@ -0,0 +1,435 @@
+#pragma clang diagnostic ignored "-Wunknown-pragmas"
+#pragma ide diagnostic ignored "cppcoreguidelines-narrowing-conversions"
+
+#ifdef HAVE_DIX_CONFIG_H
+#include <dix-config.h>
+#endif
+
+#include <X11/X.h>
+#include <X11/extensions/Xv.h>
+#include <X11/extensions/Xvproto.h>
+#include "scrnintstr.h"
+#include "gcstruct.h"
+#include "regionstr.h"
+#include "resource.h"
+#include "xvdix.h"
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lorie.h"
+
+#define unused __attribute__((unused))
+#define log(prio, ...) __android_log_print(ANDROID_LOG_ ## prio, "LorieNative", __VA_ARGS__)
+
+#define FOURCC_YUY2 0x32595559
+#define FOURCC_YV12 0x32315659
+#define FOURCC_I420 0x30323449
+#define FOURCC_NV12 0x3231564e
+
+#define LORIE_XV_NUM_PORTS 16
+#define LORIE_XV_MAX_SIZE 8192
+// Converted image is pushed to the drawable in strips to keep the scratch memory small and cache-hot.
+#define LORIE_XV_STRIP_ROWS 32
+
+#define LORIE_XV_GUID(a, b, c, d) { a, b, c, d, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 }
+#define LORIE_XV_IMAGE(fourcc, uuid, bpp, fmt, planes, hu, vu, order) { \
+        .id = fourcc, .type = XvYUV, .byte_order = LSBFirst, .guid = uuid, .bits_per_pixel = bpp, .format = fmt, \
+        .num_planes = planes, .y_sample_bits = 8, .u_sample_bits = 8, .v_sample_bits = 8, \
+        .horz_y_period = 1, .horz_u_period = hu, .horz_v_period = hu, \
+        .vert_y_period = 1, .vert_u_period = vu, .vert_v_period = vu, \
+        .component_order = order, .scanline_order = XvTopToBottom }
+
+static XvImageRec lorieXvImages[] = {
+        LORIE_XV_IMAGE(FOURCC_YUY2, LORIE_XV_GUID('Y', 'U', 'Y', '2'), 16, XvPacked, 1, 2, 1, "YUYV"),
+        LORIE_XV_IMAGE(FOURCC_YV12, LORIE_XV_GUID('Y', 'V', '1', '2'), 12, XvPlanar, 3, 2, 2, "YVU"),
+        LORIE_XV_IMAGE(FOURCC_I420, LORIE_XV_GUID('I', '4', '2', '0'), 12, XvPlanar, 3, 2, 2, "YUV"),
+        LORIE_XV_IMAGE(FOURCC_NV12, LORIE_XV_GUID('N', 'V', '1', '2'), 12, XvPlanar, 2, 2, 2, "YUV"),
+};
+
+typedef struct {
+    uint32_t *strip, *row;
+    size_t stripSize, rowSize;
+} LorieXvPortPriv;
+
+typedef struct {
+    int id;
+    const uint8_t *y, *u, *v;
+    int yPitch, uvPitch;
+    int uvStep; // 1 for planar chroma, 2 for interleaved (NV12) chroma
+} LorieXvFrame;
+
+static struct {
+    XvAdaptorRec adaptor;
+    XvEncodingRec encoding;
+    XvFormatRec formats[8];
+    XvPortRec ports[LORIE_XV_NUM_PORTS];
+    LorieXvPortPriv privs[LORIE_XV_NUM_PORTS];
+    CloseScreenProcPtr CloseScreen;
+} lorieXv;
+
+static inline uint32_t lorieXvClamp(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// BT.601 limited range, 8-bit fixed point. The NEON path below uses exactly the same coefficients and rounding.
+static inline uint32_t lorieXvPixel(int y, int u, int v) {
+    int c = 298 * (y - 16) + 128, d = u - 128, e = v - 128;
+    return 0xFF000000
+           | lorieXvClamp((c + 409 * e) >> 8) << 16
+           | lorieXvClamp((c - 100 * d - 208 * e) >> 8) << 8
+           | lorieXvClamp((c + 516 * d) >> 8);
+}
+
+#if defined(__ARM_NEON)
+#define LORIE_XV_CHANNEL_HALF(half, c, d, e, kd, ke) \
+        vqrshrun_n_s32(vmlal_n_s16(vmlal_n_s16(vmull_n_s16(half(c), 298), half(d), kd), half(e), ke), 8)
+#define LORIE_XV_CHANNEL(c, d, e, kd, ke) vqmovn_u16(vcombine_u16( \
+        LORIE_XV_CHANNEL_HALF(vget_low_s16, c, d, e, kd, ke), LORIE_XV_CHANNEL_HALF(vget_high_s16, c, d, e, kd, ke)))
+
+static inline void lorieXvStore8(uint32_t *out, uint8x8_t y, uint8x8_t u, uint8x8_t v) {
+    // Widening subtraction wraps around, reinterpreting the result as signed gives correct negative values.
+    int16x8_t c = vreinterpretq_s16_u16(vsubl_u8(y, vdup_n_u8(16)));
+    int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(u, vdup_n_u8(128)));
+    int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(v, vdup_n_u8(128)));
+    uint8x8x4_t px;
+
+    px.val[0] = LORIE_XV_CHANNEL(c, d, e, 516, 0);
+    px.val[1] = LORIE_XV_CHANNEL(c, d, e, -100, -208);
+    px.val[2] = LORIE_XV_CHANNEL(c, d, e, 0, 409);
+    px.val[3] = vdup_n_u8(0xFF);
+    vst4_u8((uint8_t*) out, px);
+}
+#endif
+
+/**
+ * Converts `count` pixels of source row `sy` starting at source column `sx` to x8r8g8b8.
+ */
+static void lorieXvConvertRow(const LorieXvFrame *f, int sy, int sx, int count, uint32_t *out) {
+    int i = 0, x = sx;
+
+    if (f->id == FOURCC_YUY2) {
+        const uint8_t *row = f->y + sy * f->yPitch;
+        if (x & 1 && i < count)
+            out[i++] = lorieXvPixel(row[x * 2], row[x * 2 - 1], row[x * 2 + 1]), x++;
+#if defined(__ARM_NEON)
+        for (; i + 16 <= count; i += 16, x += 16) {
+            uint8x8x4_t p = vld4_u8(row + x * 2);
+            uint8x8x2_t yy = vzip_u8(p.val[0], p.val[2]), uu = vzip_u8(p.val[1], p.val[1]), vv = vzip_u8(p.val[3], p.val[3]);
+            lorieXvStore8(out + i, yy.val[0], uu.val[0], vv.val[0]);
+            lorieXvStore8(out + i + 8, yy.val[1], uu.val[1], vv.val[1]);
+        }
+#endif
+        for (; i < count; i++, x++) {
+            const uint8_t *pair = row + (x & ~1) * 2;
+            out[i] = lorieXvPixel(row[x * 2], pair[1], pair[3]);
+        }
+    } else {
+        const uint8_t *yRow = f->y + sy * f->yPitch;
+        const uint8_t *uRow = f->u + (sy >> 1) * f->uvPitch, *vRow = f->v + (sy >> 1) * f->uvPitch;
+        if (x & 1 && i < count)
+            out[i++] = lorieXvPixel(yRow[x], uRow[(x >> 1) * f->uvStep], vRow[(x >> 1) * f->uvStep]), x++;
+#if defined(__ARM_NEON)
+        for (; i + 16 <= count; i += 16, x += 16) {
+            uint8x16_t y = vld1q_u8(yRow + x);
+            uint8x8_t u, v;
+            if (f->uvStep == 2) {
+                uint8x8x2_t uv = vld2_u8(uRow + x);
+                u = uv.val[0];
+                v = uv.val[1];
+            } else {
+                u = vld1_u8(uRow + x / 2);
+                v = vld1_u8(vRow + x / 2);
+            }
+
+            uint8x8x2_t uu = vzip_u8(u, u), vv = vzip_u8(v, v);
+            lorieXvStore8(out + i, vget_low_u8(y), uu.val[0], vv.val[0]);
+            lorieXvStore8(out + i + 8, vget_high_u8(y), uu.val[1], vv.val[1]);
+        }
+#endif
+        for (; i < count; i++, x++)
+            out[i] = lorieXvPixel(yRow[x], uRow[(x >> 1) * f->uvStep], vRow[(x >> 1) * f->uvStep]);
+    }
+}
+
+static Bool lorieXvReserve(uint32_t **buf, size_t *size, size_t pixels) {
+    uint32_t *tmp;
+    if (*size >= pixels)
+        return TRUE;
+
+    if (!(tmp = realloc(*buf, pixels * sizeof(uint32_t))))
+        return FALSE;
+
+    *buf = tmp;
+    *size = pixels;
+    return TRUE;
+}
+
+static int lorieXvQueryImageAttributes(unused XvPortPtr pPort, XvImagePtr format, CARD16 *w, CARD16 *h, int *pitches, int *offsets) {
+    int size, tmp;
+
+    *w = min(*w, LORIE_XV_MAX_SIZE);
+    *h = min(*h, LORIE_XV_MAX_SIZE);
+    *w = (*w + 1) & ~1;
+    if (offsets)
+        offsets[0] = 0;
+
+    switch (format->id) {
+        case FOURCC_YV12:
+        case FOURCC_I420:
+            *h = (*h + 1) & ~1;
+            size = (*w + 3) & ~3;
+            if (pitches)
+                pitches[0] = size;
+            size *= *h;
+            if (offsets)
+                offsets[1] = size;
+            tmp = ((*w >> 1) + 3) & ~3;
+            if (pitches)
+                pitches[1] = pitches[2] = tmp;
+            tmp *= (*h >> 1);
+            size += tmp;
+            if (offsets)
+                offsets[2] = size;
+            size += tmp;
+            break;
+        case FOURCC_NV12:
+            *h = (*h + 1) & ~1;
+            size = (*w + 3) & ~3;
+            if (pitches)
+                pitches[0] = pitches[1] = size;
+            size *= *h;
+            if (offsets)
+                offsets[1] = size;
+            size += ((*w + 3) & ~3) * (*h >> 1);
+            break;
+        case FOURCC_YUY2:
+        default:
+            size = *w << 1;
+            if (pitches)
+                pitches[0] = size;
+            size *= *h;
+            break;
+    }
+
+    return size;
+}
+
+static int lorieXvPutImage(DrawablePtr pDraw, XvPortPtr pPort, GCPtr pGC,
+                           INT16 src_x, INT16 src_y, CARD16 src_w, CARD16 src_h,
+                           INT16 drw_x, INT16 drw_y, CARD16 drw_w, CARD16 drw_h,
+                           XvImagePtr format, unsigned char *data, unused Bool sync, CARD16 width, CARD16 height) {
+    LorieXvPortPriv *priv = pPort->devPriv.ptr;
+    int pitches[3] = {0}, offsets[3] = {0}, x, y, rows, cw, sy, lastSy;
+    CARD16 w = width, h = height;
+    LorieXvFrame f = { .id = format->id };
+    BoxRec clip, *extents;
+    ChangeGCVal values[2] = { { .val = GXcopy }, { .val = ~0U } };
+    GCPtr gc;
+
+    if (pDraw->depth != 24 && pDraw->depth != 32)
+        return BadMatch;
+
+    // Clamp the source rectangle to the image, clients are allowed to pass anything here.
+    if (src_x < 0)
+        src_w = max(0, src_w + src_x), src_x = 0;
+    if (src_y < 0)
+        src_h = max(0, src_h + src_y), src_y = 0;
+    src_w = min(src_w, max(0, width - src_x));
+    src_h = min(src_h, max(0, height - src_y));
+    if (!src_w || !src_h || !drw_w || !drw_h || width > LORIE_XV_MAX_SIZE || height > LORIE_XV_MAX_SIZE)
+        return Success;
+
+    lorieXvQueryImageAttributes(pPort, format, &w, &h, pitches, offsets);
+    f.y = data;
+    f.yPitch = pitches[0];
+    f.uvPitch = pitches[1];
+    f.uvStep = 1;
+    switch (format->id) {
+        case FOURCC_I420:
+            f.u = data + offsets[1];
+            f.v = data + offsets[2];
+            break;
+        case FOURCC_YV12:
+            f.v = data + offsets[1];
+            f.u = data + offsets[2];
+            break;
+        case FOURCC_NV12:
+            f.u = data + offsets[1];
+            f.v = f.u + 1;
+            f.uvStep = 2;
+            break;
+        case FOURCC_YUY2:
+            break;
+        default:
+            return BadMatch;
+    }
+
+    // Only convert pixels which will end up visible, composite clip is in screen coordinates.
+    extents = RegionExtents(pGC->pCompositeClip);
+    clip.x1 = max(pDraw->x + drw_x, extents->x1) - pDraw->x;
+    clip.y1 = max(pDraw->y + drw_y, extents->y1) - pDraw->y;
+    clip.x2 = min(pDraw->x + drw_x + drw_w, extents->x2) - pDraw->x;
+    clip.y2 = min(pDraw->y + drw_y + drw_h, extents->y2) - pDraw->y;
+    if (clip.x1 >= clip.x2 || clip.y1 >= clip.y2)
+        return Success;
+
+    cw = clip.x2 - clip.x1;
+    if (!lorieXvReserve(&priv->strip, &priv->stripSize, cw * LORIE_XV_STRIP_ROWS)
+        || (src_w != drw_w && !lorieXvReserve(&priv->row, &priv->rowSize, src_w)))
+        return BadAlloc;
+
+    // Video replaces the pixels, only clip of the client GC applies, not its function or plane mask.
+    if (!(gc = GetScratchGC(pDraw->depth, pDraw->pScreen)))
+        return BadAlloc;
+    ChangeGC(NullClient, gc, GCFunction | GCPlaneMask, values);
+    CopyGC(pGC, gc, GCSubwindowMode | GCClipXOrigin | GCClipYOrigin | GCClipMask);
+    ValidateGC(pDraw, gc);
+
+    for (y = clip.y1; y < clip.y2; y += rows) {
+        rows = min(LORIE_XV_STRIP_ROWS, clip.y2 - y);
+        lastSy = -1;
+        for (int r = 0; r < rows; r++) {
+            uint32_t *out = priv->strip + r * cw;
+            sy = src_y + (int) (((int64_t) (y + r - drw_y) * src_h) / drw_h);
+            if (sy == lastSy) {
+                // Upscaling, the row is the same as the previous one.
+                memcpy(out, out - cw, cw * sizeof(*out));
+                continue;
+            }
+
+            if (src_w == drw_w)
+                lorieXvConvertRow(&f, sy, src_x + clip.x1 - drw_x, cw, out);
+            else {
+                uint32_t step = ((uint32_t) src_w << 16) / drw_w;
+                uint64_t pos = ((uint64_t) (clip.x1 - drw_x) * src_w << 16) / drw_w;
+                lorieXvConvertRow(&f, sy, src_x, src_w, priv->row);
+                for (x = 0; x < cw; x++, pos += step)
+                    out[x] = priv->row[min(pos >> 16, src_w - 1)];
+            }
+            lastSy = sy;
+        }
+
+        gc->ops->PutImage(pDraw, gc, pDraw->depth, clip.x1, y, cw, rows, 0, ZPixmap, (char*) priv->strip);
+    }
+
+    FreeScratchGC(gc);
+    return Success;
+}
+
+static int lorieXvStopVideo(XvPortPtr pPort, unused DrawablePtr pDraw) {
+    LorieXvPortPriv *priv = pPort->devPriv.ptr;
+    free(priv->strip);
+    free(priv->row);
+    *priv = (LorieXvPortPriv) {0};
+    return Success;
+}
+
+static int lorieXvNoAttribute(unused XvPortPtr pPort, unused Atom attribute, unused INT32 value) {
+    return BadMatch;
+}
+
+static int lorieXvGetNoAttribute(unused XvPortPtr pPort, unused Atom attribute, unused INT32 *value) {
+    return BadMatch;
+}
+
+static int lorieXvQueryBestSize(unused XvPortPtr pPort, unused CARD8 motion, unused CARD16 vid_w, unused CARD16 vid_h,
+                                CARD16 drw_w, CARD16 drw_h, unsigned int *p_w, unsigned int *p_h) {
+    *p_w = drw_w;
+    *p_h = drw_h;
+    return Success;
+}
+
+static int lorieXvNoVideo(unused DrawablePtr pDraw, unused XvPortPtr pPort, unused GCPtr pGC,
+                          unused INT16 vid_x, unused INT16 vid_y, unused CARD16 vid_w, unused CARD16 vid_h,
+                          unused INT16 drw_x, unused INT16 drw_y, unused CARD16 drw_w, unused CARD16 drw_h) {
+    return BadMatch;
+}
+
+static Bool lorieXvCloseScreen(ScreenPtr pScreen) {
+    for (int i = 0; i < LORIE_XV_NUM_PORTS; i++)
+        lorieXvStopVideo(&lorieXv.ports[i], NULL);
+
+    pScreen->CloseScreen = lorieXv.CloseScreen;
+    return pScreen->CloseScreen(pScreen);
+}
+
+Bool lorieXvInit(ScreenPtr pScreen) {
+    XvScreenPtr pxvs;
+    int i, j, k, nFormats = 0;
+
+    if (XvScreenInit(pScreen) != Success)
+        return FALSE;
+
+    if (!(pxvs = dixLookupPrivate(&pScreen->devPrivates, XvGetScreenKey())))
+        return FALSE;
+
+    memset(&lorieXv, 0, sizeof(lorieXv));
+    for (i = 0; i < pScreen->numDepths; i++) {
+        DepthPtr depth = &pScreen->allowedDepths[i];
+        if (depth->depth != 24 && depth->depth != 32)
+            continue;
+
+        for (j = 0; j < depth->numVids; j++)
+            for (k = 0; k < pScreen->numVisuals && nFormats < (int) ARRAY_SIZE(lorieXv.formats); k++)
+                if (pScreen->visuals[k].vid == depth->vids[j] && pScreen->visuals[k].class == TrueColor)
+                    lorieXv.formats[nFormats++] = (XvFormatRec) { .depth = depth->depth, .visual = depth->vids[j] };
+    }
+
+    lorieXv.encoding = (XvEncodingRec) {
+            .id = 0,
+            .name = "XV_IMAGE",
+            .pScreen = pScreen,
+            .width = LORIE_XV_MAX_SIZE,
+            .height = LORIE_XV_MAX_SIZE,
+            .rate = { 1, 1 },
+    };
+
+    lorieXv.adaptor = (XvAdaptorRec) {
+            .type = XvInputMask | XvImageMask,
+            .name = "Termux:X11 Video (CPU)",
+            .nEncodings = 1,
+            .pEncodings = &lorieXv.encoding,
+            .nFormats = nFormats,
+            .pFormats = lorieXv.formats,
+            .nImages = ARRAY_SIZE(lorieXvImages),
+            .pImages = lorieXvImages,
+            .nPorts = LORIE_XV_NUM_PORTS,
+            .pPorts = lorieXv.ports,
+            .pScreen = pScreen,
+            .ddPutVideo = lorieXvNoVideo,
+            .ddPutStill = lorieXvNoVideo,
+            .ddGetVideo = lorieXvNoVideo,
+            .ddGetStill = lorieXvNoVideo,
+            .ddStopVideo = lorieXvStopVideo,
+            .ddSetPortAttribute = lorieXvNoAttribute,
+            .ddGetPortAttribute = lorieXvGetNoAttribute,
+            .ddQueryBestSize = lorieXvQueryBestSize,
+            .ddPutImage = lorieXvPutImage,
+            .ddQueryImageAttributes = lorieXvQueryImageAttributes,
+    };
+
+    for (i = 0; i < LORIE_XV_NUM_PORTS; i++) {
+        XvPortPtr port = &lorieXv.ports[i];
+        port->id = FakeClientID(0);
+        port->pAdaptor = &lorieXv.adaptor;
+        port->pNotify = NULL;
+        port->pDraw = NULL;
+        port->client = NULL;
+        port->grab.client = NULL;
+        port->time = currentTime;
+        port->devPriv.ptr = &lorieXv.privs[i];
+        if (!AddResource(port->id, XvGetRTPort(), port))
+            return FALSE;
+    }
+
+    lorieXv.adaptor.base_id = lorieXv.ports[0].id;
+
+    pxvs->nAdaptors = 1;
+    pxvs->pAdaptors = &lorieXv.adaptor;
+
+    lorieXv.CloseScreen = pScreen->CloseScreen;
+    pScreen->CloseScreen = lorieXvCloseScreen;
+
+    return TRUE;
+}
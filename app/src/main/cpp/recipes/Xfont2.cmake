@@ -42,7 +42,9 @@ add_library(Xfont2 STATIC
         "libxfont/src/builtins/file.c"
         "libxfont/src/builtins/fonts.c"
         "libxfont/src/builtins/fpe.c"
-        "libxfont/src/builtins/render.c")
+        "libxfont/src/builtins/render.c"
+
+        "lorie/fontcache.c")
 target_compile_options(Xfont2 PRIVATE
         ${common_compile_options}
         "-fvisibility=hidden"
@@ -67,4 +69,7 @@ target_compile_options(Xfont2 PRIVATE
         "-D_XOPEN_SOURCE"
         "-DNOFILES_MAX=512")
 target_include_directories(Xfont2 PRIVATE "libxfont" "libxfont/include" "libfontenc/include")
+# Font directory reading is wrapped in lorie/fontcache.c to cache parsed fonts.dir and fonts.alias.
+set_source_files_properties("libxfont/src/fontfile/dirfile.c" PROPERTIES COMPILE_OPTIONS
+        "-DFontFileReadDirectory=FontFileReadDirectoryUncached;-DFontFileAddFontFile=lorieFontCacheAddFontFile;-DFontFileAddFontAlias=lorieFontCacheAddFontAlias")
 target_link_libraries(Xfont2 PUBLIC xorgproto)
@@ -279,6 +279,15 @@ add_library(Xlorie SHARED
         "lorie/InitOutput.c"
         "lorie/InitInput.c"
         "lorie/InputXKB.c"
+        "lorie/xkbcache.c"
+        "lorie/filecache.c"
+        "lorie/startup.c"
+        "lorie/trace.c"
+        "lorie/requestprofile.c"
+        "lorie/xv.c"
+        "lorie/ring.c"
+        "lorie/protocol.c"
+        "lorie/resample.c"
         "lorie/renderer.c"
         "lorie/buffer.c"
         "lorie/activity.c")
@@ -286,5 +295,9 @@ target_include_directories(Xlorie PRIVATE ${inc} "libxcvt/include")
 target_link_options(Xlorie PRIVATE "-Wl,--as-needed" "-Wl,--no-undefined" "-fvisibility=hidden")
 target_link_libraries(Xlorie "-Wl,--whole-archive" ${XSERVER_LIBS} "-Wl,--no-whole-archive" android log m z EGL GLESv2)
 target_compile_options(Xlorie PRIVATE ${compile_options})
+option(LORIE_TRACE "Build Xlorie with trace points, see lorie/trace.h" ON)
+if (LORIE_TRACE)
+    target_compile_definitions(Xlorie PRIVATE LORIE_TRACE)
+endif()
 target_apply_patch(Xlorie "${CMAKE_CURRENT_SOURCE_DIR}/xserver" "${CMAKE_CURRENT_SOURCE_DIR}/patches/xserver.patch")
 target_apply_patch(Xlorie "${CMAKE_CURRENT_SOURCE_DIR}/libepoxy" "${CMAKE_CURRENT_SOURCE_DIR}/patches/libepoxy.patch")
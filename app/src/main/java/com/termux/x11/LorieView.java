@@ -94,7 +94,7 @@ public class LorieView extends SurfaceView implements InputStub {
     private void init() {
         getHolder().addCallback(mSurfaceCallback);
         clipboard = (ClipboardManager) getContext().getSystemService(Context.CLIPBOARD_SERVICE);
-        nativeInit();
+        nativeInit(getContext().getCacheDir().getAbsolutePath());
     }
 
     public void setCallback(Callback callback) {
@@ -346,7 +346,7 @@ public class LorieView extends SurfaceView implements InputStub {
         }
     }
 
-    @FastNative private native void nativeInit();
+    @FastNative private native void nativeInit(String cacheDir);
     @FastNative private native void surfaceChanged(Surface surface);
     @FastNative static native void connect(int fd);
     @CriticalNative static native boolean connected();
@@ -358,6 +358,7 @@ public class LorieView extends SurfaceView implements InputStub {
     @FastNative public native void sendMouseEvent(float x, float y, int whichButton, boolean buttonDown, boolean relative);
     @FastNative public native void sendTouchEvent(int action, int id, int x, int y);
     @FastNative public native void sendStylusEvent(float x, float y, int pressure, int tiltX, int tiltY, int orientation, int buttons, boolean eraser, boolean mouseMode);
+    @FastNative public native void sendMotionBatch(int device, int buttons, boolean eraser, boolean mouseMode, long eventTime, int count, float[] samples);
     @FastNative static public native void requestStylusEnabled(boolean enabled);
     @FastNative public native boolean sendKeyEvent(int scanCode, int keyCode, boolean keyDown);
     @FastNative public native void sendTextEvent(byte[] text);
@@ -64,6 +64,10 @@ public final class InputEventSender {
         android.util.Log.d("STYLUS_EVENT", "transformed x " + x + " y " + y + " pressure " + pressure + " tiltX " + tiltX + " tiltY " + tiltY + " orientation " + orientation + " buttons " + buttons + " eraser " + eraser + " mouseMode " + mouse);
     }
 
+    public void sendMotionBatch(int device, int buttons, boolean eraser, boolean mouse, long eventTime, int count, float[] samples) {
+        mInjector.sendMotionBatch(device, buttons, eraser, mouse, eventTime, count, samples);
+    }
+
     public void sendMouseDown(int button, boolean relative) {
         if (!buttons.contains(button)) 
             return;
@@ -92,6 +96,7 @@ public final class InputEventSender {
     }
 
     final boolean[] pointers = new boolean[10];
+    private float[] motionSamples = new float[0];
     /**
      * Extracts the touch point data from a MotionEvent, converts each point into a marshallable
      * object and passes the set of points to the JNI layer to be transmitted to the remote host.
@@ -106,19 +111,35 @@ public final class InputEventSender {
         if (action == ACTION_MOVE || action == ACTION_HOVER_MOVE || action == ACTION_HOVER_ENTER || action == ACTION_HOVER_EXIT) {
             // In order to process all of the events associated with an ACTION_MOVE event, we need
             // to walk the list of historical events in order and add each event to our list, then
-            // retrieve the current move event data.
+            // retrieve the current move event data. All of them are sent with one call.
             int pointerCount = event.getPointerCount();
+            int historySize = event.getHistorySize();
+            long eventTime = event.getEventTime();
+            int count = 0;
+
+            if (motionSamples.length < (historySize + 1) * pointerCount * MOTION_SAMPLE_STRIDE)
+                motionSamples = new float[(historySize + 1) * pointerCount * MOTION_SAMPLE_STRIDE];
 
             for (int p = 0; p < pointerCount; p++)
                 pointers[event.getPointerId(p)] = false;
 
-            for (int p = 0; p < pointerCount; p++) {
-                int x = clamp((int) (event.getX(p) * renderData.scale.x), 0, renderData.screenWidth);
-                int y = clamp((int) (event.getY(p) * renderData.scale.y), 0, renderData.screenHeight);
-                pointers[event.getPointerId(p)] = true;
-                mInjector.sendTouchEvent(XI_TouchUpdate, event.getPointerId(p), x, y);
+            for (int h = 0; h <= historySize; h++) {
+                long time = h < historySize ? event.getHistoricalEventTime(h) : eventTime;
+                for (int p = 0; p < pointerCount; p++) {
+                    float x = h < historySize ? event.getHistoricalX(p, h) : event.getX(p);
+                    float y = h < historySize ? event.getHistoricalY(p, h) : event.getY(p);
+                    int i = count++ * MOTION_SAMPLE_STRIDE;
+                    motionSamples[i] = clamp((int) (x * renderData.scale.x), 0, renderData.screenWidth);
+                    motionSamples[i + 1] = clamp((int) (y * renderData.scale.y), 0, renderData.screenHeight);
+                    motionSamples[i + 2] = motionSamples[i + 3] = motionSamples[i + 4] = motionSamples[i + 5] = 0;
+                    motionSamples[i + 6] = event.getPointerId(p);
+                    motionSamples[i + 7] = time - eventTime;
+                    pointers[event.getPointerId(p)] = true;
+                }
             }
 
+            mInjector.sendMotionBatch(MOTION_TOUCH, 0, false, false, eventTime, count, motionSamples);
+
             // Sometimes Android does not send ACTION_POINTER_UP/ACTION_UP so some pointers are "stuck" in pressed state.
             for (int p = 0; p < 10; p++) {
                 if (!pointers[p])
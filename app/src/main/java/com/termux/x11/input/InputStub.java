@@ -42,4 +42,15 @@ public interface InputStub {
     void sendTouchEvent(int action, int pointerId, int x, int y);
 
     void sendStylusEvent(float x, float y, int pressure, int tiltX, int tiltY, int orientation, int buttons, boolean eraser, boolean mouseMode);
+
+    int MOTION_TOUCH = 0;
+    int MOTION_STYLUS = 1;
+    /** Every sample is x, y, pressure, tiltX, tiltY, orientation, pointerId and time relative to eventTime in milliseconds. */
+    int MOTION_SAMPLE_STRIDE = 8;
+
+    /**
+     * Sends batched motion samples (i.e. historical samples of a MotionEvent) of one device
+     * with one call. Touch samples are treated as XI_TouchUpdate.
+     */
+    void sendMotionBatch(int device, int buttons, boolean eraser, boolean mouseMode, long eventTime, int count, float[] samples);
 }
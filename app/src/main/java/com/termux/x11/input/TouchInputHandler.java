@@ -904,6 +904,43 @@ public class TouchInputHandler {
     private class StylusListener {
         private float x = 0, y = 0, pressure = 0, tilt = 0, orientation = 0;
         private int buttons = 0;
+        private float[] samples = new float[0];
+
+        private int tiltX(float orientation, float tilt) {
+            return (int) Math.round((float) Math.asin(-Math.sin(orientation) * Math.sin(tilt)) * 63.5 - 0.5);
+        }
+
+        private int tiltY(float orientation, float tilt) {
+            return (int) Math.round((float) Math.asin( Math.cos(orientation) * Math.sin(tilt)) * 63.5 - 0.5);
+        }
+
+        /**
+         * Sends historical samples and the current sample of the event with one call, with their event times.
+         * Buttons are applied to the current sample only, history was recorded before they changed.
+         */
+        private void sendSamples(MotionEvent e, float scaleX, float scaleY, boolean hasTilt, int newButtons) {
+            int historySize = e.getHistorySize(), p = e.getActionIndex();
+            if (samples.length < (historySize + 1) * InputStub.MOTION_SAMPLE_STRIDE)
+                samples = new float[(historySize + 1) * InputStub.MOTION_SAMPLE_STRIDE];
+
+            for (int h = 0; h <= historySize; h++) {
+                boolean current = h == historySize;
+                float o = current ? e.getAxisValue(MotionEvent.AXIS_ORIENTATION, p) : e.getHistoricalAxisValue(MotionEvent.AXIS_ORIENTATION, p, h);
+                float t = current ? e.getAxisValue(MotionEvent.AXIS_TILT, p) : e.getHistoricalAxisValue(MotionEvent.AXIS_TILT, p, h);
+                int i = h * InputStub.MOTION_SAMPLE_STRIDE;
+                samples[i] = (current ? e.getX(p) : e.getHistoricalX(p, h)) * scaleX;
+                samples[i + 1] = (current ? e.getY(p) : e.getHistoricalY(p, h)) * scaleY;
+                samples[i + 2] = (int) ((current ? e.getPressure(p) : e.getHistoricalPressure(p, h)) * 65535);
+                samples[i + 3] = hasTilt ? tiltX(o, t) : 0;
+                samples[i + 4] = hasTilt ? tiltY(o, t) : 0;
+                samples[i + 5] = convertOrientation(o);
+                samples[i + 6] = 0;
+                samples[i + 7] = current ? 0 : e.getHistoricalEventTime(h) - e.getEventTime();
+            }
+
+            mInjector.sendMotionBatch(InputStub.MOTION_STYLUS, newButtons, e.getToolType(p) == MotionEvent.TOOL_TYPE_ERASER,
+                    mInjector.stylusIsMouse, e.getEventTime(), historySize + 1, samples);
+        }
 
         private int convertOrientation(float value) {
             int newValue = (int) (((value * 180 / Math.PI) + 360) % 360);
@@ -942,9 +979,8 @@ public class TouchInputHandler {
         @SuppressLint("ClickableViewAccessibility")
         boolean onTouch(MotionEvent e) {
             int action = e.getAction();
-            int tiltX = 0, tiltY = 0;
             int newButtons = extractButtons(e);
-            float newX = e.getX(e.getActionIndex()), newY = e.getY(e.getActionIndex());
+            float newX = e.getX(e.getActionIndex()), newY = e.getY(e.getActionIndex()), scaleX, scaleY;
             InputDevice dev = e.getDevice();
             InputDevice.MotionRange rangeX = dev.getMotionRange(MotionEvent.AXIS_X);
             InputDevice.MotionRange rangeY = dev.getMotionRange(MotionEvent.AXIS_Y);
@@ -953,35 +989,27 @@ public class TouchInputHandler {
 
             if (MainActivity.getInstance().getLorieView().hasPointerCapture() &&
                     isExternal(dev) && rangeX != null && rangeY != null) {
-                newX *= mRenderData.imageWidth / rangeX.getMax();
-                newY *= mRenderData.imageHeight / rangeY.getMax();
+                scaleX = mRenderData.imageWidth / rangeX.getMax();
+                scaleY = mRenderData.imageHeight / rangeY.getMax();
             } else {
-                newX *= mRenderData.scale.x;
-                newY *= mRenderData.scale.y;
+                scaleX = mRenderData.scale.x;
+                scaleY = mRenderData.scale.y;
             }
+            newX *= scaleX;
+            newY *= scaleY;
 
-            if (x == newX && y == newY && pressure == e.getPressure() && tilt == e.getAxisValue(MotionEvent.AXIS_TILT) &&
+            if (e.getHistorySize() == 0 && x == newX && y == newY && pressure == e.getPressure() && tilt == e.getAxisValue(MotionEvent.AXIS_TILT) &&
                     orientation == e.getAxisValue(MotionEvent.AXIS_ORIENTATION) && buttons == newButtons)
                 return true;
 
-            if (hasTilt && hasOrientation) {
-                orientation = e.getAxisValue(MotionEvent.AXIS_ORIENTATION);
-                tilt = e.getAxisValue(MotionEvent.AXIS_TILT);
-                tiltX = (int) Math.round((float) Math.asin(-Math.sin(orientation) * Math.sin(tilt)) * 63.5 - 0.5);
-                tiltY = (int) Math.round((float) Math.asin( Math.cos(orientation) * Math.sin(tilt)) * 63.5 - 0.5);
-            }
-
             android.util.Log.d("STYLUS_EVENT", "action " + action + " x " + newX + " y " + newY + " pressure " + e.getPressure() + " tilt " + e.getAxisValue(MotionEvent.AXIS_TILT) + " orientation " + e.getAxisValue(MotionEvent.AXIS_ORIENTATION) + " buttonState " + e.getButtonState() + " extractedButtons " + newButtons);
-            mInjector.sendStylusEvent(
-                    x = newX,
-                    y = newY,
-                    (int) ((pressure = e.getPressure()) * 65535),
-                    tiltX,
-                    tiltY,
-                    convertOrientation(orientation),
-                    buttons = newButtons,
-                    e.getToolType(e.getActionIndex()) == MotionEvent.TOOL_TYPE_ERASER,
-                    mInjector.stylusIsMouse);
+            sendSamples(e, scaleX, scaleY, hasTilt && hasOrientation, newButtons);
+            x = newX;
+            y = newY;
+            pressure = e.getPressure();
+            tilt = e.getAxisValue(MotionEvent.AXIS_TILT);
+            orientation = e.getAxisValue(MotionEvent.AXIS_ORIENTATION);
+            buttons = newButtons;
 
             return true;
         }